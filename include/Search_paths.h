@@ -3,6 +3,17 @@
 
 #include "main_helpers.h"
 
+// Mission segment reported in SPI telemetry
+typedef enum {
+    SEGMENT_NONE,
+    SEGMENT_OUTSIDE_CAVE_1,
+    SEGMENT_INSIDE_CAVE,
+    SEGMENT_OUTSIDE_CAVE_2,
+    SEGMENT_OUTSIDE_CAVE_3,
+    SEGMENT_SHORT_SEARCH,
+    SEGMENT_SHIMMY
+} mission_segment_t;
+
 // Intial S sweep
 void Outside_Cave_Part_1();
 
@@ -0,0 +1,59 @@
+/**
+ * @file clock_sync.h
+ * @brief Offset between the Pi's clock and esp_timer, from SPI_RPC_CLOCK answers
+ *
+ * Each sample pairs the ESP32's time at the end of the transaction that
+ * carried a clock request with the Pi's time for the same instant (see
+ * spi_clock_sample_t). The Pi's timestamp is late by however long it took to
+ * get round to reading the transfer, which also delays its answer, so of the
+ * last few samples the one with the shortest round trip is trusted. Plain C
+ * with no ESP-IDF dependencies, like spi_protocol.h.
+ */
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLOCK_SYNC_WINDOW   8   // Samples the offset is picked from
+
+typedef struct {
+    int64_t offset_us;          // Pi clock minus esp_timer
+    uint32_t round_trip_us;     // From the request being clocked out to the answer arriving
+} clock_sync_sample_t;
+
+typedef struct {
+    clock_sync_sample_t samples[CLOCK_SYNC_WINDOW];
+    uint32_t count;             // Samples taken since the last reset
+    int64_t offset_us;          // From the best sample in the window
+    uint32_t uncertainty_us;    // Round trip of that sample, bounds the offset's error
+} clock_sync_t;
+
+void clock_sync_reset(clock_sync_t *sync);
+
+/**
+ * @brief Add a sample
+ *
+ * @param local_us esp_timer time the request was clocked out
+ * @param remote_us Pi time it read the request
+ * @param round_trip_us From local_us to the answer arriving
+ */
+void clock_sync_sample(clock_sync_t *sync, int64_t local_us, int64_t remote_us, uint32_t round_trip_us);
+
+/**
+ * @brief true once a sample has been taken
+ */
+bool clock_sync_ready(const clock_sync_t *sync);
+
+/**
+ * @brief Convert a Pi timestamp, as the low 32 bits of its microseconds, to esp_timer time
+ *
+ * The upper bits are taken from the Pi time closest to 'local_now_us', so the
+ * timestamp must be within half a wrap (about 35 minutes) of it.
+ *
+ * @return false until the first sample
+ */
+bool clock_sync_to_local(const clock_sync_t *sync, uint32_t remote_us, int64_t local_now_us, int64_t *local_us);
+
+#endif // CLOCK_SYNC_H
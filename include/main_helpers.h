@@ -8,9 +8,15 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "spi_secondary.h"
+#include "spi_rpc.h"
 #include "led.h"
 #include "math.h"
 #include "Search_paths.h"
+#include "vision_fields.h"
+
+// Vision rates per mission phase, see spi_secondary_request_vision; the field sets are in vision_fields.h
+#define VISION_RATE_ALIGN       0       // As fast as the link allows
+#define VISION_RATE_HEARTBEAT   2       // Enough to tell the Pi is alive while driving on encoders
 
 typedef struct {
     led_t headlight;
@@ -53,10 +59,21 @@ typedef enum {
  */
 int setup();
 
-void switch_pipeline(int new_pipeline);
+/**
+ * @brief Ask the Pi for a pipeline and wait for frames from it
+ *
+ * @return false if none came within PIPELINE_SWITCH_TIMEOUT_MS
+ */
+bool switch_pipeline(int new_pipeline);
 
 void full_motor_init();
 
+/**
+ * @brief Strafe, rotate and drive until square to a tag and at the given size
+ *
+ * @param desired_fid Tag to align to, -1 for whichever the Pi lists first; see get_fiducial_by_id
+ * @param ta_target Area the tag should fill when done, negative to skip driving to it
+ */
 void aprilTag_main(int desired_fid, double ta_target);
 
 void predetermined_test();
@@ -41,6 +41,7 @@
   * - pwm_pin: MCPWM output pin
   * - group_id: MCPWM group ID
   * - type: Motor type (DC or servo)
+  * - speed: Last speed commanded with dc_set_speed
   */
  typedef struct {
      mcpwm_timer_handle_t timer;      // MCPWM timer handle
@@ -52,6 +53,7 @@
      int timer_id;
      int oper_id;
      motor_type_t type;               // Motor type (DC or servo)
+     float speed;                     // Last commanded speed (-100 to 100)
  } motor_t;
 
 void init_motor_resources();
@@ -108,6 +110,34 @@ void init_motor_resources();
   * @param speed_scalar Scalar to scale the speed of the robot (0 to 100)
   */
  void perform_maneuver(motor_t *motors, maneuver_t maneuver, float speeds[4], float speed_scalar);
+
+ /**
+  * @brief Reasons the drive wheels are held stopped, see motor_hold
+  */
+ typedef enum {
+     MOTOR_HOLD_STOP = 1 << 0,   // Priority STOP from the Pi: every drive command waits, timed moves included
+     MOTOR_HOLD_LINK = 1 << 1    // Vision link lost: perform_maneuver waits, its drives end on what vision sees;
+                                 // timed moves go on, they only need the encoders or the clock
+ } motor_hold_t;
+
+ /**
+  * @brief Hold the drive wheels stopped, or let them go again
+  *
+  * While held, perform_maneuver only records what it was asked for, and timed
+  * moves (move_pid_time and the hardcoded ones) held by the reason stop their
+  * clock, so they still cover their full distance afterwards. Once the last hold ends, the last
+  * maneuver asked of perform_maneuver is put back on the wheels. Safe to call
+  * from any task.
+  *
+  * @param motors Array of 4 drive motors
+  * @param reason One motor_hold_t bit
+  */
+ void motor_hold(motor_t *motors, motor_hold_t reason, bool held);
+
+ /**
+  * @brief motor_hold_t bits currently set
+  */
+ uint32_t motor_holds();
  
  void outtake_dump(motor_t *outtakeMotor);
 
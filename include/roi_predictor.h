@@ -0,0 +1,62 @@
+/**
+ * @file roi_predictor.h
+ * @brief Predicts where a fiducial will be in the next frames, for spi_roi_hint_t
+ *
+ * The predictor is fed the corners of every frame that saw the tag and tracks
+ * the box center's velocity in the image. A prediction moves the last box by
+ * that velocity over the time since it was seen and pads it: more the faster
+ * the tag moves, and more in the direction the robot is moving. Plain C with
+ * no ESP-IDF dependencies, like spi_protocol.h.
+ */
+
+#ifndef ROI_PREDICTOR_H
+#define ROI_PREDICTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "spi_protocol.h"
+
+#define ROI_VELOCITY_ALPHA  0.5     // Weight of the newest velocity sample
+#define ROI_MARGIN          0.5     // Padding on each side, as a fraction of the box size
+#define ROI_MOTION_MARGIN   0.5     // Extra padding along the robot's motion
+#define ROI_MAX_LEAD_US     200000  // Velocity is not extrapolated further than this
+#define ROI_MAX_AGE_US      500000  // No hint once the tag has been out of view this long
+
+/**
+ * @brief How the robot is moving, which decides where the box is padded
+ */
+typedef enum {
+    ROI_MOTION_NONE,
+    ROI_MOTION_LATERAL,     // Strafing or rotating, the tag slides sideways
+    ROI_MOTION_APPROACH     // Driving forward or back, the tag grows or shrinks
+} roi_motion_t;
+
+typedef struct {
+    bool valid;             // A tag has been seen since the last reset
+    int fID;
+    double cx, cy;          // Box center, pixels
+    double w, h;            // Box size, pixels
+    double vx, vy;          // Center velocity, pixels per second
+    int64_t seen_us;        // Time of the last observation
+} roi_predictor_t;
+
+void roi_predictor_reset(roi_predictor_t *predictor);
+
+/**
+ * @brief Feed the corners of a frame that saw the tag
+ *
+ * @param pts Corner points in any order
+ * @param now_us Time the frame was captured, or arrived if that is unknown
+ */
+void roi_predictor_observe(roi_predictor_t *predictor, const double pts[4][2], int fID, int64_t now_us);
+
+/**
+ * @brief Predict the window for a frame captured at 'at_us'
+ *
+ * @param out seq is left for the caller to fill in
+ * @return false if the tag has not been seen recently enough to guess
+ */
+bool roi_predictor_predict(const roi_predictor_t *predictor, roi_motion_t motion, int64_t at_us,
+                           spi_roi_hint_t *out);
+
+#endif // ROI_PREDICTOR_H
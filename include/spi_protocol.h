@@ -0,0 +1,689 @@
+/**
+ * @file spi_protocol.h
+ * @brief Wire formats shared by the Raspberry Pi and the ESP32 on the SPI link
+ *
+ * Everything in this file is plain C with no ESP-IDF dependencies so the same
+ * encoders/decoders can be compiled for the Pi side or a host test program.
+ * All multi-byte fields are little-endian (native on both the ESP32 and the Pi).
+ */
+
+#ifndef SPI_PROTOCOL_H
+#define SPI_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vision_schema.h"
+
+#define SPI_CHUNK_SIZE 64  // Bytes per SPI transaction, must match CHUNK_SIZE
+
+/* Message type prefixes (first byte of a message) */
+#define SPI_MSG_JSON        'J'     // Vision JSON document, may span several chunks
+#define SPI_MSG_TEXT        'M'     // Plain text message
+#define SPI_MSG_BINARY      'B'     // Fixed-layout binary vision frame, always a single chunk
+#define SPI_MSG_TELEMETRY   'T'     // ESP32 state snapshot sent on MISO instead of "ACK"
+#define SPI_MSG_RPC         'R'     // Answer to a request the ESP32 made, see spi_rpc.h
+#define SPI_MSG_STATS       'S'     // Master asks for link statistics; the ESP32 answers with spi_stats_page_t
+#define SPI_MSG_DELTA       'D'     // Vision frame carrying only the fields that changed, always a single chunk
+#define SPI_MSG_PRIORITY    '!'     // spi_priority_t, handled ahead of everything else
+
+#define SPI_FRAME_MAGIC     0xA5    // First byte of a framed message, never valid in JSON text
+// First byte of a priority chunk. It never occurs in UTF-8, and only text
+// messages continue into another chunk, so no other chunk can start with it
+#define SPI_PRIORITY_MAGIC  0xFE
+
+#define VISION_BIN_VERSION      2       // 2 added capture_us
+#define VISION_BIN_PTS_SCALE    4.0 // Corner points are sent in quarter pixels
+#define SPI_TELEMETRY_VERSION   1
+#define SPI_STATS_VERSION       1
+#define SPI_PROTOCOL_VERSION    1       // Bumped when the meaning of an existing message changes
+
+#define VISION_DELTA_KEYFRAME_INTERVAL  30      // The Pi sends a keyframe at least this often
+#define VISION_DELTA_KEYFRAME_REQUEST   "K"     // Command the ESP32 sends when it lost the delta chain
+#define SPI_ROI_HINT_PREFIX             'W'     // First byte of a spi_roi_hint_t command
+
+#define SPI_STATS_HIST_BINS         8
+#define SPI_STATS_SIZE_BIN_BYTES    64      // Frame size bin i counts frames up to 64 << i bytes
+#define SPI_STATS_INTERVAL_BIN_US   1000    // Interval bin i counts gaps up to 1 ms << i
+#define SPI_STATS_PRIORITY_BIN_US   50      // Priority latency bin i counts latencies up to 50 us << i
+#define SPI_STATS_LATENCY_BIN_US    1000    // Frame latency bin i counts latencies up to 1 ms << i
+#define SPI_STATS_PARSE_BIN_US      50      // Parse latency bin i counts latencies up to 50 us << i
+
+/**
+ * @brief Header that prefixes a message when the master frames it
+ *
+ * The header starts the first chunk of a message; the message itself (type
+ * byte included) follows immediately and continues in the next chunks.
+ * Because the length is known, a framed message does not need <END>.
+ * check is the low byte of spi_crc16 over the bytes before it.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;             // SPI_FRAME_MAGIC
+    uint16_t seq;               // Incremented by one per message
+    uint16_t length;            // Message bytes after the header
+    uint8_t  check;
+} spi_frame_header_t;
+
+#define SPI_FRAME_HEADER_SIZE sizeof(spi_frame_header_t)
+
+/**
+ * @brief Commands carried by a priority chunk
+ */
+typedef enum {
+    SPI_PRIORITY_STOP = 1,      // Stop the drive motors and hold them until released
+    SPI_PRIORITY_RELEASE        // Let the mission code drive again
+} spi_priority_command_t;
+
+/**
+ * @brief Emergency or control command that skips frame assembly
+ *
+ * Always a chunk of its own, zero padded. The master may send it at any time,
+ * including between two chunks of a frame: the receiver acts on it as soon as
+ * the transaction ends and leaves the frame around it intact. A command is
+ * repeated with the same seq until the master sees it took effect; the
+ * receiver acts once per seq, and forgets the last seq after a handshake or
+ * a link loss, when the master may have restarted its count. crc is spi_crc16 over every byte before it.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  magic;             // SPI_PRIORITY_MAGIC
+    uint8_t  type;              // SPI_MSG_PRIORITY
+    uint8_t  command;           // spi_priority_command_t
+    uint8_t  arg;
+    uint16_t seq;
+    uint16_t crc;
+} spi_priority_t;
+
+/**
+ * @brief Optional protocol features, exchanged during the handshake
+ */
+typedef enum {
+    SPI_CAP_BINARY      = 1 << 0,   // Vision frames as vision_frame_bin_t instead of JSON
+    SPI_CAP_FRAMED      = 1 << 1,   // Messages prefixed by spi_frame_header_t
+    SPI_CAP_TELEMETRY   = 1 << 2,   // spi_telemetry_t in idle MISO chunks
+    SPI_CAP_STATS       = 1 << 3,   // SPI_MSG_STATS requests
+    SPI_CAP_DELTA       = 1 << 4,   // SPI_MSG_DELTA vision frames
+    SPI_CAP_VISION_RATE = 1 << 5,   // The ESP32 sets the vision rate and fields, see spi_vision_profile_t
+    SPI_CAP_ROI_HINT    = 1 << 6,   // The ESP32 sends spi_roi_hint_t windows to crop detection to
+    SPI_CAP_CLOCK_SYNC  = 1 << 7,   // Frames carry their capture time and the ESP32 syncs to the Pi's clock
+    SPI_CAP_SUBSCRIBE   = 1 << 8    // The ESP32 lists the fields it reads per pipeline, see spi_vision_subscription_t
+} spi_capability_t;
+
+/**
+ * @brief What one side of the link supports, or what both agreed on
+ *
+ * Sent as text in the handshake, "v<version> c<caps in hex> k<chunk size> r<frames per second>".
+ * Each side negotiates with spi_link_negotiate on the same two inputs so both
+ * end up in the same mode without another round trip. A side that does not
+ * answer the handshake is treated as version 0 with no capabilities: plain
+ * JSON ended by <END>.
+ */
+typedef struct {
+    uint8_t  version;
+    uint32_t caps;              // spi_capability_t bits
+    uint16_t chunk_size;
+    uint16_t frame_rate;        // Highest vision frame rate wanted or offered, 0 for no limit
+} spi_link_caps_t;
+
+/**
+ * @brief Vision rate and fields the ESP32 wants for the current mission phase
+ *
+ * Sent as text, "r<frames per second> f<vision_field_t bits in hex>". Rate 0
+ * means as fast as the link agreed on. Fields left out of the set may be
+ * omitted from frames or sent stale; the Pi should also skip work that only
+ * feeds them.
+ */
+typedef struct {
+    uint16_t rate;
+    uint32_t fields;            // vision_field_t bits
+} spi_vision_profile_t;
+
+/**
+ * @brief Fields the ESP32 reads from one pipeline's frames
+ *
+ * Sent as text after the handshake, one SPI_RPC_SUBSCRIBE call per pipeline:
+ * "p<pipeline> f<vision_field_t bits in hex>". Frames from a subscribed
+ * pipeline carry only its fields that are also in the current vision
+ * profile: JSON leaves the other members out and deltas never send them,
+ * keyframes included. Binary frames have a fixed layout and are unaffected.
+ * Pipelines without a subscription send every field.
+ */
+typedef struct {
+    uint8_t  pipeline;
+    uint32_t fields;            // vision_field_t bits
+} spi_vision_subscription_t;
+
+/**
+ * @brief Answer to a clock sync request
+ *
+ * The ESP32 sends SPI_RPC_CLOCK without arguments; the Pi answers with the
+ * time on its clock, in microseconds, at which it read the request off MISO:
+ * "t<microseconds>". That is the end of the transaction that carried the
+ * request, an instant the ESP32 timestamps too, so the pair gives the offset
+ * between the clocks without assuming the two directions take equally long.
+ * Capture times in vision frames are on the same clock.
+ */
+typedef struct {
+    uint64_t pi_us;
+} spi_clock_sample_t;
+
+/**
+ * @brief Window the ESP32 expects the tag in for the next frames
+ *
+ * Sent as a command, "W<seq> x<x> y<y> w<width> h<height> i<fID>", in the
+ * same pixel coordinates as the corner points. The window may reach past the
+ * image edges; the Pi clips it. A Pi that finds nothing inside the window
+ * should fall back to the full image.
+ */
+typedef struct {
+    uint16_t seq;               // Incremented per hint so the Pi can drop stale ones
+    int16_t  x, y;              // Top left corner
+    uint16_t w, h;
+    int16_t  fID;               // Tag expected in the window, -1 for any
+} spi_roi_hint_t;
+
+/**
+ * @brief Which pipeline result a vision frame describes
+ */
+typedef enum {
+    VISION_TARGET_NONE = 0,
+#define X(NAME, name, key) VISION_TARGET_##NAME,
+    VISION_SCHEMA_TARGETS(X)
+#undef X
+    VISION_TARGET_COUNT         // One past the last, NONE included
+} vision_target_t;
+
+/**
+ * @brief Binary vision frame as it appears on the wire
+ *
+ * The whole frame fits in one SPI chunk so it never needs reassembly.
+ * crc is CRC-16/CCITT-FALSE over every byte before it.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  type;              // SPI_MSG_BINARY
+    uint8_t  version;           // VISION_BIN_VERSION
+    uint8_t  target;            // vision_target_t
+    uint8_t  pID;               // Active pipeline index
+    uint8_t  v;                 // 1 if a target is in view
+    uint8_t  reserved;
+    int16_t  fID;               // Fiducial ID, -1 for retro targets
+    uint32_t capture_us;        // Pi clock when the image was taken, low 32 bits, 0 if unknown
+#define X(NAME, name, key) float name;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    int16_t  pts[4][2];         // bottom left, bottom right, top right, top left
+    uint16_t crc;
+} vision_frame_bin_t;
+
+_Static_assert(sizeof(vision_frame_bin_t) <= SPI_CHUNK_SIZE, "binary vision frame must fit in one chunk");
+
+/**
+ * @brief Decoded vision frame
+ */
+typedef struct {
+    vision_target_t target;
+    int pID;
+    int v;
+    int fID;
+    uint32_t capture_us;        // Pi clock when the image was taken, low 32 bits, 0 if unknown
+#define X(NAME, name, key) double name;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    double pts[4][2];
+    uint32_t valid;             // vision_field_t bits the Pi sent, the others are 0
+} vision_frame_t;
+
+/**
+ * @brief Fields of a delta frame, in the order they appear on the wire
+ *
+ * Field sizes match vision_frame_bin_t: target, pID and v are one byte, fID
+ * is int16, the metrics are floats and each corner is two int16 quarter pixels.
+ */
+typedef enum {
+    VISION_FIELD_TARGET = 0,
+    VISION_FIELD_PID,
+    VISION_FIELD_V,
+    VISION_FIELD_FID,
+#define X(NAME, name, key) VISION_FIELD_##NAME,
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    VISION_FIELD_PT0,           // bottom left
+    VISION_FIELD_PT1,           // bottom right
+    VISION_FIELD_PT2,           // top right
+    VISION_FIELD_PT3,           // top left
+    VISION_FIELD_COUNT
+} vision_field_t;
+
+#define VISION_FIELDS_ALL   ((1u << VISION_FIELD_COUNT) - 1)
+#define VISION_METRIC_COUNT (VISION_FIELD_PT0 - VISION_FIELD_TA)
+
+#define VISION_MAX_TAGS     8   // Fiducials kept per frame, a power of two; more are left out
+
+/**
+ * @brief Every fiducial a frame saw, looked up by fID
+ *
+ * Open addressing: a tag sits in slot fID % VISION_MAX_TAGS or the first free
+ * one after it, so a lookup reads one slot unless two tags in the frame
+ * share it. Each slot holds the tag's own members (fID, the metrics and its
+ * corners) with target set; empty slots have valid == 0.
+ */
+typedef struct {
+    uint8_t count;
+    vision_frame_t slots[VISION_MAX_TAGS];
+} vision_tags_t;
+
+_Static_assert((VISION_MAX_TAGS & (VISION_MAX_TAGS - 1)) == 0, "VISION_MAX_TAGS must be a power of two");
+
+#define VISION_JSON_MAX_DEPTH   32  // Nesting a JSON vision document may have
+#define VISION_JSON_NUMBER_LEN  40  // Longest number in one that is converted
+#define VISION_JSON_KEY_LEN     12  // Longest key in one that is recognised
+
+/**
+ * @brief Start of a delta frame, followed by the fields in mask and a crc16
+ *
+ * A delta applies to the state left by frame seq - back. A keyframe carries
+ * every subscribed field (every field without a subscription) and replaces
+ * the state whatever it was; fields it leaves out read as 0. crc covers every byte
+ * before it. A full keyframe with a framing header exactly fills one chunk.
+ * With VISION_DELTA_FLAG_CAPTURE the frame's capture_us follows the header,
+ * before the fields; it is not part of the state and is left out whenever it
+ * would make the frame overflow its chunk.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  type;              // SPI_MSG_DELTA
+    uint8_t  flags;             // VISION_DELTA_FLAG_*
+    uint16_t seq;
+    uint8_t  back;              // Distance to the base frame, 0 for keyframes
+    uint16_t mask;              // vision_field_t bits present
+} vision_delta_header_t;
+
+#define VISION_DELTA_FLAG_KEYFRAME  0x01
+#define VISION_DELTA_FLAG_CAPTURE   0x02
+#define VISION_DELTA_MAX_SIZE       (sizeof(vision_delta_header_t) + 3 + 2 + VISION_METRIC_COUNT * 4 + 4 * 4 + 2)
+
+_Static_assert(VISION_DELTA_MAX_SIZE <= SPI_CHUNK_SIZE - sizeof(spi_frame_header_t),
+               "keyframe must fit in one framed chunk");
+_Static_assert(VISION_FIELD_COUNT <= 16, "delta mask is 16 bits");
+
+typedef enum {
+    VISION_DELTA_APPLIED,
+    VISION_DELTA_KEYFRAME,
+    VISION_DELTA_STALE,         // Base frame is not the one the state holds, wait for a keyframe
+    VISION_DELTA_INVALID
+} vision_delta_result_t;
+
+/**
+ * @brief ESP32 telemetry snapshot, sent on MISO when no command is pending
+ *
+ * Wheel order for encoders and duty is front right, front left, back right,
+ * back left. crc is spi_crc16 over every byte before it.
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  type;              // SPI_MSG_TELEMETRY
+    uint8_t  version;           // SPI_TELEMETRY_VERSION
+    uint8_t  segment;           // Mission segment set by the mission code
+    uint8_t  flags;             // SPI_TELEMETRY_FLAG_*
+    uint16_t seq;               // Incremented per snapshot so the Pi can spot gaps
+    uint32_t timestamp_us;      // esp_timer_get_time, low 32 bits
+    int16_t  encoders[4];       // Raw encoder counts
+    int8_t   duty[4];           // Last commanded wheel speed, -100 to 100
+    uint32_t free_heap;
+    uint32_t min_free_heap;     // Lowest free heap since boot
+    uint16_t spi_stack_free;    // Stack high water marks, in bytes
+    uint16_t main_stack_free;
+    uint16_t crc;
+} spi_telemetry_t;
+
+#define SPI_TELEMETRY_FLAG_LINK_LOST    0x01    // No vision frame within the link timeout, see MOTOR_HOLD_LINK
+#define SPI_TELEMETRY_FLAG_STOP_HELD    0x02    // A priority STOP is in force
+
+_Static_assert(sizeof(spi_telemetry_t) <= SPI_CHUNK_SIZE, "telemetry must fit in one chunk");
+
+/**
+ * @brief Pages of link statistics, sent in turn after a SPI_MSG_STATS request
+ */
+typedef enum {
+    SPI_STATS_PAGE_COUNTERS = 0,    // values indexed by spi_stat_id_t
+    SPI_STATS_PAGE_FRAME_SIZE,      // values[0..SPI_STATS_HIST_BINS) is the frame size histogram
+    SPI_STATS_PAGE_INTERVAL,        // values[0..SPI_STATS_HIST_BINS) is the inter-frame interval histogram
+    SPI_STATS_PAGE_PRIORITY,        // values indexed by spi_priority_stat_id_t
+    SPI_STATS_PAGE_RECEIVE_LATENCY, // Capture to the last chunk arriving, values indexed by spi_latency_stat_id_t
+    SPI_STATS_PAGE_PARSE_LATENCY,   // Last chunk to the frame being readable, mutex wait included
+    SPI_STATS_PAGE_CONSUME_LATENCY, // Frame readable to the mission code first reading it
+    SPI_STATS_PAGE_FRAME_AGE,       // Capture to the mission code first reading the frame
+    SPI_STATS_PAGE_COUNT
+} spi_stats_page_id_t;
+
+typedef enum {
+    SPI_STAT_CHUNKS = 0,
+    SPI_STAT_FRAMES,
+    SPI_STAT_BYTES,
+    SPI_STAT_CHUNKS_PER_S,
+    SPI_STAT_FRAMES_PER_S,
+    SPI_STAT_BYTES_PER_S,
+    SPI_STAT_PARSE_FAILURES,
+    SPI_STAT_MUTEX_TIMEOUTS,
+    SPI_STAT_SPI_TIMEOUTS,
+    SPI_STAT_OVERRUNS,
+    SPI_STAT_FRAMES_DROPPED,
+    SPI_STAT_RESYNCS,
+    SPI_STAT_MAX_PROCESS_US,
+    SPI_STAT_COUNT
+} spi_stat_id_t;
+
+typedef enum {
+    SPI_PRIORITY_STAT_HIST = 0,     // SPI_STATS_HIST_BINS bins of latency, SPI_STATS_PRIORITY_BIN_US
+    SPI_PRIORITY_STAT_COMMANDS = SPI_STATS_HIST_BINS,
+    SPI_PRIORITY_STAT_MAX_US,
+    SPI_PRIORITY_STAT_COUNT
+} spi_priority_stat_id_t;
+
+/**
+ * @brief Values of the latency pages
+ *
+ * The parse page bins by SPI_STATS_PARSE_BIN_US, the others by
+ * SPI_STATS_LATENCY_BIN_US. Latencies measured from capture only count frames
+ * that carried a capture time while the ESP32's clock was synced.
+ */
+typedef enum {
+    SPI_LATENCY_STAT_HIST = 0,
+    SPI_LATENCY_STAT_FRAMES = SPI_STATS_HIST_BINS,
+    SPI_LATENCY_STAT_LAST_US,
+    SPI_LATENCY_STAT_MAX_US,
+    SPI_LATENCY_STAT_COUNT
+} spi_latency_stat_id_t;
+
+/**
+ * @brief One page of link statistics on MISO, crc is spi_crc16 over every byte before it
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t  type;              // SPI_MSG_STATS
+    uint8_t  version;           // SPI_STATS_VERSION
+    uint8_t  page;              // spi_stats_page_id_t
+    uint8_t  reserved;
+    uint32_t values[SPI_STAT_COUNT];
+    uint16_t crc;
+} spi_stats_page_t;
+
+_Static_assert(sizeof(spi_stats_page_t) <= SPI_CHUNK_SIZE, "stats page must fit in one chunk");
+_Static_assert((int)SPI_PRIORITY_STAT_COUNT <= (int)SPI_STAT_COUNT, "priority stats must fit in a stats page");
+_Static_assert((int)SPI_LATENCY_STAT_COUNT <= (int)SPI_STAT_COUNT, "latency stats must fit in a stats page");
+_Static_assert(SPI_STATS_PAGE_COUNT <= 8, "pending stats pages are kept in a byte");
+
+/**
+ * @brief CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF)
+ */
+uint16_t spi_crc16(const uint8_t *data, size_t len);
+
+/**
+ * @brief Parse and validate a frame header at the start of a chunk
+ *
+ * @return true if buf starts with a well-formed header
+ */
+bool spi_frame_header_decode(const uint8_t *buf, size_t len, spi_frame_header_t *out);
+
+/**
+ * @brief Write a frame header for a message of 'length' bytes
+ *
+ * @return Number of bytes written, 0 if buf is too small
+ */
+size_t spi_frame_header_encode(uint16_t seq, uint16_t length, uint8_t *buf, size_t len);
+
+/**
+ * @brief Write a zero-padded priority chunk
+ *
+ * @return Number of bytes written (len), 0 if buf is too small
+ */
+size_t spi_priority_encode(spi_priority_command_t command, uint8_t arg, uint16_t seq, uint8_t *buf, size_t len);
+
+/**
+ * @brief Recognise a priority chunk
+ *
+ * @param len Bytes of buf to check; everything after the command must be zero
+ * @param out Decoded command, may be NULL to only test the chunk
+ */
+bool spi_priority_decode(const uint8_t *buf, size_t len, spi_priority_t *out);
+
+/**
+ * @brief Decode a binary vision frame without allocating
+ *
+ * @param buf Received chunk, starting with SPI_MSG_BINARY
+ * @param len Number of valid bytes in buf
+ * @param out Decoded frame, only written on success
+ * @return true if the version and CRC checked out
+ */
+bool vision_frame_decode_binary(const uint8_t *buf, size_t len, vision_frame_t *out);
+
+/**
+ * @brief Decode a JSON vision document in place, without allocating
+ *
+ * The target is the first entry of the pipeline listed first in
+ * VISION_SCHEMA_TARGETS that the document has, so "Fiducial" before "Retro";
+ * "ts" is the capture time. Keys are matched exactly and everything else in the document
+ * is only checked for well-formedness. Members that are missing or not
+ * numbers are left out of out->valid, as are corners that are not two numbers.
+ *
+ * @param json Document text; it need not be terminated
+ * @param len Length of the document, anything after its closing brace is ignored
+ * @param out Decoded frame, only written on success
+ * @return false if the document is not well-formed JSON
+ */
+bool vision_frame_decode_json(const char *json, size_t len, vision_frame_t *out);
+
+/**
+ * @brief Whether two frames hold the same members, bit for bit; padding is not compared
+ */
+bool vision_frame_equal(const vision_frame_t *a, const vision_frame_t *b);
+
+/**
+ * @brief Add a fiducial to a table, see vision_tags_t
+ *
+ * @return false if it has no fID, the table is full, or already has the tag;
+ *         the entry added first stays
+ */
+bool vision_tags_add(vision_tags_t *tags, const vision_frame_t *tag);
+
+/**
+ * @return The slot holding tag 'fID', NULL if the frame did not see it
+ */
+const vision_frame_t *vision_tags_find(const vision_tags_t *tags, int fID);
+
+/**
+ * @brief vision_frame_decode_json for a document that arrives in pieces
+ *
+ * Holds everything the decoder needs between pieces, including a key or a
+ * number cut in two, so nothing fed to it has to be kept. The members are
+ * private to spi_protocol.c.
+ */
+typedef struct {
+    uint8_t state;
+    uint8_t token;
+    uint8_t depth;              // Open containers
+    uint8_t skip_depth;         // Depth of the outermost container being stepped over, 0 if none
+    uint32_t objects;           // Bit per open container, set for objects, innermost in bit 0
+    uint8_t entries[6];         // Index of the current entry of each array read into, by depth
+    uint8_t key;                // Last key of the innermost object read into
+    uint8_t slot;               // Where the number being read goes
+    uint8_t number_state;
+    uint8_t target;             // vision_target_t of the pipeline being read, minus one
+    bool escape;
+    bool have_target[VISION_TARGET_COUNT - 1];
+    uint8_t xy_numbers;         // Numbers in the corner being read
+    uint8_t text_len;
+    char text[VISION_JSON_NUMBER_LEN + 1];  // Key or number being read
+    const char *literal;        // Rest of the true, false or null being read
+    double xy[2];
+    vision_frame_t frame;       // Members of the document itself
+    vision_frame_t targets[VISION_TARGET_COUNT - 1];  // Members of the first entry of each pipeline
+    vision_frame_t entry;       // Members of the pipeline entry being read
+    vision_tags_t tags;         // Every "Fiducial" entry with an fID, complete once finish succeeds
+} vision_json_stream_t;
+
+/**
+ * @brief Start decoding a document
+ */
+void vision_json_stream_begin(vision_json_stream_t *stream);
+
+/**
+ * @brief Decode the next piece of a document
+ *
+ * Pieces may split the document anywhere. Bytes after its closing brace are ignored.
+ * A pID, v or fID outside int's range, or a ts past 64 bits, makes it malformed.
+ *
+ * @return false once the document is malformed; feeding it more does nothing
+ */
+bool vision_json_stream_feed(vision_json_stream_t *stream, const char *data, size_t len);
+
+/**
+ * @brief The frame decoded once the whole document has been fed
+ *
+ * @return false if the document is malformed or not complete yet
+ */
+bool vision_json_stream_finish(const vision_json_stream_t *stream, vision_frame_t *out);
+
+/**
+ * @brief Encode a vision frame into its binary wire form (used by the Pi side and host tools)
+ *
+ * @return Number of bytes written, 0 if buf is too small
+ */
+size_t vision_frame_encode_binary(const vision_frame_t *frame, uint8_t *buf, size_t len);
+
+/**
+ * @brief Encode the fields of 'frame' that differ from what the receiver holds
+ *
+ * @param reference Receiver's state after frame seq - 1, updated to its state after this one
+ * @param tolerance Metric changes smaller than this are not sent
+ * @param keyframe Send every field in 'fields' regardless of reference
+ * @param fields vision_field_t bits the receiver reads, the others are never sent
+ * @param len Room in buf; the capture time is only sent if the frame still fits
+ * @return Number of bytes written, 0 if buf is too small
+ */
+size_t vision_frame_encode_delta(const vision_frame_t *frame, vision_frame_t *reference, uint16_t seq,
+                                 bool keyframe, double tolerance, uint32_t fields, uint8_t *buf, size_t len);
+
+/**
+ * @brief Merge a delta frame into the receiver's state
+ *
+ * @param state Current state, only changed when the delta applies
+ * @param seq Sequence number the state is at, updated on success
+ * @param have_state false until a keyframe has been applied
+ * @param fields vision_field_t bits the sender encodes now; a field it stopped sending
+ *               is dropped from state->valid rather than kept at its last value
+ *
+ * A keyframe replaces the state, valid bits included. The state's capture_us
+ * is set from the delta, 0 if it carried none.
+ */
+vision_delta_result_t vision_frame_apply_delta(const uint8_t *buf, size_t len, vision_frame_t *state,
+                                               uint16_t *seq, bool have_state, uint32_t fields);
+
+/**
+ * @brief Fill in the type, version and crc of a telemetry snapshot
+ */
+void spi_telemetry_seal(spi_telemetry_t *telemetry);
+
+/**
+ * @brief Validate and copy out a telemetry snapshot received on MISO
+ */
+bool spi_telemetry_decode(const uint8_t *buf, size_t len, spi_telemetry_t *out);
+
+/**
+ * @brief Write the handshake text for a set of capabilities
+ *
+ * @return Length written, 0 if buf is too small
+ */
+size_t spi_link_caps_format(const spi_link_caps_t *caps, char *buf, size_t len);
+
+/**
+ * @brief Parse handshake text written by spi_link_caps_format
+ */
+bool spi_link_caps_parse(const char *text, spi_link_caps_t *out);
+
+/**
+ * @brief Pick the fastest mode both sides support
+ *
+ * Capabilities are only kept if both sides have them and the chunk sizes
+ * match; otherwise the link stays on JSON.
+ */
+void spi_link_negotiate(const spi_link_caps_t *local, const spi_link_caps_t *peer, spi_link_caps_t *out);
+
+/**
+ * @brief Write the text for a vision profile
+ *
+ * @return Length written, 0 if buf is too small
+ */
+size_t spi_vision_profile_format(const spi_vision_profile_t *profile, char *buf, size_t len);
+
+/**
+ * @brief Parse text written by spi_vision_profile_format
+ */
+bool spi_vision_profile_parse(const char *text, spi_vision_profile_t *out);
+
+/**
+ * @brief Write the text for a subscription
+ *
+ * @return Length written, 0 if buf is too small
+ */
+size_t spi_vision_subscription_format(const spi_vision_subscription_t *subscription, char *buf, size_t len);
+
+/**
+ * @brief Parse text written by spi_vision_subscription_format
+ */
+bool spi_vision_subscription_parse(const char *text, spi_vision_subscription_t *out);
+
+/**
+ * @brief Write the answer to a clock sync request
+ *
+ * @return Length written, 0 if buf is too small
+ */
+size_t spi_clock_sample_format(const spi_clock_sample_t *sample, char *buf, size_t len);
+
+/**
+ * @brief Parse an answer written by spi_clock_sample_format
+ */
+bool spi_clock_sample_parse(const char *text, spi_clock_sample_t *out);
+
+/**
+ * @brief Write the command text for an ROI hint
+ *
+ * @return Length written, 0 if buf is too small
+ */
+size_t spi_roi_hint_format(const spi_roi_hint_t *hint, char *buf, size_t len);
+
+/**
+ * @brief Parse a command written by spi_roi_hint_format
+ */
+bool spi_roi_hint_parse(const char *text, spi_roi_hint_t *out);
+
+/**
+ * @brief Write a received message as one line of a capture file
+ *
+ * Binary and delta frames are their type letter followed by the rest of the
+ * message in hex; every other message is written as is, so J documents stay
+ * readable. No newline is added.
+ *
+ * @return Length written, 0 if buf is too small or a text message holds a
+ *         line break or a NUL
+ */
+size_t spi_capture_format(const uint8_t *message, size_t len, char *buf, size_t buf_len);
+
+/**
+ * @brief Turn a line written by spi_capture_format back into the message
+ *
+ * The line ends at its terminator or at a line break. The message is
+ * NUL-terminated as process_received_data wants it; the terminator is not
+ * counted in the length.
+ *
+ * @return Length of the message, 0 if the line is malformed or buf is too small
+ */
+size_t spi_capture_parse(const char *line, uint8_t *buf, size_t len);
+
+/**
+ * @brief Histogram bin for a value, bin edges double from first_edge and the last bin is open
+ */
+uint8_t spi_stats_bin(uint32_t value, uint32_t first_edge);
+
+void spi_stats_page_seal(spi_stats_page_t *page);
+
+bool spi_stats_page_decode(const uint8_t *buf, size_t len, spi_stats_page_t *out);
+
+#endif // SPI_PROTOCOL_H
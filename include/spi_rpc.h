@@ -0,0 +1,123 @@
+/**
+ * @file spi_rpc.h
+ * @brief Request/response calls to the Raspberry Pi over the SPI link
+ *
+ * Requests ride on MISO like any other command, as text:
+ *      R<id> <method>[ <args>]
+ * The Pi answers with a message of type SPI_MSG_RPC on MOSI:
+ *      R<id> <status>[ <payload>]
+ * where status 0 means success. The SPI task loads requests into outgoing
+ * transactions and resends them when a delivered request goes unanswered, so
+ * callers never have to loop on send_message themselves.
+ */
+
+#ifndef SPI_RPC_H
+#define SPI_RPC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define SPI_RPC_MAX_PENDING     4       // Calls in flight at once
+#define SPI_RPC_ARGS_LEN        40
+#define SPI_RPC_PAYLOAD_LEN     48
+#define SPI_RPC_RETRY_MS        50      // Resend if a delivered request has no answer after this long
+#define SPI_RPC_MAX_ATTEMPTS    5
+
+/**
+ * @brief Methods the Pi understands
+ */
+typedef enum {
+    SPI_RPC_HANDSHAKE = 'H',    // args and answer: spi_link_caps_format text
+    SPI_RPC_PIPELINE  = 'P',    // args: pipeline index, answered once the pipeline is running
+    SPI_RPC_VISION    = 'V',    // args: spi_vision_profile_format text, answered once the Pi applied it
+    SPI_RPC_CLOCK     = 'C',    // no args, answered with spi_clock_sample_format text
+    SPI_RPC_SUBSCRIBE = 'S'     // args: spi_vision_subscription_format text
+} spi_rpc_method_t;
+
+typedef enum {
+    SPI_RPC_PENDING,
+    SPI_RPC_OK,
+    SPI_RPC_ERROR,              // The Pi answered with a non-zero status
+    SPI_RPC_TIMEOUT,
+    SPI_RPC_NO_SLOT             // Too many calls in flight
+} spi_rpc_status_t;
+
+/**
+ * @brief Completion callback
+ *
+ * @param delivered_us esp_timer time the answered request was clocked out, 0 if it
+ *                     went out more than once and the answer may be to any copy
+ */
+typedef void (*spi_rpc_callback_t)(uint16_t id, spi_rpc_status_t status, const char *payload,
+                                   int64_t delivered_us, void *arg);
+
+typedef struct {
+    uint32_t calls;
+    uint32_t ok;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t retries;               // Requests sent more than once
+    uint32_t last_latency_us;       // From the call to its answer
+    uint32_t max_latency_us;
+    uint64_t total_latency_us;      // Sum over successful calls
+    uint32_t last_round_trip_us;    // From delivery of the answered request to the answer
+} spi_rpc_stats_t;
+
+/**
+ * @brief Create the lock guarding the call table, called by spi_secondary_init
+ */
+void spi_rpc_init();
+
+/**
+ * @brief Start a call without blocking
+ *
+ * @param callback Run from the SPI task when the call completes, may be NULL
+ * @return Call ID, 0 if no slot was free
+ */
+uint16_t spi_rpc_call(spi_rpc_method_t method, const char *args, spi_rpc_callback_t callback, void *arg);
+
+/**
+ * @brief Make a call and block until it completes
+ *
+ * @param payload Receives the answer's payload, may be NULL
+ */
+spi_rpc_status_t spi_rpc_call_wait(spi_rpc_method_t method, const char *args,
+                                   char *payload, size_t payload_len, TickType_t timeout);
+
+/**
+ * @brief Append requests that are due to an outgoing chunk (SPI task only)
+ *
+ * @param buf Chunk being built
+ * @param used Bytes of buf already used by other commands
+ * @param size Size of buf, one byte is always left for the terminator
+ * @param loaded Bitmask of the call slots that were loaded, for spi_rpc_delivered
+ * @return New number of used bytes
+ */
+size_t spi_rpc_load(char *buf, size_t used, size_t size, uint32_t *loaded);
+
+/**
+ * @brief Mark the requests of a completed transaction as delivered (SPI task only)
+ *
+ * @param delivered_us When the transaction ended
+ */
+void spi_rpc_delivered(uint32_t loaded, int64_t delivered_us);
+
+/**
+ * @brief Handle an SPI_MSG_RPC message, without its type byte (SPI task only)
+ */
+void spi_rpc_handle_response(const char *message);
+
+/**
+ * @brief Time out calls whose retries are exhausted (SPI task only)
+ *
+ * Calls made with spi_rpc_call also time out when they have not been clocked
+ * out SPI_RPC_MAX_ATTEMPTS * SPI_RPC_RETRY_MS after they were made.
+ */
+void spi_rpc_poll();
+
+void spi_rpc_get_stats(spi_rpc_stats_t *stats);
+
+#endif // SPI_RPC_H
@@ -10,38 +10,151 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
-#include "cJSON.h"
 #include "esp_err.h"
 #include "esp_timer.h"
-
-#define CHUNK_SIZE 64  // Define chunk size for SPI transactions
+#include "spi_protocol.h"
+#include "motor.h"
+
+#define CHUNK_SIZE SPI_CHUNK_SIZE  // Define chunk size for SPI transactions
+#define SPI_RX_QUEUE_DEPTH 4  // Transactions kept queued with the SPI slave driver
+#define SPI_OUTBOX_PRODUCERS 4  // Tasks that may send commands to the Pi
+#define SPI_OUTBOX_DEPTH 8  // Commands queued per task (power of two)
+#define SPI_COMMAND_SEPARATOR '\n'  // Separates commands packed into one MISO chunk
+#define SPI_LINK_FRAME_RATE 60  // Vision frames per second requested in the handshake
+#define SPI_PRIORITY_QUEUE_DEPTH 4  // Priority chunks waiting for the priority task
+#define SPI_PRIORITY_TASK_PRIORITY 10  // Above the SPI task (5) and the mission code
+#define SPI_LINK_TIMEOUT_MS 300  // Gap in vision frames after which the link counts as lost
+#define SPI_LINK_TIMEOUT_FRAMES 3  // At low vision rates, frame intervals missed before it does
 #define INITIALIZATION_MESSAGE_TRANSMIT     "Establishing Communication"
 #define INITIALIZATION_MESSAGE_RECEIVE      "Communication Established"
 
 extern SemaphoreHandle_t data_mutex;
 
+/**
+ * @brief Lock-free single-producer/single-consumer command queue
+ *
+ * Each task that sends commands owns one outbox; the SPI task is the only
+ * consumer. Sequence numbers start at 1 and are per outbox.
+ */
+typedef struct {
+    TaskHandle_t owner;
+    char commands[SPI_OUTBOX_DEPTH][CHUNK_SIZE];
+    _Atomic uint32_t head;       // Written by the owning task
+    _Atomic uint32_t tail;       // Written by the SPI task when a command is loaded
+    _Atomic uint32_t delivered;  // Sequence of the last command clocked out to the master
+} spi_outbox_t;
+
 typedef struct {
-    cJSON *jsonInput;
     char *messageInput;
 } SPI_received_data_t;
 
+typedef struct {
+    char *cells;            // DMA-capable receive cells, each CHUNK_SIZE bytes
+    uint32_t next_cell;     // Cell the next queued transaction lands in
+    uint32_t frame_start;   // First cell of the frame being assembled
+    bool frame_discard;     // Frame overflowed, ignore chunks until <END>
+    bool frame_gaps;        // A chunk before the last one was short, frame must be compacted
+    bool last_chunk_short;
+    bool framed;            // Current frame started with a spi_frame_header_t
+    bool peer_framed;       // The master has sent framed messages
+    bool resyncing;         // Skipping chunks until the next frame header
+    uint16_t frame_length;  // Message length from the header
+    uint16_t last_seq;      // Sequence of the last accepted framed message
+    bool have_seq;
+} frame_ring_t;
+
+/**
+ * @brief Latency histogram of one stage of the vision pipeline
+ */
+typedef struct {
+    uint32_t frames;
+    uint32_t last_us;
+    uint32_t max_us;
+    uint32_t hist[SPI_STATS_HIST_BINS];
+} spi_latency_stats_t;
+
+typedef struct {
+    uint32_t chunks;                    // Chunks received
+    uint32_t overruns;                  // Times the transaction queue ran empty
+    uint32_t short_transactions;        // Transactions shorter than CHUNK_SIZE
+    uint32_t oversized_frames;          // Frames dropped for not fitting the frame ring
+    uint32_t frames;                    // Complete messages handed to the parser
+    uint32_t frames_dropped;            // Gaps in the sequence numbers
+    uint32_t frames_duplicated;         // Repeated sequence numbers, discarded
+    uint32_t frames_truncated;          // Frames cut short by <END> or by the next header
+    uint32_t resyncs;                   // Times assembly restarted at a frame boundary
+    uint32_t bytes;                     // Bytes clocked in by the master
+    uint32_t parse_failures;            // Messages that failed to decode (bad JSON, bad binary frame)
+    uint32_t mutex_timeouts;            // Failed data_mutex takes, parser and getters
+    uint32_t spi_timeouts;              // Waits for a transaction that timed out with the link idle
+    uint32_t deltas;                    // Delta frames merged into the vision state
+    uint32_t delta_keyframes;
+    uint32_t deltas_stale;              // Deltas dropped because their base frame was missed
+    uint64_t total_process_us;
+    uint32_t avg_process_us;            // Time from completion to re-arm, per chunk
+    uint32_t max_process_us;
+    uint32_t observed_chunks_per_s;     // Rate over the last second
+    uint32_t peak_chunks_per_s;
+    uint32_t sustainable_chunks_per_s;  // Estimated from avg_process_us
+    uint32_t frames_per_s;              // Over the last second
+    uint32_t bytes_per_s;
+    uint32_t frame_size_hist[SPI_STATS_HIST_BINS];      // See spi_stats_bin and SPI_STATS_SIZE_BIN_BYTES
+    uint32_t frame_interval_hist[SPI_STATS_HIST_BINS];  // Gap between frames, SPI_STATS_INTERVAL_BIN_US
+    int64_t last_frame_us;
+    uint32_t priority_commands;         // Priority chunks acted on, repeats not included
+    uint32_t priority_last_us;          // From the end of the chunk's transaction to the command taking effect
+    uint32_t priority_max_us;
+    uint32_t priority_latency_hist[SPI_STATS_HIST_BINS];  // SPI_STATS_PRIORITY_BIN_US
+    uint32_t link_losses;               // Times the link watchdog declared the link lost
+    uint32_t link_down_us;              // From the last frame before each loss to the first after, summed
+    uint32_t link_max_down_us;
+    uint32_t clock_samples;             // Clock sync answers taken, see clock_sync.h
+    int64_t clock_offset_us;            // Pi clock minus esp_timer
+    uint32_t clock_uncertainty_us;
+    spi_latency_stats_t receive_latency;    // Capture to the last chunk arriving, SPI_STATS_LATENCY_BIN_US
+    spi_latency_stats_t parse_latency;      // Last chunk to the frame being readable, SPI_STATS_PARSE_BIN_US
+    spi_latency_stats_t consume_latency;    // Frame readable to the first getter reading it
+    spi_latency_stats_t frame_age;          // Capture to the first getter reading it
+} spi_rx_stats_t;
+
+/**
+ * @brief When the current vision data was captured and came in, in esp_timer time
+ */
+typedef struct {
+    int64_t captured_us;    // 0 if the frame carried no capture time or the clock is not synced yet
+    int64_t received_us;    // The frame's last chunk clocked in
+    int64_t parsed_us;      // The frame became readable through the getters
+} spi_frame_timing_t;
+
+/**
+ * @brief The newest vision frame with what a controller needs to judge it
+ */
+typedef struct {
+    vision_frame_t frame;       // frame.valid tells the members the Pi sent; a member is 0 only if it was
+    spi_frame_timing_t timing;
+    uint32_t seq;               // Frames published up to this one, 0 before the first
+    int64_t age_us;             // From its capture, or arrival when that is unknown, to the snapshot
+} spi_vision_snapshot_t;
+
+/**
+ * @brief Told when the link watchdog declares the link lost or back
+ *
+ * Runs in the priority task, so it must not block.
+ */
+typedef void (*spi_link_callback_t)(bool up, void *arg);
+
 typedef struct {
     bool initialized;
     double alpha;  // Smoothing factor (between 0.0 and 1.0)
     char* pipeline_type;
 
-    double point_bottom_left[2];
-    double point_bottom_right[2];
-    double point_top_right[2];
-    double point_top_left[2];
+#define X(index, name) double point_##name[2];
+    VISION_SCHEMA_CORNERS(X)
+#undef X
 
-    double ta_ema;
-    double tx_ema;
-    double tx_nocross_ema;
-    double txp_ema;
-    double ty_ema;
-    double ty_nocross_ema;
-    double typ_ema;
+#define X(NAME, name, key) double name##_ema;
+    VISION_SCHEMA_METRICS(X)
+#undef X
 
 } EMAState;
 
@@ -50,58 +163,203 @@ esp_err_t spi_secondary_init(void);
 
 void spi_secondary_task(void *arg);
 
-void process_received_data(char* input);
-
-void send_message(char *message);
+void spi_secondary_get_rx_stats(spi_rx_stats_t *stats);
+
+/**
+ * @brief Send telemetry (spi_telemetry_t) instead of "ACK" when no command is pending
+ */
+void spi_telemetry_enable(bool enable);
+
+/**
+ * @brief Exchange versions and capabilities with the Pi and switch to the agreed mode
+ *
+ * @return true if the Pi answered; on false the link stays on plain JSON
+ */
+bool spi_secondary_handshake(TickType_t timeout);
+
+/**
+ * @brief Mode agreed on in the last handshake, version 0 with no capabilities before one succeeds
+ */
+void spi_secondary_get_link_caps(spi_link_caps_t *caps);
+
+/**
+ * @brief Ask the Pi for a vision rate and field set, without blocking
+ *
+ * Meant to be called at the start of each mission phase: a high rate while
+ * aligning on vision, a heartbeat while driving on encoders. Asking for the
+ * profile already requested does nothing. The rate is capped to the one agreed
+ * in the handshake.
+ *
+ * @param rate Frames per second, 0 for as fast as the link allows
+ * @param fields vision_field_t bits the phase reads
+ * @return false if the Pi does not support it or the request could not be queued
+ */
+bool spi_secondary_request_vision(uint16_t rate, uint32_t fields);
+
+/**
+ * @brief Last vision profile the Pi acknowledged, rate 0 and every field before any
+ */
+void spi_secondary_get_vision_profile(spi_vision_profile_t *profile);
+
+/**
+ * @brief Register the four drive motors (FR, FL, BR, BL)
+ *
+ * Their duty is reported in telemetry and a priority STOP from the Pi stops them.
+ */
+void spi_secondary_set_wheels(motor_t *wheels);
+
+/**
+ * @brief true between a priority STOP and the following RELEASE
+ *
+ * The STOP holds the wheels registered with spi_secondary_set_wheels through
+ * motor_hold, so motion code needs no check of its own: perform_maneuver and
+ * the timed moves wait until the RELEASE.
+ */
+bool spi_secondary_stop_held();
+
+/**
+ * @brief Timing of the vision data the getters currently return
+ *
+ * Controllers use it to tell how old what they steer on is, for example to
+ * wait for an image taken after the robot stopped.
+ *
+ * @return false before the first frame
+ */
+bool spi_secondary_get_frame_timing(spi_frame_timing_t *timing);
+
+/**
+ * @brief Copy the newest vision frame whole, never blocks
+ *
+ * Everything one control step reads comes from the same frame, unlike a
+ * getter per value, and seq and age_us tell whether it is worth acting on.
+ *
+ * @return false before the first frame
+ */
+bool spi_secondary_snapshot(spi_vision_snapshot_t *snapshot);
+
+/**
+ * @brief spi_secondary_snapshot with frame holding one tag, as get_fiducial_by_id returns it
+ *
+ * @return false if the newest frame did not see the tag; seq, timing and age_us are filled in anyway
+ */
+bool spi_secondary_snapshot_tag(int fID, spi_vision_snapshot_t *snapshot);
+
+/**
+ * @brief Whether a frame newer than 'seq' has come in, without copying anything
+ *
+ * @param seq spi_vision_snapshot_t.seq of the frame last acted on, 0 for none
+ */
+bool spi_secondary_has_new_frame(uint32_t seq);
+
+/**
+ * @brief Set the gap in vision frames after which the link counts as lost
+ *
+ * The watchdog starts with the first frame. Once the gap passes, the wheels
+ * are held with MOTOR_HOLD_LINK within LINK_CHECK_PERIOD_MS until frames
+ * resume: maneuvers the mission code ends on what vision sees stop, timed
+ * dead-reckoning moves go on. The gap is stretched to SPI_LINK_TIMEOUT_FRAMES
+ * frame intervals when the vision rate is low.
+ *
+ * @param timeout_ms 0 turns the watchdog off; set it before spi_secondary_init to start it off
+ */
+void spi_secondary_set_link_timeout(uint32_t timeout_ms);
+
+/**
+ * @brief Register the function told about link losses, NULL for none
+ *
+ * Meant to be set once from setup, before frames start flowing.
+ */
+void spi_secondary_set_link_callback(spi_link_callback_t callback, void *arg);
+
+/**
+ * @brief false while the watchdog holds the link lost
+ *
+ * The getters keep returning the last frame during a loss; code that steers
+ * on vision checks this before trusting them.
+ */
+bool spi_secondary_link_up();
+
+/**
+ * @brief Block until the link is up again
+ *
+ * @return false if it was still lost after timeout
+ */
+bool spi_secondary_wait_link(TickType_t timeout);
+
+void spi_telemetry_set_segment(uint8_t segment);
+
+// Clears the per-match counters, call at the start of a match
+void spi_secondary_reset_rx_stats();
+
+void spi_secondary_log_rx_stats();
 
-char* get_message();
+void process_received_data(char* input);
 
-cJSON* get_last_json();
+void process_binary_frame(const uint8_t *input, size_t len);
 
-cJSON* get_retro();
+void process_delta_frame(const uint8_t *input, size_t len);
 
-double get_retro_ta();
+/**
+ * @brief Queue a command for the master without blocking
+ *
+ * @return Sequence number to check delivery with, 0 if the outbox is full
+ */
+uint32_t spi_send_command(const char *message);
 
-double get_retro_tx();
+bool spi_command_delivered(uint32_t id);
 
-double get_retro_tx_nocross();
+/**
+ * @brief Block until a command from this task has been clocked out to the master
+ */
+bool spi_wait_command_delivered(uint32_t id, TickType_t timeout);
 
-double get_retro_txp();
+/**
+ * @brief Send the Pi the window the tag should be in, along with a motion command
+ *
+ * The window comes from the corners of recent frames (see roi_predictor.h),
+ * moved and padded for the maneuver about to run. Nothing is sent while the
+ * window is unchanged or the previous hint has not gone out yet.
+ *
+ * @param fID Tag the caller is looking for, -1 for whichever is in view
+ * @return false if no hint could be made or the Pi does not take them
+ */
+bool spi_send_roi_hint(maneuver_t maneuver, int fID);
 
-double get_retro_ty();
+void send_message(char *message);
 
-double get_retro_ty_nocross();
+bool send_message_wait(char *message, TickType_t timeout);
 
-double get_retro_typ();
+char* get_message();
 
-cJSON* get_fiducial();
+// get_retro_<metric>() for each of VISION_SCHEMA_METRICS, 0 unless the newest frame is a retro target with it
+#define X(NAME, name, key) double get_retro_##name();
+VISION_SCHEMA_METRICS(X)
+#undef X
 
 int get_fiducial_fID();
 
-char* get_fiducial_fam();
-
-cJSON* get_fiducial_pts();
-
 void get_point_at_index(int index, double* ret);
 
-double get_fiducial_ta();
-
-double get_fiducial_tx();
-
-double get_fiducial_tx_nocross();
-
-double get_fiducial_txp();
-
-double get_fiducial_ty();
-
-double get_fiducial_ty_nocross();
-
-double get_fiducial_typ();
+/**
+ * @brief One tag of the newest frame, whichever place the Pi listed it in
+ *
+ * Every fiducial of a frame is kept, up to VISION_MAX_TAGS, and found by fID
+ * without a search, so code aligning to a given tag never reads another one.
+ * Members the Pi did not send are 0 and left out of tag->valid, like the getters.
+ *
+ * @param fID Tag to look up, -1 for the one the Pi listed first (what the get_fiducial_* getters read)
+ * @param tag Its members with the frame's pID, v and capture time, zeroed when false is returned
+ * @return false if the newest frame did not see that tag
+ */
+bool get_fiducial_by_id(int fID, vision_frame_t *tag);
+
+// get_fiducial_<metric>() for each of VISION_SCHEMA_METRICS, 0 unless the newest frame is a fiducial with it
+#define X(NAME, name, key) double get_fiducial_##name();
+VISION_SCHEMA_METRICS(X)
+#undef X
 
 double get_pID();
 
-char* get_pTYPE();
-
 int get_v();
 
 void init_ema(EMAState *ema, double alpha, char* type);
@@ -110,16 +368,12 @@ void reset_ema(EMAState *ema);
 
 void update_ema(EMAState *ema);
 
-void get_ema_point_bottom_left(const EMAState *ema, double ret[2]);
-void get_ema_point_bottom_right(const EMAState *ema, double ret[2]);
-void get_ema_point_top_right(const EMAState *ema, double ret[2]);
-void get_ema_point_top_left(const EMAState *ema, double ret[2]);
-double get_ema_ta(const EMAState *ema);
-double get_ema_tx(const EMAState *ema);
-double get_ema_tx_nocross(const EMAState *ema);
-double get_ema_txp(const EMAState *ema);
-double get_ema_ty(const EMAState *ema);
-double get_ema_ty_nocross(const EMAState *ema);
-double get_ema_typ(const EMAState *ema);
+// get_ema_point_<corner>(ema, ret) for each of VISION_SCHEMA_CORNERS and get_ema_<metric>(ema) for each of VISION_SCHEMA_METRICS
+#define X(index, name) void get_ema_point_##name(const EMAState *ema, double ret[2]);
+VISION_SCHEMA_CORNERS(X)
+#undef X
+#define X(NAME, name, key) double get_ema_##name(const EMAState *ema);
+VISION_SCHEMA_METRICS(X)
+#undef X
 
 #endif  // SPI_SECONDARY_H
@@ -0,0 +1,28 @@
+/**
+ * @file vision_bench.h
+ * @brief Times the vision decoders on the ESP32 with the CPU cycle counter
+ *
+ * Replays the messages of vision_corpus.h through vision_replay_message, the
+ * decode path tools/spi_host/replay_bench times on the host, so the two sets
+ * of numbers compare. Built into firmware compiled with -DVISION_BENCH (the
+ * esp32dev-bench environment), which runs it at boot instead of the mission.
+ */
+
+#ifndef VISION_BENCH_H
+#define VISION_BENCH_H
+
+#include <stdint.h>
+
+#define VISION_BENCH_PASSES         2000    // Default passes over the corpus
+#define VISION_BENCH_MAX_MESSAGES   32
+#define VISION_BENCH_ARENA_SIZE     4096    // Decoded corpus messages, back to back
+
+/**
+ * @brief Replay the corpus 'passes' times and log cycles and nanoseconds per frame by message type
+ *
+ * Nothing is published and the link is not touched; it can run before setup().
+ * Yields for a tick after every pass so the idle task keeps its watchdog fed.
+ */
+void vision_bench_run(uint32_t passes);
+
+#endif // VISION_BENCH_H
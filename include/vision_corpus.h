@@ -0,0 +1,64 @@
+/**
+ * @file vision_corpus.h
+ * @brief Vision messages as the Pi sends them, and the decode path to replay them through
+ *
+ * The corpus is the shared input of the host tools (replay_bench and the
+ * vision_fuzz seeds, see tools/spi_host) and of the benchmark the ESP32 runs
+ * itself (vision_bench.h), so their numbers compare. Plain C with no ESP-IDF
+ * dependencies, like spi_protocol.h.
+ */
+
+#ifndef VISION_CORPUS_H
+#define VISION_CORPUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "spi_protocol.h"
+
+/**
+ * @brief The messages, one spi_capture_format line each, in the order they are replayed
+ *
+ * Delta frames follow the keyframe they apply to.
+ */
+extern const char *const vision_corpus[];
+extern const size_t vision_corpus_count;
+
+/**
+ * @brief Messages every decoder has to reject, in the same format
+ *
+ * Numbers no field can hold and the like. They seed vision_fuzz and
+ * replay_bench checks nothing publishes them, but no benchmark replays them.
+ */
+extern const char *const vision_corpus_malformed[];
+extern const size_t vision_corpus_malformed_count;
+
+/**
+ * @brief What the receive path keeps between messages
+ */
+typedef struct {
+    vision_json_stream_t json;
+    vision_frame_t delta_state;
+    uint16_t delta_seq;
+    bool delta_valid;
+} vision_replay_t;
+
+/**
+ * @brief Forget the delta chain, as after a reset of the link
+ */
+void vision_replay_begin(vision_replay_t *replay);
+
+/**
+ * @brief Decode one message with the decoders process_received_data and friends use
+ *
+ * Nothing is published: this is the part of the receive path that only
+ * depends on the message, so it can be timed anywhere.
+ *
+ * @param message Message with its type byte; J documents need no terminator
+ * @param frame Decoded frame; fiducials of a J document are in replay->json.tags
+ * @return true if the message decoded to a frame, false if it was malformed,
+ *         a delta without its base, or not a vision message
+ */
+bool vision_replay_message(vision_replay_t *replay, const uint8_t *message, size_t len, vision_frame_t *frame);
+
+#endif // VISION_CORPUS_H
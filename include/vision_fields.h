@@ -0,0 +1,38 @@
+/**
+ * @file vision_fields.h
+ * @brief Vision fields the mission code reads, per pipeline and per mission phase
+ *
+ * The subscriptions are fixed at compile time and sent to the Pi after every
+ * handshake (see spi_vision_subscription_t), so it stops serializing fields
+ * nothing on the ESP32 reads. The phase sets narrow them further through
+ * spi_secondary_request_vision. Code that starts reading another field from
+ * the getters has to add it here, or the Pi will not send it.
+ */
+
+#ifndef VISION_FIELDS_H
+#define VISION_FIELDS_H
+
+#include "spi_protocol.h"
+
+#define VISION_PIPELINE_APRILTAG    6
+
+// aprilTag_main steers on tx, ta and the bottom corners; the ROI predictor
+// boxes all four corners, and setup waits on pID and v
+#define VISION_FIELDS_APRILTAG  ((1u << VISION_FIELD_TARGET) | (1u << VISION_FIELD_PID) | (1u << VISION_FIELD_V) | \
+                                 (1u << VISION_FIELD_FID) | (1u << VISION_FIELD_TA) | (1u << VISION_FIELD_TX) | \
+                                 (1u << VISION_FIELD_PT0) | (1u << VISION_FIELD_PT1) | \
+                                 (1u << VISION_FIELD_PT2) | (1u << VISION_FIELD_PT3))
+
+// Per mission phase, see spi_secondary_request_vision
+#define VISION_FIELDS_ALIGN     VISION_FIELDS_APRILTAG
+#define VISION_FIELDS_HEARTBEAT ((1u << VISION_FIELD_TARGET) | (1u << VISION_FIELD_PID) | (1u << VISION_FIELD_V))
+
+// Initializer for the spi_vision_subscription_t table sent after the handshake
+#define VISION_SUBSCRIPTIONS { \
+    { .pipeline = VISION_PIPELINE_APRILTAG, .fields = VISION_FIELDS_APRILTAG }, \
+}
+
+_Static_assert((VISION_FIELDS_HEARTBEAT & ~VISION_FIELDS_APRILTAG) == 0,
+               "a phase cannot ask for fields its pipeline is not subscribed to");
+
+#endif // VISION_FIELDS_H
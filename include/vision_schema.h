@@ -0,0 +1,43 @@
+/**
+ * @file vision_schema.h
+ * @brief The vision pipelines and the metrics each of their targets carries
+ *
+ * Everything that repeats per pipeline or per metric is expanded from these
+ * lists by the preprocessor: the vision_frame_t and vision_frame_bin_t
+ * members, their vision_field_t bits, the JSON keys the decoder matches, the
+ * get_<pipeline>_<metric> getters, and the EMAState averages with their
+ * get_ema_* getters. Adding a metric is one line here.
+ *
+ * Each list calls the macro it is given once per entry. The order is the wire
+ * order of the binary and delta frames, so add metrics at the end and bump
+ * VISION_BIN_VERSION; the Pi has to be built from the same list.
+ */
+
+#ifndef VISION_SCHEMA_H
+#define VISION_SCHEMA_H
+
+// Pipelines a frame can describe: X(NAME, name, json_key)
+// NAME makes VISION_TARGET_<NAME>, name the get_<name>_<metric> getters
+#define VISION_SCHEMA_TARGETS(X) \
+    X(FIDUCIAL, fiducial, "Fiducial") \
+    X(RETRO,    retro,    "Retro")
+
+// Metrics of a target, all doubles: X(NAME, name, json_key)
+// NAME makes VISION_FIELD_<NAME>, name the frame member, the getters and the <name>_ema average
+#define VISION_SCHEMA_METRICS(X) \
+    X(TA,         ta,         "ta") \
+    X(TX,         tx,         "tx") \
+    X(TX_NOCROSS, tx_nocross, "tx_nocross") \
+    X(TXP,        txp,        "txp") \
+    X(TY,         ty,         "ty") \
+    X(TY_NOCROSS, ty_nocross, "ty_nocross") \
+    X(TYP,        typ,        "typ")
+
+// Corners of a fiducial's "pts", in order: X(index, name) makes point_<name> in EMAState
+#define VISION_SCHEMA_CORNERS(X) \
+    X(0, bottom_left) \
+    X(1, bottom_right) \
+    X(2, top_right) \
+    X(3, top_left)
+
+#endif // VISION_SCHEMA_H
@@ -7,6 +7,7 @@ double TA_CLOSE = 0.12;
 
 // Outside the Cave - Part 1: Initial S Sweep
 void Outside_Cave_Part_1() {
+    spi_telemetry_set_segment(SEGMENT_OUTSIDE_CAVE_1);
     dc_set_speed(&robot_singleton.intakeMotor, -75);
 
     move_pid_time(robot_singleton.omniMotors, FORWARD, 15, 1.9);
@@ -51,6 +52,7 @@ void Outside_Cave_Part_1() {
 
 // Inside the Cave: Sweep for Astral Material
 void Inside_Cave() {
+    spi_telemetry_set_segment(SEGMENT_INSIDE_CAVE);
     // Initial forward move.
     move_pid_time(robot_singleton.omniMotors, FORWARD, 15, 2.5);
     perform_maneuver(robot_singleton.omniMotors, RIGHT, NULL, 22);
@@ -125,6 +127,7 @@ void Inside_Cave() {
 
 // Outside the Cave - Part 2: Dump Geodinium and Move Nebulite Bin
 void Outside_Cave_Part_2() {
+    spi_telemetry_set_segment(SEGMENT_OUTSIDE_CAVE_2);
 
     move_pid_time(robot_singleton.omniMotors, FORWARD, 15, 1.0);
 
@@ -134,6 +137,7 @@ void Outside_Cave_Part_2() {
 
 // Outside the Cave - Part 3: Re-sweep, Dump, and Move Geodinium Bin
 void Outside_Cave_Part_3() {
+    spi_telemetry_set_segment(SEGMENT_OUTSIDE_CAVE_3);
     move_pid_time(robot_singleton.omniMotors, LEFT, 15, 0.5);
     move_pid_time(robot_singleton.omniMotors, FORWARD, 15, 3.5);
     move_pid_time(robot_singleton.omniMotors, BACKWARD, 10, 0.4);
@@ -141,6 +145,7 @@ void Outside_Cave_Part_3() {
 }
 
 void Short_Search_All() {
+    spi_telemetry_set_segment(SEGMENT_SHORT_SEARCH);
     dc_set_speed(&robot_singleton.intakeMotor, -75);
 
     move_pid_time(robot_singleton.omniMotors, FORWARD, 15, 0.35);
@@ -0,0 +1,39 @@
+#include "clock_sync.h"
+
+#include <string.h>
+
+void clock_sync_reset(clock_sync_t *sync) {
+    memset(sync, 0, sizeof(*sync));
+}
+
+void clock_sync_sample(clock_sync_t *sync, int64_t local_us, int64_t remote_us, uint32_t round_trip_us) {
+    sync->samples[sync->count % CLOCK_SYNC_WINDOW] = (clock_sync_sample_t) {
+        .offset_us = remote_us - local_us,
+        .round_trip_us = round_trip_us
+    };
+    ++sync->count;
+
+    // Old samples drop out of the window, so the offset follows drift between the crystals
+    uint32_t filled = sync->count < CLOCK_SYNC_WINDOW ? sync->count : CLOCK_SYNC_WINDOW;
+    const clock_sync_sample_t *best = &sync->samples[0];
+    for (uint32_t i = 1; i < filled; ++i) {
+        if (sync->samples[i].round_trip_us < best->round_trip_us) {
+            best = &sync->samples[i];
+        }
+    }
+    sync->offset_us = best->offset_us;
+    sync->uncertainty_us = best->round_trip_us;
+}
+
+bool clock_sync_ready(const clock_sync_t *sync) {
+    return sync->count > 0;
+}
+
+bool clock_sync_to_local(const clock_sync_t *sync, uint32_t remote_us, int64_t local_now_us, int64_t *local_us) {
+    if (!clock_sync_ready(sync)) return false;
+
+    int64_t remote_now = local_now_us + sync->offset_us;
+    int64_t remote = remote_now + (int32_t)(remote_us - (uint32_t)remote_now);
+    *local_us = remote - sync->offset_us;
+    return true;
+}
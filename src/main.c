@@ -1,10 +1,16 @@
 #include "main_helpers.h"
+#include "vision_bench.h"
 
 #define TAG "MAIN"
 
 int64_t start_time_us;
 
 int app_main() {
+#ifdef VISION_BENCH
+    // Bench firmware (env:esp32dev-bench) only times the vision decoders and leaves the robot alone
+    vision_bench_run(VISION_BENCH_PASSES);
+    return 0;
+#endif
 
     if (setup() != 0) {
         for (int jordyn = 0; jordyn < 7; ++jordyn) {
@@ -28,11 +34,14 @@ int app_main() {
                 break;
             case READY:
                 wait_for_push_start();
+                spi_secondary_reset_rx_stats();
                 vTaskDelay(pdMS_TO_TICKS(5000));
 
                 currentState = FULL_SEARCH;
                 break;
             case FULL_SEARCH:
+                // The search opens on encoders; aprilTag_main raises the rate while it aligns
+                spi_secondary_request_vision(VISION_RATE_HEARTBEAT, VISION_FIELDS_HEARTBEAT);
                 Outside_Cave_Part_1();
                 Inside_Cave();
                 Outside_Cave_Part_2();
@@ -41,6 +50,7 @@ int app_main() {
                 currentState = SHIMMY;
                 break;
             case SHIMMY:
+                spi_telemetry_set_segment(SEGMENT_SHIMMY);
                 dc_set_speed(&robot_singleton.intakeMotor, 0);
                 perform_maneuver(robot_singleton.omniMotors, ROTATE_CLOCKWISE, NULL, 20);
                 for (int i = 0; i < 10; ++i) {
@@ -65,6 +75,8 @@ int app_main() {
                 currentState = STOP_PROGRAM;
                 break;
             case STOP_PROGRAM:
+                spi_telemetry_set_segment(SEGMENT_NONE);
+                spi_secondary_log_rx_stats();
                 perform_maneuver(robot_singleton.omniMotors, STOP, NULL, 0);
                 dc_set_speed(&robot_singleton.intakeMotor, 0);
                 dc_set_speed(&robot_singleton.outtakeMotor, 0);
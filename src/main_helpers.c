@@ -1,6 +1,14 @@
 #include "main_helpers.h"
 
 #define TAG "MAIN HELPER"
+#define HANDSHAKE_RESEND_MS 100  // Wait this long for the Pi to answer before resending
+#define PIPELINE_RESEND_MS  500
+#define RPC_WAIT_MS         500  // Fall back to plain commands if the Pi does not answer RPCs
+#define SETTLE_FRAME_WAIT_MS 150  // Longest wait for an image taken after the robot stopped
+#define ALIGN_FRAME_WAIT_MS 100  // Longest an alignment step waits for a frame that saw the tag
+#define ALIGN_POLL_MS       5    // How often it checks for one
+#define ALIGN_MAX_FRAME_AGE_MS 250  // Frames older than this are not steered on
+#define PIPELINE_SWITCH_TIMEOUT_MS 5000  // Give up on a pipeline the Pi never reports running
 
 robot_t robot_singleton;
 
@@ -23,20 +31,38 @@ int setup() {
 
     /* 4. RPI SPI Communication Initialization Sequence */
     spi_secondary_init();
+    spi_secondary_set_wheels(robot_singleton.omniMotors);
     
     char* received = "";
+    uint32_t pending = 0;
+    TickType_t sent_at = 0;
+    bool negotiated = false;
     ESP_LOGI(TAG, "Waiting for Communication Initialization Confirmation");
+    // The Pi is usually still booting, so keep offering both handshakes until it answers either
     while(get_pID() < 0 && (strcmp(received, "INITIALIZATION_MESSAGE"))) {
-        send_message("INITIALIZATION_MESSAGE");
+        negotiated = spi_secondary_handshake(pdMS_TO_TICKS(RPC_WAIT_MS));
+        if (negotiated) break;
+        // Only resend once the last copy reached the Pi and went unanswered
+        if (pending == 0 || (spi_command_delivered(pending) &&
+                             xTaskGetTickCount() - sent_at >= pdMS_TO_TICKS(HANDSHAKE_RESEND_MS))) {
+            pending = spi_send_command("INITIALIZATION_MESSAGE");
+            sent_at = xTaskGetTickCount();
+        }
         // ESP_LOGI(TAG, "message = %s", get_message());
         received = get_message();
         vTaskDelay(pdMS_TO_TICKS(5));
     }
+    // The Pi is up now; only older software, which ignores the capability handshake, still fails it
+    if (!negotiated && !spi_secondary_handshake(pdMS_TO_TICKS(RPC_WAIT_MS))) {
+        ESP_LOGW(TAG, "Pi answered only the plain handshake, staying on JSON");
+    }
     ESP_LOGI(TAG, "communication established");
     send_message("communication established");
     
     // ESP_LOGI(TAG, "Waiting for Pipeline Switch");
-    switch_pipeline(6);
+    if (!switch_pipeline(VISION_PIPELINE_APRILTAG)) {
+        return -1;
+    }
     
     led_flash(&robot_singleton.headlight);
     led_flash(&robot_singleton.headlight);
@@ -45,14 +71,31 @@ int setup() {
     return 0;
 }
 
-void switch_pipeline(int new_pipeline) {
+bool switch_pipeline(int new_pipeline) {
     char message[5];
     sprintf(message, "P%d", new_pipeline);
-    send_message(message);
+
+    // The Pi answers once the pipeline is running, then only the first frame from it is awaited
+    bool acknowledged = spi_rpc_call_wait(SPI_RPC_PIPELINE, message + 1, NULL, 0,
+                                          pdMS_TO_TICKS(RPC_WAIT_MS)) == SPI_RPC_OK;
+    uint32_t pending = acknowledged ? 0 : spi_send_command(message);
+    TickType_t sent_at = xTaskGetTickCount();
+    TickType_t start = sent_at;
     while (get_pID() != (double)new_pipeline) {
-        send_message(message);
+        // Without frames the pipeline ID never changes, so this would spin forever
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(PIPELINE_SWITCH_TIMEOUT_MS)) {
+            ESP_LOGE(TAG, "Pipeline %d not running after %dms", new_pipeline, PIPELINE_SWITCH_TIMEOUT_MS);
+            return false;
+        }
+        // Only resend once the last copy reached the Pi and went unanswered
+        if (!acknowledged && (pending == 0 || (spi_command_delivered(pending) &&
+                              xTaskGetTickCount() - sent_at >= pdMS_TO_TICKS(PIPELINE_RESEND_MS)))) {
+            pending = spi_send_command(message);
+            sent_at = xTaskGetTickCount();
+        }
         vTaskDelay(5);
     }
+    return true;
 }
 
 void full_motor_init() {
@@ -96,6 +139,89 @@ void full_motor_init() {
     outtake_reset(&robot_singleton.outtakeMotor);
 }
 
+/*
+ * Waits until the vision data comes from an image taken after 'since_us'
+ * (esp_timer time). Without it, the decision right after a stop acts on an
+ * image from while the robot was still moving, which is what made alignment
+ * overshoot. Frames without a capture time count from when they arrived.
+ */
+static void wait_for_frame_after(int64_t since_us) {
+    TickType_t start = xTaskGetTickCount();
+    spi_frame_timing_t timing;
+    while (xTaskGetTickCount() - start < pdMS_TO_TICKS(SETTLE_FRAME_WAIT_MS)) {
+        if (spi_secondary_get_frame_timing(&timing) &&
+            (timing.captured_us ? timing.captured_us : timing.received_us) >= since_us) {
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
+
+/*
+ * Maneuvers while aligning also tell the Pi where to look for the tag next.
+ * While the link is lost the values the caller steers on are stale, so this
+ * waits for the link and a fresh frame instead of driving; the caller's loop
+ * reads again before its next maneuver.
+ */
+static void align_maneuver(maneuver_t maneuver, int desired_fid, float speed_scalar) {
+    if (!spi_secondary_link_up()) {
+        perform_maneuver(robot_singleton.omniMotors, STOP, NULL, 0);
+        ESP_LOGW(TAG, "Alignment paused until the link is back");
+        spi_secondary_wait_link(portMAX_DELAY);
+        wait_for_frame_after(esp_timer_get_time());
+        return;
+    }
+    spi_send_roi_hint(maneuver, desired_fid);
+    perform_maneuver(robot_singleton.omniMotors, maneuver, NULL, speed_scalar);
+}
+
+/*
+ * What alignment steers on, for the tag it locks onto: 'desired_fid', or the
+ * one the Pi lists first for -1, so with several bins in view it never steers
+ * on the wrong one. Each value is the last one a frame actually carried, so a
+ * frame that missed the tag leaves them in place instead of reading as 0.
+ */
+typedef struct {
+    uint32_t seq;       // Newest frame looked at, see spi_vision_snapshot_t
+    bool seen;          // That frame saw the tag and was recent enough to steer on
+    double tx;
+    double ta;
+    double dy;          // Bottom right corner minus bottom left, in y
+} align_view_t;
+
+/*
+ * Takes the newest frame into 'view' if it is one the view has not looked at,
+ * saw the tag and is recent enough to steer on. Returns whether it did.
+ */
+static bool update_align_view(int desired_fid, align_view_t *view) {
+    if (!spi_secondary_has_new_frame(view->seq)) return false;
+    spi_vision_snapshot_t snapshot;
+    // Frames from before the align profile took effect may lack what it steers on
+    uint32_t steering = (1u << VISION_FIELD_TX) | (1u << VISION_FIELD_TA);
+    bool seen = spi_secondary_snapshot_tag(desired_fid, &snapshot) && snapshot.frame.v &&
+                (snapshot.frame.valid & steering) == steering;
+    view->seq = snapshot.seq;
+    view->seen = seen && snapshot.age_us <= ALIGN_MAX_FRAME_AGE_MS * 1000;
+    if (!view->seen) return false;
+
+    const vision_frame_t *tag = &snapshot.frame;
+    uint32_t bottom = (1u << VISION_FIELD_PT0) | (1u << VISION_FIELD_PT1);
+    view->tx = tag->tx;
+    view->ta = tag->ta;
+    if ((tag->valid & bottom) == bottom) view->dy = tag->pts[1][1] - tag->pts[0][1];
+    return true;
+}
+
+// Waits for the next frame that saw the tag, up to 'timeout_ms', and takes it into 'view'
+static bool await_align_view(int desired_fid, align_view_t *view, uint32_t timeout_ms) {
+    TickType_t start = xTaskGetTickCount();
+    while (!update_align_view(desired_fid, view)) {
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(timeout_ms)) return false;
+        vTaskDelay(pdMS_TO_TICKS(ALIGN_POLL_MS));
+    }
+    return true;
+}
+
 void aprilTag_main(int desired_fid, double ta_target) {
     int done = 0;
 
@@ -103,102 +229,58 @@ void aprilTag_main(int desired_fid, double ta_target) {
     double tx_threshold = 3;
     double tx_epsilon = 10;
     double ta_epsilon = 0.005; // CHANGED THIS
-    double ta_temp = 0.0;
-    double ta = 0.0;
-    double tx = 0.0;
-    double tx_tmp = 0.0;
-    double bottom_right[2];
-    double bottom_left[2];
-    double dy = 0.0;
+    align_view_t view = { 0 };
+    // Alignment steers on every frame, only the fields read below are needed
+    spi_secondary_request_vision(VISION_RATE_ALIGN, VISION_FIELDS_ALIGN);
     while (!done) {
-        while (get_v() == 0) {
-            vTaskDelay(pdMS_TO_TICKS(20));
+        while (!view.seen) {
+            await_align_view(desired_fid, &view, ALIGN_FRAME_WAIT_MS);
         }
         int aligned = 0;
         while (!aligned) {
-            tx = 0.0;
-            tx_tmp = 0.0;
-
-            tx_tmp = get_fiducial_tx();
-            if (fabs(tx_tmp) > 0.00001) {
-                tx = tx_tmp;
-            }
-            dy = 0.0;
-            get_point_at_index(0, bottom_left);
-            get_point_at_index(1, bottom_right);
-            if (fabs(bottom_right[1] - bottom_left[1]) > 0.00001) {
-                dy = bottom_right[1] - bottom_left[1];
-            }
+            update_align_view(desired_fid, &view);
 
             // --- STRAFE until centered ---
-            while (fabs(tx) > tx_threshold) {
-                ta_temp = get_fiducial_ta();
-                if (ta_temp > 0.00001) {
-                    ta = ta_temp;
-                }
-                if (tx < -tx_threshold) {
-                    perform_maneuver(robot_singleton.omniMotors, LEFT, NULL, (23 * (1 - ta)));
-                } else if (tx > tx_threshold) {
-                    perform_maneuver(robot_singleton.omniMotors, RIGHT, NULL, (23 * (1 - ta)));
-                }
-                vTaskDelay(pdMS_TO_TICKS(20));
-                
-                tx_tmp = get_fiducial_tx();
-                if (fabs(tx_tmp) > 0.00001) {
-                    tx = tx_tmp;
+            // Each maneuver waits for a frame that saw the tag, rather than re-reading the one it acted on
+            while (fabs(view.tx) > tx_threshold) {
+                if (view.tx < -tx_threshold) {
+                    align_maneuver(LEFT, desired_fid, (23 * (1 - view.ta)));
+                } else if (view.tx > tx_threshold) {
+                    align_maneuver(RIGHT, desired_fid, (23 * (1 - view.ta)));
                 }
+                await_align_view(desired_fid, &view, ALIGN_FRAME_WAIT_MS);
             }
-            perform_maneuver(robot_singleton.omniMotors, STOP, NULL, 0);
+            align_maneuver(STOP, desired_fid, 0);
+            wait_for_frame_after(esp_timer_get_time());
         
             // --- ROTATE until epsilon ---
-            get_point_at_index(0, bottom_left);
-            get_point_at_index(1, bottom_right);
-            if (fabs(bottom_right[1] - bottom_left[1]) > 0.00001) {
-                dy = bottom_right[1] - bottom_left[1];
-            }
+            update_align_view(desired_fid, &view);
             
-            if ((dy < (-1 * dy_threshold)) && (fabs(tx) < tx_epsilon)) {
-                perform_maneuver(robot_singleton.omniMotors, ROTATE_COUNTERCLOCKWISE, NULL, 16);
-            } else if ((dy > dy_threshold) && (fabs(tx) < tx_epsilon)) {
-                perform_maneuver(robot_singleton.omniMotors, ROTATE_CLOCKWISE, NULL, 16);
+            if ((view.dy < (-1 * dy_threshold)) && (fabs(view.tx) < tx_epsilon)) {
+                align_maneuver(ROTATE_COUNTERCLOCKWISE, desired_fid, 16);
+            } else if ((view.dy > dy_threshold) && (fabs(view.tx) < tx_epsilon)) {
+                align_maneuver(ROTATE_CLOCKWISE, desired_fid, 16);
             }
 
             // Rotate while BOTH:
             // Not aligned (dy > threshold)
             // Still centered (tx < epsilon)
-            while ((fabs(dy) > dy_threshold) && (fabs(tx) < tx_epsilon)) {
-                vTaskDelay(pdMS_TO_TICKS(20));
-
-                // Update dy and tx
-                get_point_at_index(0, bottom_left);
-                get_point_at_index(1, bottom_right);
-                if (fabs(bottom_right[1] - bottom_left[1]) > 0.00001) {
-                    dy = bottom_right[1] - bottom_left[1];
-                }
-                tx_tmp = get_fiducial_tx();
-                if (fabs(tx_tmp) > 0.00001) {
-                    tx = tx_tmp;
-                }
+            // A link loss stops the wheels, so the STOP below waits for it instead of spinning here
+            while ((fabs(view.dy) > dy_threshold) && (fabs(view.tx) < tx_epsilon) && spi_secondary_link_up()) {
+                await_align_view(desired_fid, &view, ALIGN_FRAME_WAIT_MS);
             }
 
             // Stop strafing when either:
             // - dy is small enough (aligned)
             // - tx is too large (not centered anymore)
-            perform_maneuver(robot_singleton.omniMotors, STOP, NULL, 0);
+            align_maneuver(STOP, desired_fid, 0);
+            wait_for_frame_after(esp_timer_get_time());
 
             // Refresh for aligned check
-            tx_tmp = get_fiducial_tx();
-            if (fabs(tx_tmp) > 0.00001) {
-                tx = tx_tmp;
-            }
-            get_point_at_index(0, bottom_left);
-            get_point_at_index(1, bottom_right);
-            if (fabs(bottom_right[1] - bottom_left[1]) > 0.00001) {
-                dy = bottom_right[1] - bottom_left[1];
-            }
+            update_align_view(desired_fid, &view);
 
             // Exit if both alignment (dy) and centering (tx) are good
-            if ((fabs(tx) <= tx_threshold) && (fabs(dy) <= dy_threshold)) {
+            if ((fabs(view.tx) <= tx_threshold) && (fabs(view.dy) <= dy_threshold)) {
                 aligned = 1;
             }
 
@@ -211,41 +293,26 @@ void aprilTag_main(int desired_fid, double ta_target) {
             distance_done = 1;
         }
         
-        ta = 0.0;
-        ta_temp = 0.0;
         while (!distance_done) {
-            ta_temp = get_fiducial_ta();
-            if (ta_temp > 0.00001) {
-                ta = ta_temp;
-            }
-
-            if (ta < (ta_target - ta_epsilon)) {
-                perform_maneuver(robot_singleton.omniMotors, FORWARD, NULL, (18 * (1 - ta)));
-            } else if (ta > (ta_target + ta_epsilon)) {
-                perform_maneuver(robot_singleton.omniMotors, BACKWARD, NULL, (18 * (1 - ta)));
+            if (view.ta < (ta_target - ta_epsilon)) {
+                align_maneuver(FORWARD, desired_fid, (18 * (1 - view.ta)));
+            } else if (view.ta > (ta_target + ta_epsilon)) {
+                align_maneuver(BACKWARD, desired_fid, (18 * (1 - view.ta)));
             } else {
                 distance_done = 1;
             }
 
-            vTaskDelay(pdMS_TO_TICKS(10));
-        }
-        tx_tmp = get_fiducial_tx();
-        tx = 0.0;
-        if (fabs(tx_tmp) > 0.00001) {
-            tx = tx_tmp;
-        }
-        dy = 0.0;
-        get_point_at_index(0, bottom_left);
-        get_point_at_index(1, bottom_right);
-        if (fabs(bottom_right[1] - bottom_left[1]) > 0.00001) {
-            dy = bottom_right[1] - bottom_left[1];
+            await_align_view(desired_fid, &view, ALIGN_FRAME_WAIT_MS);
         }
-        if ((tx < tx_threshold) && (fabs(dy) < dy_threshold)) {
+        update_align_view(desired_fid, &view);
+        if ((view.tx < tx_threshold) && (fabs(view.dy) < dy_threshold)) {
             done = 1;
         }
     }
 
     perform_maneuver(robot_singleton.omniMotors, STOP, NULL, 0);
+    // Back to dead reckoning until the next alignment
+    spi_secondary_request_vision(VISION_RATE_HEARTBEAT, VISION_FIELDS_HEARTBEAT);
 }
 
 
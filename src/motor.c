@@ -1,3 +1,4 @@
+#include <string.h>
 #include "motor.h"
 #include "esp_log.h"
 
@@ -10,10 +11,29 @@
 #define ROTATE_SPEED_CONSTANT 42        // degrees per second
 #define MAX_ENCODER_VELOCITY_TICKS 1300
 #define UPDATE_INTERVAL_MS 50
+#define TIMED_MOVE_HOLDS MOTOR_HOLD_STOP  // Holds that also stop timed moves, see motor_hold_t
 
 mcpwm_timer_handle_t timers[2][3];      // Array of 3 timers in each of 2 groups
 mcpwm_oper_handle_t opers[2][3];        // Array of 3 operators in each of 2 groups
 
+// The drive state below is shared by the mission code and the tasks that hold the wheels
+static portMUX_TYPE drive_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t drive_holds = 0;        // motor_hold_t bits set
+static bool timed_move = false;         // A timed move sets the wheels, not perform_maneuver
+// Last maneuver asked of perform_maneuver, put back on the wheels when the holds end
+static struct {
+    motor_t *motors;
+    maneuver_t maneuver;
+    float speeds[4];
+    float speed_scalar;
+} requested = { .motors = NULL, .maneuver = STOP };
+
+// Clock of a timed move, which stands still while the wheels are held
+typedef struct {
+    int64_t last_us;
+    int64_t elapsed_us;
+} move_clock_t;
+
 void init_motor_resources() {
     for (int group = 0; group < 2; ++group) {
         for (int number = 0; number < 3; ++number) {
@@ -107,6 +127,7 @@ void dc_set_speed(motor_t *motor, float speed) {
     } else if (speed > 100) {
         speed = 100;
     }
+    motor->speed = speed;
  
     float min_pulse = 1050;
     float max_pulse = 1950;
@@ -120,7 +141,8 @@ void dc_set_speed(motor_t *motor, float speed) {
 }
  
  
-void perform_maneuver(motor_t *motors, maneuver_t maneuver, float speeds[4], float speed_scalar) {
+// Sets the drive wheels for 'maneuver' whatever the holds; drive_lock must be held
+static void set_maneuver(motor_t *motors, maneuver_t maneuver, const float speeds[4], float speed_scalar) {
     // Ensure speed_scalar is within the range [0, 100]
     if (speed_scalar < 0) speed_scalar = 0;
     if (speed_scalar > 100) speed_scalar = 100;
@@ -213,6 +235,88 @@ void perform_maneuver(motor_t *motors, maneuver_t maneuver, float speeds[4], flo
     }
 }
 
+// Whether a hold keeps the wheels stopped for what drives them now; drive_lock must be held
+static bool drive_held() {
+    return (drive_holds & (timed_move ? TIMED_MOVE_HOLDS : ~0u)) != 0;
+}
+
+void perform_maneuver(motor_t *motors, maneuver_t maneuver, float speeds[4], float speed_scalar) {
+    portENTER_CRITICAL(&drive_lock);
+    requested.motors = motors;
+    requested.maneuver = maneuver;
+    requested.speed_scalar = speed_scalar;
+    if (maneuver == CUSTOM && speeds) {
+        memcpy(requested.speeds, speeds, sizeof(requested.speeds));
+    }
+    // Stopping is always allowed
+    if (maneuver == STOP || !drive_held()) {
+        set_maneuver(motors, maneuver, requested.speeds, speed_scalar);
+    }
+    portEXIT_CRITICAL(&drive_lock);
+}
+
+void motor_hold(motor_t *motors, motor_hold_t reason, bool held) {
+    portENTER_CRITICAL(&drive_lock);
+    bool was_held = drive_held();
+    if (held) {
+        drive_holds |= reason;
+    } else {
+        drive_holds &= ~(uint32_t)reason;
+    }
+    if (drive_held()) {
+        set_maneuver(motors, STOP, NULL, 0);
+    } else if (was_held && !timed_move && requested.motors) {
+        // A timed move sets the wheels again on its next step by itself
+        set_maneuver(requested.motors, requested.maneuver, requested.speeds, requested.speed_scalar);
+    }
+    portEXIT_CRITICAL(&drive_lock);
+}
+
+uint32_t motor_holds() {
+    portENTER_CRITICAL(&drive_lock);
+    uint32_t holds = drive_holds;
+    portEXIT_CRITICAL(&drive_lock);
+    return holds;
+}
+
+static void begin_timed_move(move_clock_t *clock) {
+    portENTER_CRITICAL(&drive_lock);
+    timed_move = true;
+    portEXIT_CRITICAL(&drive_lock);
+    clock->last_us = esp_timer_get_time();
+    clock->elapsed_us = 0;
+}
+
+static void end_timed_move(motor_t *motors) {
+    portENTER_CRITICAL(&drive_lock);
+    timed_move = false;
+    portEXIT_CRITICAL(&drive_lock);
+    perform_maneuver(motors, STOP, NULL, 0);
+}
+
+// How long a timed move has driven so far; time spent held since the last reading does not count
+static int64_t timed_move_elapsed(move_clock_t *clock) {
+    portENTER_CRITICAL(&drive_lock);
+    bool held = drive_held();
+    portEXIT_CRITICAL(&drive_lock);
+
+    int64_t now = esp_timer_get_time();
+    if (!held) {
+        clock->elapsed_us += now - clock->last_us;
+    }
+    clock->last_us = now;
+    return clock->elapsed_us;
+}
+
+// Sets the wheels for one step of a timed move, unless they are held
+static void timed_move_set(motor_t *motors, maneuver_t maneuver, const float speeds[4], float speed_scalar) {
+    portENTER_CRITICAL(&drive_lock);
+    if (!drive_held()) {
+        set_maneuver(motors, maneuver, speeds, speed_scalar);
+    }
+    portEXIT_CRITICAL(&drive_lock);
+}
+
 void outtake_dump(motor_t *outtakeMotor) {
     int64_t start_time = esp_timer_get_time();
     int64_t elapsed_time = 0;
@@ -237,8 +341,7 @@ void outtake_reset(motor_t *outtakeMotor) {
 }
 
 void move_distance_hardcode(motor_t *motors, maneuver_t maneuver, float speed_scalar, double feet) {
-    int64_t start_time = esp_timer_get_time();
-    int64_t elapsed_time = 0;
+    move_clock_t clock;
     double multiplier = 0.0;
     if (maneuver == FORWARD || maneuver == BACKWARD) {
         multiplier = FORWARD_SPEED_CONSTANT;
@@ -246,24 +349,23 @@ void move_distance_hardcode(motor_t *motors, maneuver_t maneuver, float speed_sc
         multiplier = STRAFE_SPEED_CONSTANT;
     }
     int64_t target_time = 1000000 * feet / ((speed_scalar / 25)* multiplier);
-    while (elapsed_time < target_time) {
-        perform_maneuver(motors, maneuver, NULL, speed_scalar);
+    begin_timed_move(&clock);
+    while (timed_move_elapsed(&clock) < target_time) {
+        timed_move_set(motors, maneuver, NULL, speed_scalar);
         vTaskDelay(20);
-        elapsed_time = esp_timer_get_time() - start_time;
     }
-    perform_maneuver(motors, STOP, NULL, 0); 
+    end_timed_move(motors);
 }
 
 void rotate_angle_hardcode(motor_t *motors, maneuver_t maneuver, float speed_scalar, int degrees) {
-    int64_t start_time = esp_timer_get_time();
-    int64_t elapsed_time = 0;
+    move_clock_t clock;
     int64_t target_time = 1000000 * degrees / ((speed_scalar / 25) * ROTATE_SPEED_CONSTANT);
-    while (elapsed_time < target_time) {
-        perform_maneuver(motors, maneuver, NULL, speed_scalar);
+    begin_timed_move(&clock);
+    while (timed_move_elapsed(&clock) < target_time) {
+        timed_move_set(motors, maneuver, NULL, speed_scalar);
         vTaskDelay(20);
-        elapsed_time = esp_timer_get_time() - start_time;
     }
-    perform_maneuver(motors, STOP, NULL, 0); 
+    end_timed_move(motors);
 }
 
 void move_pid_time(motor_t *motors, maneuver_t maneuver, float speed_scalar, double duration_seconds) {
@@ -317,11 +419,12 @@ void move_pid_time(motor_t *motors, maneuver_t maneuver, float speed_scalar, dou
         read_encoder(PCNT_UNIT_3)   // Back Left
     };
     
-    int64_t start_time = esp_timer_get_time();
+    // A held STOP stops the clock too, the targets pick up where they were
+    move_clock_t clock;
+    begin_timed_move(&clock);
     
-    while ((esp_timer_get_time() - start_time) < (duration_seconds * 1e6)) {
-        int64_t now = esp_timer_get_time();
-        double elapsed = (now - start_time) / 1e6;
+    while (timed_move_elapsed(&clock) < (duration_seconds * 1e6)) {
+        double elapsed = clock.elapsed_us / 1e6;
 
         // Compute the evolving target angles for each motor
         double target_angle = target_velocity * elapsed;
@@ -348,11 +451,13 @@ void move_pid_time(motor_t *motors, maneuver_t maneuver, float speed_scalar, dou
             pid_compute(&pid_bl, target[3], current[3])
         };
 
+        float speeds[4];
         for (int i = 0; i < 4; i++) {
-            dc_set_speed(&motors[i], -output[i]); // Invert the output for the correct direction
+            speeds[i] = -output[i]; // Invert the output for the correct direction
         }
+        timed_move_set(motors, CUSTOM, speeds, 1);
         vTaskDelay(pdMS_TO_TICKS(UPDATE_INTERVAL_MS));
     }
-    perform_maneuver(motors, STOP, NULL, 0);
+    end_timed_move(motors);
 }
 
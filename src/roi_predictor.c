@@ -0,0 +1,74 @@
+#include "roi_predictor.h"
+
+#include <math.h>
+#include <string.h>
+
+void roi_predictor_reset(roi_predictor_t *predictor) {
+    memset(predictor, 0, sizeof(*predictor));
+}
+
+void roi_predictor_observe(roi_predictor_t *predictor, const double pts[4][2], int fID, int64_t now_us) {
+    double min_x = pts[0][0], max_x = pts[0][0];
+    double min_y = pts[0][1], max_y = pts[0][1];
+    for (int i = 1; i < 4; ++i) {
+        min_x = fmin(min_x, pts[i][0]);
+        max_x = fmax(max_x, pts[i][0]);
+        min_y = fmin(min_y, pts[i][1]);
+        max_y = fmax(max_y, pts[i][1]);
+    }
+    double cx = (min_x + max_x) / 2;
+    double cy = (min_y + max_y) / 2;
+
+    // Only track velocity across frames of the same tag close enough together to be meaningful
+    int64_t dt_us = now_us - predictor->seen_us;
+    if (predictor->valid && predictor->fID == fID && dt_us > 0 && dt_us <= ROI_MAX_AGE_US) {
+        double vx = (cx - predictor->cx) * 1e6 / dt_us;
+        double vy = (cy - predictor->cy) * 1e6 / dt_us;
+        predictor->vx += ROI_VELOCITY_ALPHA * (vx - predictor->vx);
+        predictor->vy += ROI_VELOCITY_ALPHA * (vy - predictor->vy);
+    } else {
+        predictor->vx = 0;
+        predictor->vy = 0;
+    }
+
+    predictor->valid = true;
+    predictor->fID = fID;
+    predictor->cx = cx;
+    predictor->cy = cy;
+    predictor->w = max_x - min_x;
+    predictor->h = max_y - min_y;
+    predictor->seen_us = now_us;
+}
+
+static int16_t clamp_i16(double value) {
+    return (int16_t)fmax(INT16_MIN, fmin(INT16_MAX, round(value)));
+}
+
+bool roi_predictor_predict(const roi_predictor_t *predictor, roi_motion_t motion, int64_t at_us,
+                           spi_roi_hint_t *out) {
+    if (!predictor->valid || at_us - predictor->seen_us > ROI_MAX_AGE_US) return false;
+
+    double lead = (double)(at_us - predictor->seen_us);
+    if (lead < 0) lead = 0;
+    if (lead > ROI_MAX_LEAD_US) lead = ROI_MAX_LEAD_US;
+    lead /= 1e6;
+
+    double cx = predictor->cx + predictor->vx * lead;
+    double cy = predictor->cy + predictor->vy * lead;
+    // The further the tag may have travelled, the less sure the guess
+    double half_w = predictor->w * (0.5 + ROI_MARGIN) + fabs(predictor->vx) * lead;
+    double half_h = predictor->h * (0.5 + ROI_MARGIN) + fabs(predictor->vy) * lead;
+    if (motion == ROI_MOTION_LATERAL) {
+        half_w += predictor->w * ROI_MOTION_MARGIN;
+    } else if (motion == ROI_MOTION_APPROACH) {
+        half_w += predictor->w * ROI_MOTION_MARGIN / 2;
+        half_h += predictor->h * ROI_MOTION_MARGIN / 2;
+    }
+
+    out->x = clamp_i16(cx - half_w);
+    out->y = clamp_i16(cy - half_h);
+    out->w = (uint16_t)fmin(UINT16_MAX, round(2 * half_w));
+    out->h = (uint16_t)fmin(UINT16_MAX, round(2 * half_h));
+    out->fID = (int16_t)predictor->fID;
+    return true;
+}
@@ -0,0 +1,1102 @@
+#include "spi_protocol.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint16_t crc16_nibble_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t spi_crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc << 4) ^ crc16_nibble_table[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc16_nibble_table[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+bool spi_frame_header_decode(const uint8_t *buf, size_t len, spi_frame_header_t *out) {
+    if (!buf || len < sizeof(spi_frame_header_t) || buf[0] != SPI_FRAME_MAGIC) return false;
+
+    spi_frame_header_t header;
+    memcpy(&header, buf, sizeof(header));
+    if ((uint8_t)spi_crc16(buf, offsetof(spi_frame_header_t, check)) != header.check) return false;
+    if (header.length == 0) return false;
+
+    if (out) *out = header;
+    return true;
+}
+
+size_t spi_frame_header_encode(uint16_t seq, uint16_t length, uint8_t *buf, size_t len) {
+    if (!buf || len < sizeof(spi_frame_header_t)) return 0;
+
+    spi_frame_header_t header = {
+        .magic = SPI_FRAME_MAGIC,
+        .seq = seq,
+        .length = length
+    };
+    header.check = (uint8_t)spi_crc16((const uint8_t *)&header, offsetof(spi_frame_header_t, check));
+
+    memcpy(buf, &header, sizeof(header));
+    return sizeof(header);
+}
+
+size_t spi_priority_encode(spi_priority_command_t command, uint8_t arg, uint16_t seq, uint8_t *buf, size_t len) {
+    if (!buf || len < sizeof(spi_priority_t)) return 0;
+
+    spi_priority_t priority = {
+        .magic = SPI_PRIORITY_MAGIC,
+        .type = SPI_MSG_PRIORITY,
+        .command = (uint8_t)command,
+        .arg = arg,
+        .seq = seq
+    };
+    priority.crc = spi_crc16((const uint8_t *)&priority, offsetof(spi_priority_t, crc));
+
+    memset(buf, 0, len);
+    memcpy(buf, &priority, sizeof(priority));
+    return len;
+}
+
+bool spi_priority_decode(const uint8_t *buf, size_t len, spi_priority_t *out) {
+    if (!buf || len < sizeof(spi_priority_t)) return false;
+    if (buf[0] != SPI_PRIORITY_MAGIC || buf[1] != SPI_MSG_PRIORITY) return false;
+
+    spi_priority_t priority;
+    memcpy(&priority, buf, sizeof(priority));
+    if (spi_crc16(buf, offsetof(spi_priority_t, crc)) != priority.crc) return false;
+    // The padding makes a stray match inside frame data even less likely
+    for (size_t i = sizeof(priority); i < len; ++i) {
+        if (buf[i] != 0) return false;
+    }
+
+    if (out) *out = priority;
+    return true;
+}
+
+bool vision_frame_decode_binary(const uint8_t *buf, size_t len, vision_frame_t *out) {
+    if (!buf || !out || len < sizeof(vision_frame_bin_t)) return false;
+
+    // Copy out of the receive buffer so the float fields are aligned
+    vision_frame_bin_t bin;
+    memcpy(&bin, buf, sizeof(bin));
+
+    if (bin.type != SPI_MSG_BINARY || bin.version != VISION_BIN_VERSION) return false;
+    if (spi_crc16(buf, offsetof(vision_frame_bin_t, crc)) != bin.crc) return false;
+    if (bin.target >= VISION_TARGET_COUNT) return false;
+
+    out->target     = (vision_target_t)bin.target;
+    out->pID        = bin.pID;
+    out->v          = bin.v;
+    out->fID        = bin.fID;
+    out->capture_us = bin.capture_us;
+#define X(NAME, name, key) out->name = bin.name;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    for (int i = 0; i < 4; ++i) {
+        out->pts[i][0] = bin.pts[i][0] / VISION_BIN_PTS_SCALE;
+        out->pts[i][1] = bin.pts[i][1] / VISION_BIN_PTS_SCALE;
+    }
+    out->valid = VISION_FIELDS_ALL;
+    return true;
+}
+
+size_t vision_frame_encode_binary(const vision_frame_t *frame, uint8_t *buf, size_t len) {
+    if (!frame || !buf || len < sizeof(vision_frame_bin_t)) return 0;
+
+    vision_frame_bin_t bin;
+    memset(&bin, 0, sizeof(bin));
+    bin.type       = SPI_MSG_BINARY;
+    bin.version    = VISION_BIN_VERSION;
+    bin.target     = (uint8_t)frame->target;
+    bin.pID        = (uint8_t)frame->pID;
+    bin.v          = (uint8_t)frame->v;
+    bin.fID        = (int16_t)frame->fID;
+    bin.capture_us = frame->capture_us;
+#define X(NAME, name, key) bin.name = (float)frame->name;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    for (int i = 0; i < 4; ++i) {
+        bin.pts[i][0] = (int16_t)lround(frame->pts[i][0] * VISION_BIN_PTS_SCALE);
+        bin.pts[i][1] = (int16_t)lround(frame->pts[i][1] * VISION_BIN_PTS_SCALE);
+    }
+    bin.crc = spi_crc16((const uint8_t *)&bin, offsetof(vision_frame_bin_t, crc));
+
+    memcpy(buf, &bin, sizeof(bin));
+    return sizeof(bin);
+}
+
+// Wire size of each vision_field_t
+static const uint8_t vision_field_size[VISION_FIELD_COUNT] = {
+    [VISION_FIELD_TARGET] = 1, [VISION_FIELD_PID] = 1, [VISION_FIELD_V] = 1, [VISION_FIELD_FID] = 2,
+#define X(NAME, name, key) [VISION_FIELD_##NAME] = 4,
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    [VISION_FIELD_PT0] = 4, [VISION_FIELD_PT1] = 4, [VISION_FIELD_PT2] = 4, [VISION_FIELD_PT3] = 4
+};
+
+// Metric fields in vision_field_t order, starting at VISION_FIELD_TA
+static double *vision_field_metric(vision_frame_t *frame, int field) {
+    switch (field) {
+#define X(NAME, name, key) case VISION_FIELD_##NAME: return &frame->name;
+        VISION_SCHEMA_METRICS(X)
+#undef X
+        default: return NULL;
+    }
+}
+
+static void vision_field_write(vision_frame_t *frame, int field, uint8_t *out) {
+    if (field == VISION_FIELD_TARGET) {
+        out[0] = (uint8_t)frame->target;
+    } else if (field == VISION_FIELD_PID) {
+        out[0] = (uint8_t)frame->pID;
+    } else if (field == VISION_FIELD_V) {
+        out[0] = (uint8_t)frame->v;
+    } else if (field == VISION_FIELD_FID) {
+        int16_t fID = (int16_t)frame->fID;
+        memcpy(out, &fID, sizeof(fID));
+    } else if (field >= VISION_FIELD_PT0) {
+        int16_t pt[2] = {
+            (int16_t)lround(frame->pts[field - VISION_FIELD_PT0][0] * VISION_BIN_PTS_SCALE),
+            (int16_t)lround(frame->pts[field - VISION_FIELD_PT0][1] * VISION_BIN_PTS_SCALE)
+        };
+        memcpy(out, pt, sizeof(pt));
+    } else {
+        float value = (float)*vision_field_metric(frame, field);
+        memcpy(out, &value, sizeof(value));
+    }
+}
+
+static void vision_field_read(vision_frame_t *frame, int field, const uint8_t *in) {
+    if (field == VISION_FIELD_TARGET) {
+        frame->target = (vision_target_t)in[0];
+    } else if (field == VISION_FIELD_PID) {
+        frame->pID = in[0];
+    } else if (field == VISION_FIELD_V) {
+        frame->v = in[0];
+    } else if (field == VISION_FIELD_FID) {
+        int16_t fID;
+        memcpy(&fID, in, sizeof(fID));
+        frame->fID = fID;
+    } else if (field >= VISION_FIELD_PT0) {
+        int16_t pt[2];
+        memcpy(pt, in, sizeof(pt));
+        frame->pts[field - VISION_FIELD_PT0][0] = pt[0] / VISION_BIN_PTS_SCALE;
+        frame->pts[field - VISION_FIELD_PT0][1] = pt[1] / VISION_BIN_PTS_SCALE;
+    } else {
+        float value;
+        memcpy(&value, in, sizeof(value));
+        *vision_field_metric(frame, field) = value;
+    }
+}
+
+size_t vision_frame_encode_delta(const vision_frame_t *frame, vision_frame_t *reference, uint16_t seq,
+                                 bool keyframe, double tolerance, uint32_t fields, uint8_t *buf, size_t len) {
+    if (!frame || !reference || !buf || len < VISION_DELTA_MAX_SIZE) return 0;
+
+    // Compare wire values so quantization never counts as a change
+    vision_frame_t current = *frame;
+    vision_delta_header_t header = {
+        .type = SPI_MSG_DELTA,
+        .flags = keyframe ? VISION_DELTA_FLAG_KEYFRAME : 0,
+        .seq = seq,
+        .back = keyframe ? 0 : 1
+    };
+    uint8_t values[VISION_FIELD_COUNT][4];
+    size_t fields_size = 0;
+    for (int field = 0; field < VISION_FIELD_COUNT; ++field) {
+        if (!(fields & (1u << field))) continue;
+
+        uint8_t before[4];
+        vision_field_write(&current, field, values[field]);
+        vision_field_write(reference, field, before);
+
+        bool changed = memcmp(values[field], before, vision_field_size[field]) != 0;
+        double *metric = vision_field_metric(&current, field);
+        if (changed && metric && fabs(*metric - *vision_field_metric(reference, field)) < tolerance) {
+            changed = false;
+        }
+        if (!keyframe && !changed) continue;
+
+        header.mask |= 1u << field;
+        fields_size += vision_field_size[field];
+    }
+
+    // The fields are picked first: the capture time only goes in if the frame still fits
+    size_t used = sizeof(header);
+    if (frame->capture_us && used + sizeof(frame->capture_us) + fields_size + sizeof(uint16_t) <= len) {
+        header.flags |= VISION_DELTA_FLAG_CAPTURE;
+        memcpy(buf + used, &frame->capture_us, sizeof(frame->capture_us));
+        used += sizeof(frame->capture_us);
+    }
+    for (int field = 0; field < VISION_FIELD_COUNT; ++field) {
+        if (!(header.mask & (1u << field))) continue;
+        memcpy(buf + used, values[field], vision_field_size[field]);
+        used += vision_field_size[field];
+        vision_field_read(reference, field, values[field]);
+    }
+
+    memcpy(buf, &header, sizeof(header));
+    uint16_t crc = spi_crc16(buf, used);
+    memcpy(buf + used, &crc, sizeof(crc));
+    return used + sizeof(crc);
+}
+
+vision_delta_result_t vision_frame_apply_delta(const uint8_t *buf, size_t len, vision_frame_t *state,
+                                               uint16_t *seq, bool have_state, uint32_t fields) {
+    if (!buf || !state || !seq || len < sizeof(vision_delta_header_t) + sizeof(uint16_t)) {
+        return VISION_DELTA_INVALID;
+    }
+
+    vision_delta_header_t header;
+    memcpy(&header, buf, sizeof(header));
+    if (header.type != SPI_MSG_DELTA || (header.mask & ~VISION_FIELDS_ALL)) return VISION_DELTA_INVALID;
+
+    bool has_capture = header.flags & VISION_DELTA_FLAG_CAPTURE;
+    size_t used = sizeof(header) + (has_capture ? sizeof(uint32_t) : 0);
+    for (int field = 0; field < VISION_FIELD_COUNT; ++field) {
+        if (header.mask & (1u << field)) {
+            used += vision_field_size[field];
+        }
+    }
+    uint16_t crc;
+    if (used + sizeof(crc) > len) return VISION_DELTA_INVALID;
+    memcpy(&crc, buf + used, sizeof(crc));
+    if (spi_crc16(buf, used) != crc) return VISION_DELTA_INVALID;
+
+    bool keyframe = header.flags & VISION_DELTA_FLAG_KEYFRAME;
+    if (!keyframe && (!have_state || (uint16_t)(header.seq - header.back) != *seq)) {
+        return VISION_DELTA_STALE;
+    }
+
+    // A keyframe starts over; a delta keeps only the unchanged fields the sender still encodes
+    vision_frame_t merged = keyframe ? (vision_frame_t){0} : *state;
+    merged.valid &= fields;
+    merged.capture_us = 0;
+    used = sizeof(header);
+    if (has_capture) {
+        memcpy(&merged.capture_us, buf + used, sizeof(merged.capture_us));
+        used += sizeof(merged.capture_us);
+    }
+    for (int field = 0; field < VISION_FIELD_COUNT; ++field) {
+        if (header.mask & (1u << field)) {
+            vision_field_read(&merged, field, buf + used);
+            used += vision_field_size[field];
+        }
+    }
+    if (merged.target >= VISION_TARGET_COUNT) return VISION_DELTA_INVALID;
+    merged.valid |= header.mask;
+
+    *state = merged;
+    *seq = header.seq;
+    return keyframe ? VISION_DELTA_KEYFRAME : VISION_DELTA_APPLIED;
+}
+
+/*
+ * JSON vision documents are decoded by a state machine that can be fed the
+ * document in pieces, so the SPI task decodes each chunk as it arrives.
+ * Nothing is allocated and nothing fed to it has to stay around: keys and
+ * numbers that straddle two pieces are kept in the decoder. Only the
+ * containers where the document layout has vision data are read into,
+ * everything else is stepped over after a bracket and grammar check.
+ */
+
+// Grammar states
+enum {
+    JSON_S_START = 0,           // Before the document's opening brace
+    JSON_S_VALUE,               // After ':' or ',' in an array
+    JSON_S_VALUE_OR_CLOSE,      // After '['
+    JSON_S_KEY_OR_CLOSE,        // After '{'
+    JSON_S_KEY,                 // After ',' in an object
+    JSON_S_COLON,
+    JSON_S_NEXT,                // After a value
+    JSON_S_DONE,
+    JSON_S_ERROR
+};
+
+// Token being read
+enum {
+    JSON_T_NONE = 0,
+    JSON_T_STRING,
+    JSON_T_KEY,
+    JSON_T_NUMBER,
+    JSON_T_LITERAL
+};
+
+// Number grammar, 0 ends the number
+enum {
+    JSON_N_END = 0,
+    JSON_N_START,
+    JSON_N_SIGN,
+    JSON_N_ZERO,
+    JSON_N_INT,
+    JSON_N_DOT,
+    JSON_N_FRAC,
+    JSON_N_E,
+    JSON_N_ESIGN,
+    JSON_N_EXP
+};
+
+// Keys the decoder reads: the pipelines follow JSON_K_TARGET in vision_target_t
+// order, from the first after NONE, and the metrics JSON_K_METRIC in vision_field_t order
+enum {
+    JSON_K_OTHER = 0,
+    JSON_K_TS,
+    JSON_K_PID,
+    JSON_K_V,
+    JSON_K_FID,
+    JSON_K_PTS,
+    JSON_K_TARGET,
+    JSON_K_METRIC = JSON_K_TARGET + VISION_TARGET_COUNT - 1
+};
+
+// Where a number goes, the metrics follow JSON_SLOT_METRIC in vision_field_t order
+enum {
+    JSON_SLOT_NONE = 0,
+    JSON_SLOT_TS,
+    JSON_SLOT_PID,
+    JSON_SLOT_V,
+    JSON_SLOT_FID,
+    JSON_SLOT_X,
+    JSON_SLOT_Y,
+    JSON_SLOT_METRIC
+};
+
+// Depth of each container the decoder reads into
+enum {
+    JSON_DEPTH_TOP = 1,         // The document
+    JSON_DEPTH_TARGETS,         // A pipeline, "Fiducial" or "Retro"
+    JSON_DEPTH_TARGET,          // An entry of one: the first, or any fiducial
+    JSON_DEPTH_PTS,             // Its "pts"
+    JSON_DEPTH_CORNER           // One [x, y] of them
+};
+
+_Static_assert(JSON_DEPTH_CORNER < sizeof(((vision_json_stream_t *)0)->entries), "entries too short");
+
+// Bracket that opens the container read into at each depth, by the depth of its parent
+static const char json_stream_opens[JSON_DEPTH_CORNER] = { '{', '[', '{', '[', '[' };
+
+// Whether the key just read is the literal 'name'; the length is known when
+// this compiles, so keys of another length cost one comparison and the rest
+// are compared as a few words
+#define JSON_KEY_IS(s, name) ((s)->text_len == sizeof(name) - 1 && memcmp((s)->text, name, sizeof(name) - 1) == 0)
+
+#define X(NAME, name, key) _Static_assert(sizeof(key) - 1 <= VISION_JSON_KEY_LEN, "JSON key " key " is too long");
+VISION_SCHEMA_TARGETS(X)
+VISION_SCHEMA_METRICS(X)
+#undef X
+
+// Powers of ten a double holds exactly
+static const double json_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool json_digit(char ch) {
+    return ch >= '0' && ch <= '9';
+}
+
+static inline bool json_space(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+// Converts number text that follows the JSON grammar, terminated after 'len' characters
+static double json_number_value(const char *text, size_t len) {
+    // Up to 15 digits without an exponent: the digits and the power of ten
+    // are both exact, so one division rounds the same as strtod
+    uint64_t digits = 0;
+    int count = 0;
+    int decimals = -1;
+    const char *p = text + (*text == '-');
+    for (; p < text + len && count <= 15; ++p) {
+        if (*p == '.') {
+            decimals = 0;
+        } else if (json_digit(*p)) {
+            digits = digits * 10 + (uint64_t)(*p - '0');
+            ++count;
+            if (decimals >= 0) ++decimals;
+        } else {
+            break;
+        }
+    }
+    if (p == text + len && count <= 15) {
+        double magnitude = decimals > 0 ? (double)digits / json_pow10[decimals] : (double)digits;
+        return *text == '-' ? -magnitude : magnitude;
+    }
+    return strtod(text, NULL);
+}
+
+// The key just read, by the object it is in
+static uint8_t json_stream_key(vision_json_stream_t *s) {
+    if (s->skip_depth || s->text_len > VISION_JSON_KEY_LEN) return JSON_K_OTHER;
+    if (s->depth == JSON_DEPTH_TOP) {
+        if (JSON_KEY_IS(s, "ts")) return JSON_K_TS;
+        if (JSON_KEY_IS(s, "pID")) return JSON_K_PID;
+        if (JSON_KEY_IS(s, "v")) return JSON_K_V;
+#define X(NAME, name, key) if (JSON_KEY_IS(s, key)) return JSON_K_TARGET + VISION_TARGET_##NAME - 1;
+        VISION_SCHEMA_TARGETS(X)
+#undef X
+    } else if (s->depth == JSON_DEPTH_TARGET) {
+        if (JSON_KEY_IS(s, "fID")) return JSON_K_FID;
+        if (JSON_KEY_IS(s, "pts")) return JSON_K_PTS;
+#define X(NAME, name, key) if (JSON_KEY_IS(s, key)) return JSON_K_METRIC + VISION_FIELD_##NAME - VISION_FIELD_TA;
+        VISION_SCHEMA_METRICS(X)
+#undef X
+    }
+    return JSON_K_OTHER;
+}
+
+// Takes 'ch' into the number being read, false once it is not part of it
+static bool json_stream_number_char(vision_json_stream_t *s, char ch) {
+    bool digit = json_digit(ch);
+    bool exponent = ch == 'e' || ch == 'E';
+    uint8_t next = JSON_N_END;
+    switch (s->number_state) {
+        case JSON_N_START:  next = ch == '-' ? JSON_N_SIGN : ch == '0' ? JSON_N_ZERO : digit ? JSON_N_INT : 0; break;
+        case JSON_N_SIGN:   next = ch == '0' ? JSON_N_ZERO : digit ? JSON_N_INT : 0; break;
+        case JSON_N_ZERO:   next = ch == '.' ? JSON_N_DOT : exponent ? JSON_N_E : 0; break;
+        case JSON_N_INT:    next = digit ? JSON_N_INT : ch == '.' ? JSON_N_DOT : exponent ? JSON_N_E : 0; break;
+        case JSON_N_DOT:    next = digit ? JSON_N_FRAC : 0; break;
+        case JSON_N_FRAC:   next = digit ? JSON_N_FRAC : exponent ? JSON_N_E : 0; break;
+        case JSON_N_E:      next = ch == '+' || ch == '-' ? JSON_N_ESIGN : digit ? JSON_N_EXP : 0; break;
+        case JSON_N_ESIGN:
+        case JSON_N_EXP:    next = digit ? JSON_N_EXP : 0; break;
+    }
+    if (next == JSON_N_END) return false;
+    s->number_state = next;
+    if (s->slot != JSON_SLOT_NONE) {
+        if (s->text_len < VISION_JSON_NUMBER_LEN) {
+            s->text[s->text_len++] = ch;
+        } else {
+            s->text_len = VISION_JSON_NUMBER_LEN + 1;
+        }
+    }
+    return true;
+}
+
+// Starts the value whose first character is 'ch'
+static bool json_stream_value(vision_json_stream_t *s, char ch) {
+    // What the value is read into follows from where it sits
+    bool read = false;
+    uint8_t slot = JSON_SLOT_NONE;
+    if (!s->skip_depth) {
+        switch (s->depth) {
+            case 0:
+                read = true;
+                break;
+            case JSON_DEPTH_TOP:
+                if (s->key == JSON_K_TS) slot = JSON_SLOT_TS;
+                if (s->key == JSON_K_PID) slot = JSON_SLOT_PID;
+                if (s->key == JSON_K_V) slot = JSON_SLOT_V;
+                if (s->key >= JSON_K_TARGET && s->key < JSON_K_METRIC) {
+                    s->target = s->key - JSON_K_TARGET;
+                    read = !s->have_target[s->target];
+                }
+                break;
+            case JSON_DEPTH_TARGETS:
+                // Whatever the first entry is, it is the target; every fiducial goes in tags
+                if (s->entries[JSON_DEPTH_TARGETS] == 0) {
+                    s->have_target[s->target] = true;
+                    read = true;
+                } else {
+                    read = s->target == VISION_TARGET_FIDUCIAL - 1;
+                }
+                break;
+            case JSON_DEPTH_TARGET:
+                if (s->key == JSON_K_FID) slot = JSON_SLOT_FID;
+                if (s->key >= JSON_K_METRIC) slot = JSON_SLOT_METRIC + (s->key - JSON_K_METRIC);
+                read = s->key == JSON_K_PTS;
+                break;
+            case JSON_DEPTH_PTS:
+                read = s->entries[JSON_DEPTH_PTS] < 4;
+                s->xy_numbers = 0;
+                break;
+            case JSON_DEPTH_CORNER:
+                if (s->entries[JSON_DEPTH_CORNER] < 2) slot = JSON_SLOT_X + s->entries[JSON_DEPTH_CORNER];
+                break;
+        }
+    }
+
+    if (ch == '{' || ch == '[') {
+        if (s->depth == VISION_JSON_MAX_DEPTH) return false;
+        bool into = read && s->depth < JSON_DEPTH_CORNER && ch == json_stream_opens[s->depth];
+        s->objects = (s->objects << 1) | (ch == '{');
+        ++s->depth;
+        if (into) {
+            s->entries[s->depth] = 0;
+            if (s->depth == JSON_DEPTH_TARGET) memset(&s->entry, 0, sizeof(s->entry));
+        } else if (!s->skip_depth) {
+            s->skip_depth = s->depth;
+        }
+        s->state = ch == '{' ? JSON_S_KEY_OR_CLOSE : JSON_S_VALUE_OR_CLOSE;
+    } else if (s->depth == 0) {
+        return false;  // The document has to be an object
+    } else if (ch == '"') {
+        s->token = JSON_T_STRING;
+    } else if (ch == '-' || json_digit(ch)) {
+        s->token = JSON_T_NUMBER;
+        s->number_state = JSON_N_START;
+        s->slot = slot;
+        s->text_len = 0;
+        json_stream_number_char(s, ch);
+    } else if (ch == 't' || ch == 'f' || ch == 'n') {
+        s->token = JSON_T_LITERAL;
+        s->literal = ch == 't' ? "rue" : ch == 'f' ? "alse" : "ull";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Files the pipeline entry just read: the first of each pipeline is its target, and fiducials go in tags
+static void json_stream_entry_end(vision_json_stream_t *s) {
+    if (s->entries[JSON_DEPTH_TARGETS] == 0) s->targets[s->target] = s->entry;
+    if (s->target == VISION_TARGET_FIDUCIAL - 1) {
+        s->entry.target = VISION_TARGET_FIDUCIAL;
+        s->entry.valid |= 1u << VISION_FIELD_TARGET;
+        vision_tags_add(&s->tags, &s->entry);
+    }
+}
+
+// Ends the container 'ch' closes
+static bool json_stream_close(vision_json_stream_t *s, char ch) {
+    if (s->depth == 0 || (s->objects & 1) != (ch == '}')) return false;
+    if (!s->skip_depth && s->depth == JSON_DEPTH_CORNER && s->xy_numbers == 2) {
+        int corner = s->entries[JSON_DEPTH_PTS];
+        s->entry.pts[corner][0] = s->xy[0];
+        s->entry.pts[corner][1] = s->xy[1];
+        s->entry.valid |= 1u << (VISION_FIELD_PT0 + corner);
+    } else if (!s->skip_depth && s->depth == JSON_DEPTH_TARGET) {
+        json_stream_entry_end(s);
+    }
+    s->objects >>= 1;
+    if (--s->depth < s->skip_depth) {
+        s->skip_depth = 0;
+    }
+    s->state = s->depth == 0 ? JSON_S_DONE : JSON_S_NEXT;
+    return true;
+}
+
+// Stores the number just read where it goes
+// Converts a number for an int field; one outside int's range has no value
+// the cast could give, so the document is rejected instead
+static bool json_int_value(double value, int *out) {
+    if (!isfinite(value) || value < INT_MIN || value > INT_MAX) return false;
+    *out = (int)value;
+    return true;
+}
+
+static bool json_stream_number_end(vision_json_stream_t *s) {
+    uint8_t state = s->number_state;
+    if (state != JSON_N_ZERO && state != JSON_N_INT && state != JSON_N_FRAC && state != JSON_N_EXP) return false;
+    if (s->slot == JSON_SLOT_NONE) return true;
+    if (s->text_len > VISION_JSON_NUMBER_LEN) return false;
+
+    s->text[s->text_len] = '\0';
+    double value = json_number_value(s->text, s->text_len);
+    vision_frame_t *target = &s->entry;
+    if (s->slot == JSON_SLOT_TS) {
+        // Any 64-bit clock reading keeps its low 32 bits; past that it is no clock
+        if (!isfinite(value) || value >= 0x1p64) return false;
+        s->frame.capture_us = value > 0 ? (uint32_t)(uint64_t)value : 0;
+    } else if (s->slot == JSON_SLOT_PID) {
+        if (!json_int_value(value, &s->frame.pID)) return false;
+        s->frame.valid |= 1u << VISION_FIELD_PID;
+    } else if (s->slot == JSON_SLOT_V) {
+        if (!json_int_value(value, &s->frame.v)) return false;
+        s->frame.valid |= 1u << VISION_FIELD_V;
+    } else if (s->slot == JSON_SLOT_FID) {
+        if (!json_int_value(value, &target->fID)) return false;
+        target->valid |= 1u << VISION_FIELD_FID;
+    } else if (s->slot >= JSON_SLOT_METRIC) {
+        int field = VISION_FIELD_TA + (s->slot - JSON_SLOT_METRIC);
+        *vision_field_metric(target, field) = value;
+        target->valid |= 1u << field;
+    } else {
+        s->xy[s->slot - JSON_SLOT_X] = value;
+        ++s->xy_numbers;
+    }
+    return true;
+}
+
+void vision_json_stream_begin(vision_json_stream_t *stream) {
+    memset(stream, 0, sizeof(*stream));
+    stream->state = JSON_S_START;
+}
+
+bool vision_json_stream_feed(vision_json_stream_t *stream, const char *data, size_t len) {
+    vision_json_stream_t *s = stream;
+    const char *p = data;
+    const char *end = data + len;
+    while (p < end && s->state != JSON_S_DONE && s->state != JSON_S_ERROR) {
+        char ch = *p;
+        if (s->token == JSON_T_STRING || s->token == JSON_T_KEY) {
+            bool key = s->token == JSON_T_KEY;
+            while (p < end) {
+                ch = *p++;
+                if (s->escape) {
+                    // Vision keys have no escapes, a key with one is not one of them
+                    s->escape = false;
+                    if (key) s->text_len = VISION_JSON_KEY_LEN + 1;
+                } else if (ch == '"') {
+                    s->token = JSON_T_NONE;
+                    if (key) {
+                        s->key = json_stream_key(s);
+                        s->state = JSON_S_COLON;
+                    } else {
+                        s->state = JSON_S_NEXT;
+                    }
+                    break;
+                } else if (ch == '\\') {
+                    s->escape = true;
+                } else if ((unsigned char)ch < 0x20) {
+                    s->state = JSON_S_ERROR;
+                    break;
+                } else if (key && s->text_len <= VISION_JSON_KEY_LEN) {
+                    s->text[s->text_len++] = ch;
+                }
+            }
+            continue;
+        }
+        if (s->token == JSON_T_NUMBER) {
+            while (p < end && json_stream_number_char(s, *p)) ++p;
+            if (p == end) break;
+            // The character after the number is read again below
+            s->token = JSON_T_NONE;
+            s->state = json_stream_number_end(s) ? JSON_S_NEXT : JSON_S_ERROR;
+            continue;
+        }
+        if (s->token == JSON_T_LITERAL) {
+            ++p;
+            if (ch != *s->literal++) {
+                s->state = JSON_S_ERROR;
+            } else if (*s->literal == '\0') {
+                s->token = JSON_T_NONE;
+                s->state = JSON_S_NEXT;
+            }
+            continue;
+        }
+
+        ++p;
+        if (json_space(ch)) continue;
+        bool ok = false;
+        switch (s->state) {
+            case JSON_S_START:
+                ok = ch == '{' && json_stream_value(s, ch);
+                break;
+            case JSON_S_VALUE:
+                ok = json_stream_value(s, ch);
+                break;
+            case JSON_S_VALUE_OR_CLOSE:
+                ok = ch == ']' ? json_stream_close(s, ch) : json_stream_value(s, ch);
+                break;
+            case JSON_S_KEY_OR_CLOSE:
+            case JSON_S_KEY:
+                if (ch == '}' && s->state == JSON_S_KEY_OR_CLOSE) {
+                    ok = json_stream_close(s, ch);
+                } else if (ch == '"') {
+                    s->token = JSON_T_KEY;
+                    s->text_len = 0;
+                    ok = true;
+                }
+                break;
+            case JSON_S_COLON:
+                ok = ch == ':';
+                s->state = JSON_S_VALUE;
+                break;
+            case JSON_S_NEXT:
+                if (ch == ',') {
+                    ok = true;
+                    if (s->objects & 1) {
+                        s->state = JSON_S_KEY;
+                    } else {
+                        s->state = JSON_S_VALUE;
+                        if (s->depth < sizeof(s->entries) && s->entries[s->depth] < UINT8_MAX) {
+                            ++s->entries[s->depth];
+                        }
+                    }
+                } else if (ch == '}' || ch == ']') {
+                    ok = json_stream_close(s, ch);
+                }
+                break;
+        }
+        if (!ok) {
+            s->state = JSON_S_ERROR;
+        }
+    }
+    return s->state != JSON_S_ERROR;
+}
+
+bool vision_json_stream_finish(const vision_json_stream_t *stream, vision_frame_t *out) {
+    if (!stream || !out || stream->state != JSON_S_DONE) return false;
+
+    // Pipelines listed first win wherever they came in the document, a fiducial over a retro target
+    int target = 0;
+    while (target < VISION_TARGET_COUNT - 1 && !stream->have_target[target]) ++target;
+    if (target == VISION_TARGET_COUNT - 1) {
+        *out = stream->frame;
+        return true;
+    }
+    *out = stream->targets[target];
+    out->target = (vision_target_t)(target + 1);
+    out->pID = stream->frame.pID;
+    out->v = stream->frame.v;
+    out->capture_us = stream->frame.capture_us;
+    out->valid |= stream->frame.valid | (1u << VISION_FIELD_TARGET);
+    return true;
+}
+
+bool vision_frame_decode_json(const char *json, size_t len, vision_frame_t *out) {
+    if (!json || !out) return false;
+    vision_json_stream_t stream;
+    vision_json_stream_begin(&stream);
+    vision_json_stream_feed(&stream, json, len);
+    return vision_json_stream_finish(&stream, out);
+}
+
+bool vision_frame_equal(const vision_frame_t *a, const vision_frame_t *b) {
+    bool equal = a->target == b->target && a->pID == b->pID && a->v == b->v && a->fID == b->fID &&
+                 a->capture_us == b->capture_us && a->valid == b->valid &&
+                 memcmp(a->pts, b->pts, sizeof(a->pts)) == 0;
+#define X(NAME, name, key) equal = equal && memcmp(&a->name, &b->name, sizeof(a->name)) == 0;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+    return equal;
+}
+
+// Slot a lookup for tag 'fID' starts from, see vision_tags_t
+static inline unsigned vision_tags_home(int fID) {
+    return (unsigned)fID & (VISION_MAX_TAGS - 1);
+}
+
+bool vision_tags_add(vision_tags_t *tags, const vision_frame_t *tag) {
+    if (!tags || !tag || !(tag->valid & (1u << VISION_FIELD_FID)) || tag->fID < 0) return false;
+    unsigned slot = vision_tags_home(tag->fID);
+    for (int i = 0; i < VISION_MAX_TAGS; ++i, slot = (slot + 1) & (VISION_MAX_TAGS - 1)) {
+        vision_frame_t *entry = &tags->slots[slot];
+        if (entry->valid && entry->fID == tag->fID) return false;
+        if (!entry->valid) {
+            *entry = *tag;
+            ++tags->count;
+            return true;
+        }
+    }
+    return false;
+}
+
+const vision_frame_t *vision_tags_find(const vision_tags_t *tags, int fID) {
+    if (!tags || fID < 0) return NULL;
+    unsigned slot = vision_tags_home(fID);
+    // Bounded even on a table being rewritten under a seqlock reader
+    for (int i = 0; i < VISION_MAX_TAGS; ++i, slot = (slot + 1) & (VISION_MAX_TAGS - 1)) {
+        const vision_frame_t *entry = &tags->slots[slot];
+        if (!entry->valid) return NULL;
+        if (entry->fID == fID) return entry;
+    }
+    return NULL;
+}
+
+void spi_telemetry_seal(spi_telemetry_t *telemetry) {
+    if (!telemetry) return;
+    telemetry->type = SPI_MSG_TELEMETRY;
+    telemetry->version = SPI_TELEMETRY_VERSION;
+    telemetry->crc = spi_crc16((const uint8_t *)telemetry, offsetof(spi_telemetry_t, crc));
+}
+
+bool spi_telemetry_decode(const uint8_t *buf, size_t len, spi_telemetry_t *out) {
+    if (!buf || !out || len < sizeof(spi_telemetry_t)) return false;
+
+    spi_telemetry_t telemetry;
+    memcpy(&telemetry, buf, sizeof(telemetry));
+    if (telemetry.type != SPI_MSG_TELEMETRY || telemetry.version != SPI_TELEMETRY_VERSION) return false;
+    if (spi_crc16(buf, offsetof(spi_telemetry_t, crc)) != telemetry.crc) return false;
+
+    *out = telemetry;
+    return true;
+}
+
+uint8_t spi_stats_bin(uint32_t value, uint32_t first_edge) {
+    uint8_t bin = 0;
+    uint64_t edge = first_edge;
+    while (bin < SPI_STATS_HIST_BINS - 1 && value > edge) {
+        ++bin;
+        edge <<= 1;
+    }
+    return bin;
+}
+
+void spi_stats_page_seal(spi_stats_page_t *page) {
+    if (!page) return;
+    page->type = SPI_MSG_STATS;
+    page->version = SPI_STATS_VERSION;
+    page->crc = spi_crc16((const uint8_t *)page, offsetof(spi_stats_page_t, crc));
+}
+
+bool spi_stats_page_decode(const uint8_t *buf, size_t len, spi_stats_page_t *out) {
+    if (!buf || !out || len < sizeof(spi_stats_page_t)) return false;
+
+    spi_stats_page_t page;
+    memcpy(&page, buf, sizeof(page));
+    if (page.type != SPI_MSG_STATS || page.version != SPI_STATS_VERSION) return false;
+    if (page.page >= SPI_STATS_PAGE_COUNT) return false;
+    if (spi_crc16(buf, offsetof(spi_stats_page_t, crc)) != page.crc) return false;
+
+    *out = page;
+    return true;
+}
+
+size_t spi_link_caps_format(const spi_link_caps_t *caps, char *buf, size_t len) {
+    if (!caps || !buf) return 0;
+
+    int written = snprintf(buf, len, "v%u c%lx k%u r%u", caps->version, (unsigned long)caps->caps,
+                           caps->chunk_size, caps->frame_rate);
+    if (written < 0 || (size_t)written >= len) return 0;
+    return (size_t)written;
+}
+
+bool spi_link_caps_parse(const char *text, spi_link_caps_t *out) {
+    if (!text || !out) return false;
+
+    spi_link_caps_t caps = {0};
+    bool have_version = false;
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+
+        char key = *p++;
+        char *end;
+        unsigned long value = strtoul(p, &end, key == 'c' ? 16 : 10);
+        if (end == p) return false;
+        p = end;
+
+        // Unknown keys are skipped so newer peers can add fields
+        switch (key) {
+            case 'v': caps.version = (uint8_t)value; have_version = true; break;
+            case 'c': caps.caps = (uint32_t)value; break;
+            case 'k': caps.chunk_size = (uint16_t)value; break;
+            case 'r': caps.frame_rate = (uint16_t)value; break;
+        }
+    }
+    if (!have_version) return false;
+
+    *out = caps;
+    return true;
+}
+
+size_t spi_vision_profile_format(const spi_vision_profile_t *profile, char *buf, size_t len) {
+    if (!profile || !buf) return 0;
+
+    int written = snprintf(buf, len, "r%u f%lx", profile->rate, (unsigned long)profile->fields);
+    if (written < 0 || (size_t)written >= len) return 0;
+    return (size_t)written;
+}
+
+bool spi_vision_profile_parse(const char *text, spi_vision_profile_t *out) {
+    if (!text || !out) return false;
+
+    spi_vision_profile_t profile = {0};
+    bool have_rate = false, have_fields = false;
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+
+        char key = *p++;
+        char *end;
+        unsigned long value = strtoul(p, &end, key == 'f' ? 16 : 10);
+        if (end == p) return false;
+        p = end;
+
+        switch (key) {
+            case 'r': profile.rate = (uint16_t)value; have_rate = true; break;
+            case 'f': profile.fields = (uint32_t)value & VISION_FIELDS_ALL; have_fields = true; break;
+        }
+    }
+    if (!have_rate || !have_fields) return false;
+
+    *out = profile;
+    return true;
+}
+
+size_t spi_vision_subscription_format(const spi_vision_subscription_t *subscription, char *buf, size_t len) {
+    if (!subscription || !buf) return 0;
+
+    int written = snprintf(buf, len, "p%u f%lx", subscription->pipeline, (unsigned long)subscription->fields);
+    if (written < 0 || (size_t)written >= len) return 0;
+    return (size_t)written;
+}
+
+bool spi_vision_subscription_parse(const char *text, spi_vision_subscription_t *out) {
+    if (!text || !out) return false;
+
+    spi_vision_subscription_t subscription = {0};
+    bool have_pipeline = false, have_fields = false;
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+
+        char key = *p++;
+        char *end;
+        unsigned long value = strtoul(p, &end, key == 'f' ? 16 : 10);
+        if (end == p) return false;
+        p = end;
+
+        switch (key) {
+            case 'p': subscription.pipeline = (uint8_t)value; have_pipeline = true; break;
+            case 'f': subscription.fields = (uint32_t)value & VISION_FIELDS_ALL; have_fields = true; break;
+        }
+    }
+    if (!have_pipeline || !have_fields) return false;
+
+    *out = subscription;
+    return true;
+}
+
+size_t spi_clock_sample_format(const spi_clock_sample_t *sample, char *buf, size_t len) {
+    if (!sample || !buf) return 0;
+
+    int written = snprintf(buf, len, "t%llu", (unsigned long long)sample->pi_us);
+    if (written < 0 || (size_t)written >= len) return 0;
+    return (size_t)written;
+}
+
+bool spi_clock_sample_parse(const char *text, spi_clock_sample_t *out) {
+    if (!text || !out || text[0] != 't') return false;
+
+    char *end;
+    unsigned long long pi_us = strtoull(text + 1, &end, 10);
+    if (end == text + 1) return false;
+
+    out->pi_us = (uint64_t)pi_us;
+    return true;
+}
+
+size_t spi_roi_hint_format(const spi_roi_hint_t *hint, char *buf, size_t len) {
+    if (!hint || !buf) return 0;
+
+    int written = snprintf(buf, len, "%c%u x%d y%d w%u h%u i%d", SPI_ROI_HINT_PREFIX, hint->seq,
+                           hint->x, hint->y, hint->w, hint->h, hint->fID);
+    if (written < 0 || (size_t)written >= len) return 0;
+    return (size_t)written;
+}
+
+bool spi_roi_hint_parse(const char *text, spi_roi_hint_t *out) {
+    if (!text || !out || text[0] != SPI_ROI_HINT_PREFIX) return false;
+
+    char *end;
+    spi_roi_hint_t hint = { .fID = -1 };
+    hint.seq = (uint16_t)strtoul(text + 1, &end, 10);
+    if (end == text + 1) return false;
+
+    unsigned fields = 0;
+    const char *p = end;
+    while (*p) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+
+        char key = *p++;
+        long value = strtol(p, &end, 10);
+        if (end == p) return false;
+        p = end;
+
+        switch (key) {
+            case 'x': hint.x = (int16_t)value; fields |= 1; break;
+            case 'y': hint.y = (int16_t)value; fields |= 2; break;
+            case 'w': hint.w = (uint16_t)value; fields |= 4; break;
+            case 'h': hint.h = (uint16_t)value; fields |= 8; break;
+            case 'i': hint.fID = (int16_t)value; break;
+        }
+    }
+    if (fields != 0xF) return false;
+
+    *out = hint;
+    return true;
+}
+
+// Binary messages are written in hex, the rest as text
+static inline bool capture_is_binary(uint8_t type) {
+    return type == SPI_MSG_BINARY || type == SPI_MSG_DELTA;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+size_t spi_capture_format(const uint8_t *message, size_t len, char *buf, size_t buf_len) {
+    if (!message || !len || !buf) return 0;
+
+    if (!capture_is_binary(message[0])) {
+        if (len >= buf_len) return 0;
+        // The line would end early
+        for (size_t i = 0; i < len; ++i) {
+            if (message[i] == '\0' || message[i] == '\r' || message[i] == '\n') return 0;
+        }
+        memcpy(buf, message, len);
+        buf[len] = '\0';
+        return len;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    size_t written = 1 + 2 * (len - 1);
+    if (written >= buf_len) return 0;
+    buf[0] = (char)message[0];
+    for (size_t i = 1; i < len; ++i) {
+        buf[2 * i - 1] = digits[message[i] >> 4];
+        buf[2 * i] = digits[message[i] & 0x0F];
+    }
+    buf[written] = '\0';
+    return written;
+}
+
+size_t spi_capture_parse(const char *line, uint8_t *buf, size_t len) {
+    if (!line || !buf) return 0;
+
+    size_t line_len = strcspn(line, "\r\n");
+    if (line_len == 0) return 0;
+    if (!capture_is_binary((uint8_t)line[0])) {
+        if (line_len >= len) return 0;
+        memcpy(buf, line, line_len);
+        buf[line_len] = '\0';
+        return line_len;
+    }
+
+    if (line_len % 2 == 0) return 0;
+    size_t message_len = 1 + (line_len - 1) / 2;
+    if (message_len >= len) return 0;
+    buf[0] = (uint8_t)line[0];
+    for (size_t i = 1; i < message_len; ++i) {
+        int high = hex_digit(line[2 * i - 1]);
+        int low = hex_digit(line[2 * i]);
+        if (high < 0 || low < 0) return 0;
+        buf[i] = (uint8_t)(high << 4 | low);
+    }
+    buf[message_len] = '\0';
+    return message_len;
+}
+
+void spi_link_negotiate(const spi_link_caps_t *local, const spi_link_caps_t *peer, spi_link_caps_t *out) {
+    if (!local || !peer || !out) return;
+
+    spi_link_caps_t agreed = {0};
+    agreed.version = local->version < peer->version ? local->version : peer->version;
+    agreed.chunk_size = local->chunk_size;
+    if (peer->chunk_size == local->chunk_size) {
+        agreed.caps = local->caps & peer->caps;
+    }
+    if (local->frame_rate == 0 || (peer->frame_rate != 0 && peer->frame_rate < local->frame_rate)) {
+        agreed.frame_rate = peer->frame_rate;
+    } else {
+        agreed.frame_rate = local->frame_rate;
+    }
+    *out = agreed;
+}
@@ -0,0 +1,311 @@
+#include "spi_rpc.h"
+#include "spi_secondary.h"
+
+#define TAG "SPI_RPC"
+
+typedef enum {
+    CALL_FREE,
+    CALL_QUEUED,        // Waiting to be loaded into a transaction
+    CALL_IN_FLIGHT,     // Loaded, transaction not yet clocked out
+    CALL_SENT,          // Delivered to the Pi, waiting for the answer
+    CALL_DONE           // Answered, waiting for the blocked caller to collect it
+} call_state_t;
+
+typedef struct {
+    call_state_t state;
+    uint16_t id;
+    spi_rpc_method_t method;
+    char args[SPI_RPC_ARGS_LEN];
+    int attempts;
+    bool loaded;                // Carried by a transaction spi_rpc_delivered has not seen yet
+    int64_t started_us;
+    int64_t delivered_us;
+    spi_rpc_status_t status;
+    char payload[SPI_RPC_PAYLOAD_LEN];
+    spi_rpc_callback_t callback;
+    void *arg;
+    TaskHandle_t waiter;
+} spi_rpc_slot_t;
+
+static spi_rpc_slot_t calls[SPI_RPC_MAX_PENDING];
+static SemaphoreHandle_t rpc_mutex = NULL;
+static uint16_t next_id = 1;
+static spi_rpc_stats_t rpc_stats;
+
+void spi_rpc_init() {
+    if (!rpc_mutex) {
+        rpc_mutex = xSemaphoreCreateMutex();
+    }
+}
+
+static int start_call(spi_rpc_method_t method, const char *args, spi_rpc_callback_t callback, void *arg,
+                      TaskHandle_t waiter) {
+    int index = -1;
+    xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+        // A freed call still loaded would have the new call marked delivered with that transaction
+        if (calls[i].state != CALL_FREE || calls[i].loaded) continue;
+
+        spi_rpc_slot_t *call = &calls[i];
+        memset(call, 0, sizeof(*call));
+        call->state = CALL_QUEUED;
+        call->id = next_id++;
+        if (next_id == 0) next_id = 1;
+        call->method = method;
+        if (args) {
+            strncpy(call->args, args, SPI_RPC_ARGS_LEN - 1);
+        }
+        call->started_us = esp_timer_get_time();
+        call->status = SPI_RPC_PENDING;
+        call->callback = callback;
+        call->arg = arg;
+        call->waiter = waiter;
+        ++rpc_stats.calls;
+        index = i;
+        break;
+    }
+    xSemaphoreGive(rpc_mutex);
+
+    if (index < 0) {
+        ESP_LOGW(TAG, "No free call slot for method %c", (char)method);
+    }
+    return index;
+}
+
+// Finishes a call; must be called with rpc_mutex held. Returns true if the
+// callback or waiter should be told, which the caller does after unlocking.
+static bool finish_call(spi_rpc_slot_t *call, spi_rpc_status_t status, const char *payload, int64_t now) {
+    if (call->state == CALL_FREE || call->state == CALL_DONE) return false;
+
+    call->status = status;
+    if (payload) {
+        strncpy(call->payload, payload, SPI_RPC_PAYLOAD_LEN - 1);
+        call->payload[SPI_RPC_PAYLOAD_LEN - 1] = '\0';
+    }
+
+    if (status == SPI_RPC_OK) {
+        uint32_t latency = (uint32_t)(now - call->started_us);
+        ++rpc_stats.ok;
+        rpc_stats.last_latency_us = latency;
+        rpc_stats.total_latency_us += latency;
+        if (latency > rpc_stats.max_latency_us) {
+            rpc_stats.max_latency_us = latency;
+        }
+        if (call->delivered_us) {
+            rpc_stats.last_round_trip_us = (uint32_t)(now - call->delivered_us);
+        }
+    } else if (status == SPI_RPC_TIMEOUT) {
+        ++rpc_stats.timeouts;
+    } else {
+        ++rpc_stats.errors;
+    }
+
+    call->state = call->waiter ? CALL_DONE : CALL_FREE;
+    return true;
+}
+
+// When the request a finished call was answered for went out, 0 if that is ambiguous
+static int64_t answered_delivery(const spi_rpc_slot_t *call) {
+    return call->attempts == 1 ? call->delivered_us : 0;
+}
+
+// Runs the callback or wakes the waiter of a finished call, without the mutex held
+static void notify_call(uint16_t id, spi_rpc_status_t status, const char *payload, int64_t delivered_us,
+                        spi_rpc_callback_t callback, void *arg, TaskHandle_t waiter) {
+    if (callback) {
+        callback(id, status, payload, delivered_us, arg);
+    }
+    if (waiter) {
+        xTaskNotifyGive(waiter);
+    }
+}
+
+// Hands the result of a finished waited-for call over and frees its slot; rpc_mutex must be held
+static spi_rpc_status_t collect_call(spi_rpc_slot_t *call, char *payload, size_t payload_len) {
+    if (payload && payload_len > 0) {
+        strncpy(payload, call->payload, payload_len - 1);
+        payload[payload_len - 1] = '\0';
+    }
+    call->state = CALL_FREE;
+    return call->status;
+}
+
+uint16_t spi_rpc_call(spi_rpc_method_t method, const char *args, spi_rpc_callback_t callback, void *arg) {
+    int index = start_call(method, args, callback, arg, NULL);
+    return index < 0 ? 0 : calls[index].id;
+}
+
+spi_rpc_status_t spi_rpc_call_wait(spi_rpc_method_t method, const char *args,
+                                   char *payload, size_t payload_len, TickType_t timeout) {
+    int index = start_call(method, args, NULL, NULL, xTaskGetCurrentTaskHandle());
+    if (index < 0) return SPI_RPC_NO_SLOT;
+
+    spi_rpc_slot_t *call = &calls[index];
+    uint16_t id = call->id;
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        spi_rpc_status_t status = SPI_RPC_PENDING;
+        xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+        if (call->id == id && call->state == CALL_DONE) {
+            status = collect_call(call, payload, payload_len);
+        }
+        xSemaphoreGive(rpc_mutex);
+        if (status != SPI_RPC_PENDING) {
+            return status;
+        }
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            // Give the slot up; a late answer will no longer match a call. One that
+            // came in since the check above is still taken, or its slot would never be freed
+            status = SPI_RPC_TIMEOUT;
+            xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+            if (call->id == id) {
+                if (call->state == CALL_DONE) {
+                    status = collect_call(call, payload, payload_len);
+                } else {
+                    finish_call(call, SPI_RPC_TIMEOUT, NULL, esp_timer_get_time());
+                    call->state = CALL_FREE;
+                }
+            }
+            xSemaphoreGive(rpc_mutex);
+            return status;
+        }
+        // The SPI task notifies this task when the call completes
+        ulTaskNotifyTake(pdTRUE, timeout - elapsed);
+    }
+}
+
+size_t spi_rpc_load(char *buf, size_t used, size_t size, uint32_t *loaded) {
+    if (!rpc_mutex) return used;
+
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+        spi_rpc_slot_t *call = &calls[i];
+        bool due = call->state == CALL_QUEUED ||
+                   (call->state == CALL_SENT && call->attempts < SPI_RPC_MAX_ATTEMPTS &&
+                    now - call->delivered_us >= SPI_RPC_RETRY_MS * 1000);
+        if (!due) continue;
+
+        char request[CHUNK_SIZE];
+        int len = snprintf(request, sizeof(request), "R%u %c%s%s", call->id, (char)call->method,
+                           call->args[0] ? " " : "", call->args);
+        size_t separator = used > 0 ? 1 : 0;
+        if (len < 0 || used + separator + len > size - 1) break;  // Leave it for the next transaction
+
+        if (separator) {
+            buf[used++] = SPI_COMMAND_SEPARATOR;
+        }
+        memcpy(buf + used, request, len);
+        used += len;
+
+        if (call->attempts > 0) {
+            ++rpc_stats.retries;
+        }
+        ++call->attempts;
+        call->state = CALL_IN_FLIGHT;
+        call->loaded = true;
+        *loaded |= 1u << i;
+    }
+    xSemaphoreGive(rpc_mutex);
+    return used;
+}
+
+void spi_rpc_delivered(uint32_t loaded, int64_t delivered_us) {
+    if (!loaded || !rpc_mutex) return;
+
+    xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+        if (!(loaded & (1u << i))) continue;
+        calls[i].loaded = false;
+        if (calls[i].state == CALL_IN_FLIGHT) {
+            calls[i].state = CALL_SENT;
+            calls[i].delivered_us = delivered_us;
+        }
+    }
+    xSemaphoreGive(rpc_mutex);
+}
+
+void spi_rpc_handle_response(const char *message) {
+    if (!message || !rpc_mutex) return;
+
+    char *end;
+    unsigned long id = strtoul(message, &end, 10);
+    if (end == message) {
+        ESP_LOGW(TAG, "Malformed response: %s", message);
+        return;
+    }
+    long code = strtol(end, &end, 10);
+    while (*end == ' ') ++end;
+    spi_rpc_status_t status = code == 0 ? SPI_RPC_OK : SPI_RPC_ERROR;
+
+    int64_t now = esp_timer_get_time();
+    bool notify = false;
+    spi_rpc_callback_t callback = NULL;
+    void *arg = NULL;
+    TaskHandle_t waiter = NULL;
+    int64_t delivered_us = 0;
+    char payload[SPI_RPC_PAYLOAD_LEN] = {0};
+
+    xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+    for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+        spi_rpc_slot_t *call = &calls[i];
+        if (call->id != id || call->state == CALL_FREE) continue;
+
+        notify = finish_call(call, status, end, now);
+        if (notify) {
+            callback = call->callback;
+            arg = call->arg;
+            waiter = call->waiter;
+            delivered_us = answered_delivery(call);
+            strncpy(payload, call->payload, SPI_RPC_PAYLOAD_LEN - 1);
+        }
+        break;
+    }
+    xSemaphoreGive(rpc_mutex);
+
+    // Answers to a retried request arrive more than once, only the first counts
+    if (notify) {
+        notify_call((uint16_t)id, status, payload, delivered_us, callback, arg, waiter);
+    }
+}
+
+void spi_rpc_poll() {
+    if (!rpc_mutex) return;
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+        bool notify = false;
+        spi_rpc_callback_t callback = NULL;
+        void *arg = NULL;
+        TaskHandle_t waiter = NULL;
+        uint16_t id = 0;
+
+        xSemaphoreTake(rpc_mutex, portMAX_DELAY);
+        spi_rpc_slot_t *call = &calls[i];
+        bool exhausted = call->state == CALL_SENT && call->attempts >= SPI_RPC_MAX_ATTEMPTS &&
+                         now - call->delivered_us >= SPI_RPC_RETRY_MS * 1000;
+        // A waiting caller has its own deadline, calls with a callback get as long as all their attempts
+        bool undelivered = (call->state == CALL_QUEUED || call->state == CALL_IN_FLIGHT) && !call->waiter &&
+                           now - call->started_us >= SPI_RPC_MAX_ATTEMPTS * SPI_RPC_RETRY_MS * 1000;
+        if (exhausted || undelivered) {
+            notify = finish_call(call, SPI_RPC_TIMEOUT, NULL, now);
+            callback = call->callback;
+            arg = call->arg;
+            waiter = call->waiter;
+            id = call->id;
+        }
+        xSemaphoreGive(rpc_mutex);
+
+        if (notify) {
+            ESP_LOGW(TAG, "Call %u timed out", id);
+            notify_call(id, SPI_RPC_TIMEOUT, "", 0, callback, arg, waiter);
+        }
+    }
+}
+
+void spi_rpc_get_stats(spi_rpc_stats_t *stats) {
+    if (!stats) return;
+    *stats = rpc_stats;
+}
@@ -1,7 +1,26 @@
 #include "spi_secondary.h"
+#include "clock_sync.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "freertos/queue.h"
+#include "roi_predictor.h"
+#include "spi_rpc.h"
+#include "vision_fields.h"
+#include <stdatomic.h>
 
 #define TAG "SPI_SECONDARY"
 #define END_SIGNAL "<END>"  // Special signal from master indicating the end of transmission
+#define FRAME_RING_CELLS 64  // Chunk-sized receive cells in the frame ring (power of two)
+#define FRAME_MAX_CELLS  16  // Largest frame that can be assembled, in chunks
+#define MESSAGE_MAX_LEN  (CHUNK_SIZE * 2)
+#define TELEMETRY_WATERMARK_PERIOD_US 100000
+#define LINK_CHECK_PERIOD_MS 20  // How often the priority task looks for a gap in vision frames
+#define CLOCK_SYNC_PERIOD_US 1000000  // Between clock sync requests once the window is full
+#define CLOCK_SYNC_FAST_PERIOD_US 100000  // Until then
+
+// Queued transactions must never land in a cell of the frame being assembled
+_Static_assert(FRAME_RING_CELLS >= FRAME_MAX_CELLS + SPI_RX_QUEUE_DEPTH + 1, "frame ring too small");
 
 // SPI Pin Configuration
 #define PIN_MISO  19
@@ -9,15 +28,143 @@
 #define PIN_SCLK  18
 #define PIN_CS    5
 
-static char command_to_send[CHUNK_SIZE] = {0};
-static SPI_received_data_t receivedData = { .messageInput = "default" };
+static spi_outbox_t outboxes[SPI_OUTBOX_PRODUCERS];
+static portMUX_TYPE outbox_lock = portMUX_INITIALIZER_UNLOCKED;
+static int outbox_next = 0;  // Outbox the SPI task drains first, rotated every transaction
+static uint32_t tx_loaded[SPI_RX_QUEUE_DEPTH][SPI_OUTBOX_PRODUCERS];  // Last command sequence in each queued transaction
+static uint32_t rpc_loaded[SPI_RX_QUEUE_DEPTH];  // RPC call slots carried by each queued transaction
+static spi_slave_transaction_t rx_transactions[SPI_RX_QUEUE_DEPTH];
+static int64_t trans_done_us[SPI_RX_QUEUE_DEPTH];  // When each transaction last ended, set by spi_post_trans_cb
+static int64_t chunk_received_us = 0;  // End of the transaction being handled
+static frame_ring_t frame_ring;
+static vision_json_stream_t json_stream;  // J message being assembled, decoded chunk by chunk as it arrives
+static bool json_streaming = false;  // json_stream is decoding the message being assembled
+static size_t json_stream_bytes = 0;  // Bytes of it fed so far, type byte included
+static char *tx_buffers[SPI_RX_QUEUE_DEPTH];
+static spi_rx_stats_t rx_stats;
+static _Atomic uint32_t mutex_timeouts = 0;  // Counted apart from rx_stats, the getters run in other tasks
+static uint8_t stats_pages_pending = 0;  // Bitmask of spi_stats_page_id_t still to send
+static spi_link_caps_t link_caps = {0};  // Agreed in the handshake, plain JSON until then
+static clock_sync_t clock_sync;  // SPI task only
+static bool clock_sync_pending = false;
+static int64_t clock_sync_sent_us = 0;
+static portMUX_TYPE vision_lock = portMUX_INITIALIZER_UNLOCKED;
+static spi_vision_profile_t vision_requested;  // Last profile the mission code asked for
+static bool vision_request_failed = true;  // Send the next request even if it repeats the last one
+static spi_vision_profile_t vision_active = { .rate = 0, .fields = VISION_FIELDS_ALL };
+// Profile carried by each V call in flight, guarded by vision_lock
+static struct {
+    bool busy;
+    spi_vision_profile_t profile;
+} vision_calls[SPI_RPC_MAX_PENDING];
+static vision_frame_t delta_state;  // Vision state deltas are merged into
+static uint16_t delta_seq = 0;
+static bool delta_valid = false;  // false until a keyframe arrives
+static bool keyframe_requested = false;
+static TaskHandle_t main_task = NULL;
+static bool telemetry_enabled = false;
+static motor_t *drive_wheels = NULL;
+static uint8_t telemetry_segment = 0;
+static uint16_t telemetry_seq = 0;
+static int64_t telemetry_watermark_time = -TELEMETRY_WATERMARK_PERIOD_US;
+static uint32_t telemetry_free_heap;
+static uint32_t telemetry_min_free_heap;
+static uint16_t telemetry_spi_stack;
+static uint16_t telemetry_main_stack;
+static char message_buffer[MESSAGE_MAX_LEN] = "default";
+static SPI_received_data_t receivedData = { .messageInput = message_buffer };
 EMAState purple_object_ema;
 EMAState april_tag_ema;
 EMAState line_following_ema;
 SemaphoreHandle_t data_mutex;
 
+/*
+ * Newest vision data, whatever format it came in, and its timing. The SPI task
+ * publishes it under a sequence count that is odd while the copy is being
+ * rewritten; getters copy it out and retry if the count moved meanwhile. So a
+ * getter never blocks and always gets one whole frame, and the SPI task never
+ * waits for a getter.
+ */
+typedef struct {
+    vision_frame_t frame;
+    spi_frame_timing_t timing;
+} vision_state_t;
+
+static vision_state_t vision_state;
+static vision_tags_t vision_tags;  // Every fiducial of vision_state.frame, same seqlock; apart so getters only copy what they read
+static vision_tags_t frame_tags;  // Scratch for formats that carry one target, SPI task only
+static _Atomic uint32_t vision_seq = 0;
+static portMUX_TYPE vision_publish_lock = portMUX_INITIALIZER_UNLOCKED;  // Keeps the publish from being preempted
+static _Atomic uint32_t vision_read_seq = 0;  // vision_seq of the newest vision data a getter has read
+static portMUX_TYPE read_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static spi_rx_stats_t read_stats;  // Only consume_latency and frame_age, written by the getters, guarded by read_stats_lock
+static roi_predictor_t roi_predictor;  // Fed by every frame that saw a tag, guarded by data_mutex
+static int roi_fID = -1;  // Tag the last hint was for, which the predictor follows; guarded by data_mutex
+static uint16_t roi_seq = 0;
+static spi_roi_hint_t roi_last;  // Last hint queued, not resent while unchanged
+static uint32_t roi_pending = 0;  // Command sequence of roi_last
+static const spi_vision_subscription_t vision_subscriptions[] = VISION_SUBSCRIPTIONS;
+
+// Sent together after the handshake, with a call slot left for the vision profile
+_Static_assert(sizeof(vision_subscriptions) / sizeof(vision_subscriptions[0]) < SPI_RPC_MAX_PENDING,
+               "too many vision subscriptions");
+
+// A priority chunk as the transaction callback saw it
+typedef struct {
+    uint8_t chunk[CHUNK_SIZE];
+    int64_t received_us;
+} priority_event_t;
+
+static QueueHandle_t priority_queue = NULL;
+static volatile bool stop_held = false;
+static spi_rx_stats_t priority_stats;  // Only the priority_* fields, written by the priority task
+// Cleared when the Pi may have restarted and begun its priority seq again, see apply_priority
+static _Atomic bool priority_seq_known = false;
+static uint16_t priority_last_seq;  // Priority task only
+static portMUX_TYPE link_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t link_last_frame_us = 0;  // Last good vision frame, guarded by link_lock
+static volatile uint32_t link_timeout_ms = SPI_LINK_TIMEOUT_MS;
+static volatile bool link_lost = false;  // Written by the priority task
+static int64_t link_lost_frame_us = 0;  // link_last_frame_us when the loss was declared
+static _Atomic bool link_resync = false;  // Set on restore, handled by the SPI task
+static spi_link_callback_t link_callback = NULL;
+static void *link_callback_arg = NULL;
+static spi_rx_stats_t link_stats;  // Only the link_* fields, written by the priority task
+
+static void spi_priority_task(void *arg);
+static void publish_vision_frame(const vision_frame_t *frame, const vision_tags_t *tags);
+static uint32_t read_vision_state(vision_state_t *state);
+static bool read_vision_snapshot(int fID, spi_vision_snapshot_t *snapshot);
+
+/*
+ * Runs in the SPI interrupt as soon as the master ends a transaction. Priority
+ * chunks are handed straight to the priority task so they never wait behind
+ * frame assembly or a parser blocked on data_mutex. Every transaction gets its
+ * end time recorded here, the same instant the master sees, for clock sync and
+ * frame latencies.
+ */
+static void IRAM_ATTR spi_post_trans_cb(spi_slave_transaction_t *trans) {
+    int64_t now = esp_timer_get_time();
+    trans_done_us[trans - rx_transactions] = now;
+    const uint8_t *rx = trans->rx_buffer;
+    if (rx[0] != SPI_PRIORITY_MAGIC || rx[1] != SPI_MSG_PRIORITY) return;
+
+    priority_event_t event = { .received_us = now };
+    memcpy(event.chunk, rx, CHUNK_SIZE);
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(priority_queue, &event, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
 esp_err_t spi_secondary_init(void) {
     data_mutex = xSemaphoreCreateMutex();
+    spi_rpc_init();
+    main_task = xTaskGetCurrentTaskHandle();
+    priority_queue = xQueueCreate(SPI_PRIORITY_QUEUE_DEPTH, sizeof(priority_event_t));
+    if (!priority_queue) {
+        ESP_LOGE(TAG, "Priority queue allocation failed!");
+        return ESP_ERR_NO_MEM;
+    }
 
     // SPI Bus Configuration
     spi_bus_config_t buscfg = {
@@ -33,10 +180,10 @@ esp_err_t spi_secondary_init(void) {
     spi_slave_interface_config_t slvcfg = {
         .spics_io_num = PIN_CS,
         .flags = 0,
-        .queue_size = 1,
+        .queue_size = SPI_RX_QUEUE_DEPTH,
         .mode = 0,  // SPI mode 0 (should match master)
         .post_setup_cb = NULL,
-        .post_trans_cb = NULL
+        .post_trans_cb = spi_post_trans_cb
     };
 
     // Initialize SPI bus
@@ -50,754 +197,1562 @@ esp_err_t spi_secondary_init(void) {
 
     // Start SPI communication task
     xTaskCreate(spi_secondary_task, "spi_secondary_task", 4096, NULL, 5, NULL);
+    xTaskCreate(spi_priority_task, "spi_priority_task", 2048, NULL, SPI_PRIORITY_TASK_PRIORITY, NULL);
 
     return ESP_OK;
 }
 
 
-void spi_secondary_task(void *arg) {
-    receivedData.jsonInput = cJSON_CreateObject();
-    init_ema(&purple_object_ema, 0.2f, "retro");
-    init_ema(&april_tag_ema, 0.2, "fiducial");
-    init_ema(&line_following_ema, 0.2, "retro");
-    int count = 0;
-    char *received_buffer = NULL;
-    int received_buffer_size = 0;
-    esp_err_t ret;
-    bool command_flag = false;
-    char new_buf[CHUNK_SIZE + 1] = {0};
-    char send_buf[CHUNK_SIZE] = "ACK"; // Response to master
-
-    spi_slave_transaction_t transaction;
-    memset(&transaction, 0, sizeof(transaction));
+// Finds the calling task's outbox, claiming a free one on first use
+static spi_outbox_t *get_outbox() {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < SPI_OUTBOX_PRODUCERS; ++i) {
+        if (outboxes[i].owner == self) {
+            return &outboxes[i];
+        }
+    }
 
-    transaction.length = CHUNK_SIZE * 8;  // Transaction size in bits
-    transaction.tx_buffer = send_buf;  // Data to send
-    transaction.rx_buffer = new_buf;  // Buffer to receive data
+    spi_outbox_t *outbox = NULL;
+    portENTER_CRITICAL(&outbox_lock);
+    for (int i = 0; i < SPI_OUTBOX_PRODUCERS; ++i) {
+        if (outboxes[i].owner == NULL) {
+            outboxes[i].owner = self;
+            outbox = &outboxes[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&outbox_lock);
+    return outbox;
+}
 
-    while (1) {
-        // Wait for master to send data
-        memset(new_buf, 0, sizeof(new_buf));
-        if (strlen(command_to_send) > 0) {
-            memset(send_buf, 0, sizeof(send_buf));  // Clear old data
-            size_t len = strlen(command_to_send);
-            if (len >= CHUNK_SIZE) len = CHUNK_SIZE - 1;
-            memcpy(send_buf, command_to_send, len);
-            send_buf[len] = '\0';  // Null-terminate
-            command_to_send[0] = '\0';  // Mark message as sent
-            command_flag = true;
-            // ESP_LOGI(TAG, "sent: %s", command_to_send);
-            // ESP_LOGI(TAG, "sent");
-        }
-
-        ret = spi_slave_transmit(SPI2_HOST, &transaction, pdMS_TO_TICKS(100));
-        if (command_flag) {
-            memset(send_buf, 0, sizeof(send_buf));
-            memcpy(send_buf, "ACK", strlen("ACK"));
-            command_flag = false;
-        }
-        
-        if (ret == ESP_OK) {
-            new_buf[CHUNK_SIZE] = '\0'; // Ensure null-termination
-            // Append received data to json_buffer
-
-            if (strncmp(new_buf, END_SIGNAL, strlen(END_SIGNAL)) == 0) {
-                // ESP_LOGI(TAG, "End of Transmission received");
-                //ESP_LOGI(TAG, "%s", received_buffer);
-                process_received_data(received_buffer);
-                ++count;
-                // ESP_LOGI(TAG, "%d", count);
-                if (!received_buffer) {
-                    free(received_buffer);
-                    received_buffer = NULL;
-                }
-                received_buffer_size = 0;
-            } else {
-
-                int new_size = received_buffer_size + strlen(new_buf);
-
-                received_buffer = realloc(received_buffer, new_size + 1);
-                if (!received_buffer) {
-                    ESP_LOGE(TAG, "Memory allocation failed!");
-                    free(received_buffer);
-                    received_buffer = NULL;
-                    return;
-                }
-                
-                memcpy(received_buffer + received_buffer_size, new_buf, strlen(new_buf));
-                received_buffer_size = new_size;
-                received_buffer[received_buffer_size] = '\0';
-            }
+// Fills an otherwise idle MISO chunk with a snapshot of the robot's state
+static void load_telemetry(char *send_buf) {
+    int64_t now = esp_timer_get_time();
+    spi_telemetry_t telemetry = {
+        .segment = telemetry_segment,
+        .flags = (link_lost ? SPI_TELEMETRY_FLAG_LINK_LOST : 0) | (stop_held ? SPI_TELEMETRY_FLAG_STOP_HELD : 0),
+        .seq = ++telemetry_seq,
+        .timestamp_us = (uint32_t)now,
+        .encoders = {
+            read_encoder(PCNT_UNIT_0),  // Front Right
+            read_encoder(PCNT_UNIT_1),  // Front Left
+            read_encoder(PCNT_UNIT_2),  // Back Right
+            read_encoder(PCNT_UNIT_3)   // Back Left
+        }
+    };
+    if (drive_wheels) {
+        for (int i = 0; i < 4; ++i) {
+            telemetry.duty[i] = (int8_t)drive_wheels[i].speed;
         }
     }
+
+    // Scanning for the stack high water mark is slow, so refresh these at a lower rate
+    if (now - telemetry_watermark_time >= TELEMETRY_WATERMARK_PERIOD_US) {
+        telemetry_watermark_time = now;
+        telemetry_free_heap = esp_get_free_heap_size();
+        telemetry_min_free_heap = esp_get_minimum_free_heap_size();
+        telemetry_spi_stack = uxTaskGetStackHighWaterMark(NULL);
+        telemetry_main_stack = main_task ? uxTaskGetStackHighWaterMark(main_task) : 0;
+    }
+    telemetry.free_heap = telemetry_free_heap;
+    telemetry.min_free_heap = telemetry_min_free_heap;
+    telemetry.spi_stack_free = telemetry_spi_stack;
+    telemetry.main_stack_free = telemetry_main_stack;
+
+    spi_telemetry_seal(&telemetry);
+    memcpy(send_buf, &telemetry, sizeof(telemetry));
 }
 
-void process_received_data(char *input) {
-    if (input == NULL) {
-        ESP_LOGE(TAG, "nuh uh bud");
-        return;
+// Takes data_mutex, counting the times it could not be taken in time
+static bool take_data_mutex(TickType_t timeout) {
+    if (xSemaphoreTake(data_mutex, timeout)) {
+        return true;
     }
-    // ESP_LOGI(TAG, "HEAP: %u", (unsigned int)esp_get_free_heap_size());
-    char message_type = input[0];
-    char *message_data = input + 1;
-    switch (message_type) {
-        case 'J':
-            //ESP_LOGI(TAG, "Processing JSON...");
-            cJSON *receivedJson = cJSON_Parse(message_data);
-            if (!receivedJson) {
-                const char *error_ptr = cJSON_GetErrorPtr();
-                if (error_ptr) {
-                    printf("JSON Parsing Error: %s\n", error_ptr);
-                } else {
-                    printf("Unknown error occurred while parsing JSON.\n");
-                }
-                ESP_LOGE(TAG, "Invalid JSON!");
-                ESP_LOGI(TAG, "Message Data: %s", message_data);
-            } else {
-                // ESP_LOGI(TAG, "Valid JSON received");
-                if(xSemaphoreTake(data_mutex, pdMS_TO_TICKS(100))) {
-                    if(receivedData.jsonInput != NULL) {
-                        cJSON_Delete(receivedData.jsonInput);
-                    }
-                    receivedData.jsonInput = cJSON_Duplicate(receivedJson, true);
-                    cJSON_Delete(receivedJson);
-                    xSemaphoreGive(data_mutex);
-                } else {
-                    cJSON_Delete(receivedJson);
-                }
-            }
-            
+    atomic_fetch_add_explicit(&mutex_timeouts, 1, memory_order_relaxed);
+    return false;
+}
+
+static void fill_latency_page(spi_stats_page_t *page, const spi_latency_stats_t *latency) {
+    memcpy(page->values + SPI_LATENCY_STAT_HIST, latency->hist, sizeof(latency->hist));
+    page->values[SPI_LATENCY_STAT_FRAMES]  = latency->frames;
+    page->values[SPI_LATENCY_STAT_LAST_US] = latency->last_us;
+    page->values[SPI_LATENCY_STAT_MAX_US]  = latency->max_us;
+}
+
+// Fills an otherwise idle MISO chunk with the next requested page of link statistics
+static void load_stats_page(char *send_buf) {
+    spi_stats_page_t page;
+    memset(&page, 0, sizeof(page));
+    while (!(stats_pages_pending & (1u << page.page))) {
+        ++page.page;
+    }
+    stats_pages_pending &= ~(1u << page.page);
+
+    spi_rx_stats_t stats;
+    spi_secondary_get_rx_stats(&stats);
+    switch (page.page) {
+        case SPI_STATS_PAGE_COUNTERS:
+            page.values[SPI_STAT_CHUNKS]          = stats.chunks;
+            page.values[SPI_STAT_FRAMES]          = stats.frames;
+            page.values[SPI_STAT_BYTES]           = stats.bytes;
+            page.values[SPI_STAT_CHUNKS_PER_S]    = stats.observed_chunks_per_s;
+            page.values[SPI_STAT_FRAMES_PER_S]    = stats.frames_per_s;
+            page.values[SPI_STAT_BYTES_PER_S]     = stats.bytes_per_s;
+            page.values[SPI_STAT_PARSE_FAILURES]  = stats.parse_failures;
+            page.values[SPI_STAT_MUTEX_TIMEOUTS]  = stats.mutex_timeouts;
+            page.values[SPI_STAT_SPI_TIMEOUTS]    = stats.spi_timeouts;
+            page.values[SPI_STAT_OVERRUNS]        = stats.overruns;
+            page.values[SPI_STAT_FRAMES_DROPPED]  = stats.frames_dropped;
+            page.values[SPI_STAT_RESYNCS]         = stats.resyncs;
+            page.values[SPI_STAT_MAX_PROCESS_US]  = stats.max_process_us;
             break;
-        case 'M':
-            // ESP_LOGI(TAG, "Processing Message...");
-            if (xSemaphoreTake(data_mutex, pdMS_TO_TICKS(100))) {
-                receivedData.messageInput = message_data;
-                xSemaphoreGive(data_mutex);
-            }
-            // ESP_LOGI(TAG, "message: %s", get_message());
+        case SPI_STATS_PAGE_FRAME_SIZE:
+            memcpy(page.values, stats.frame_size_hist, sizeof(stats.frame_size_hist));
+            break;
+        case SPI_STATS_PAGE_INTERVAL:
+            memcpy(page.values, stats.frame_interval_hist, sizeof(stats.frame_interval_hist));
+            break;
+        case SPI_STATS_PAGE_PRIORITY:
+            memcpy(page.values + SPI_PRIORITY_STAT_HIST, stats.priority_latency_hist,
+                   sizeof(stats.priority_latency_hist));
+            page.values[SPI_PRIORITY_STAT_COMMANDS] = stats.priority_commands;
+            page.values[SPI_PRIORITY_STAT_MAX_US]   = stats.priority_max_us;
+            break;
+        case SPI_STATS_PAGE_RECEIVE_LATENCY:
+            fill_latency_page(&page, &stats.receive_latency);
+            break;
+        case SPI_STATS_PAGE_PARSE_LATENCY:
+            fill_latency_page(&page, &stats.parse_latency);
+            break;
+        case SPI_STATS_PAGE_CONSUME_LATENCY:
+            fill_latency_page(&page, &stats.consume_latency);
+            break;
+        case SPI_STATS_PAGE_FRAME_AGE:
+            fill_latency_page(&page, &stats.frame_age);
             break;
     }
-}
 
-void send_message(char *message) {
-    memset(command_to_send, 0, sizeof(command_to_send));  // Clear entire buffer
-    memcpy(command_to_send, message, strlen(message));
-    command_to_send[0] = '\0';
-    memcpy(command_to_send, message, strlen(message));
+    spi_stats_page_seal(&page);
+    memcpy(send_buf, &page, sizeof(page));
 }
 
-char* get_message() {
-    char* returnMessage = "";
-    if (xSemaphoreTake(data_mutex, pdMS_TO_TICKS(100))) {
-        if (receivedData.messageInput != NULL) {
-            returnMessage = receivedData.messageInput;
-        } else {
-            // ESP_LOGW(TAG, "messageInput is NULL");
-            returnMessage = NULL;
+/*
+ * Loads the next outgoing chunk for the master. Queued commands are drained
+ * round-robin across producers and packed into the chunk separated by
+ * SPI_COMMAND_SEPARATOR. When nothing is queued the chunk carries
+ * requested statistics pages, then telemetry if it is enabled, "ACK" otherwise.
+ */
+static void load_tx_buffer(char *send_buf, int slot) {
+    memset(send_buf, 0, CHUNK_SIZE);  // Clear old data
+    // Pending RPC requests go first, they have a caller blocked on them
+    size_t used = spi_rpc_load(send_buf, 0, CHUNK_SIZE, &rpc_loaded[slot]);
+    bool full = false;
+
+    for (int n = 0; n < SPI_OUTBOX_PRODUCERS && !full; ++n) {
+        int i = (outbox_next + n) % SPI_OUTBOX_PRODUCERS;
+        spi_outbox_t *outbox = &outboxes[i];
+        uint32_t tail = atomic_load_explicit(&outbox->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&outbox->head, memory_order_acquire);
+
+        while (tail != head) {
+            const char *command = outbox->commands[tail % SPI_OUTBOX_DEPTH];
+            size_t len = strlen(command);
+            size_t separator = used > 0 ? 1 : 0;
+            if (used + separator + len > CHUNK_SIZE - 1) {
+                full = true;  // Leave the rest for the next transaction
+                break;
+            }
+            if (separator) {
+                send_buf[used++] = SPI_COMMAND_SEPARATOR;
+            }
+            memcpy(send_buf + used, command, len);
+            used += len;
+            ++tail;
+            atomic_store_explicit(&outbox->tail, tail, memory_order_release);
+            tx_loaded[slot][i] = tail;  // Delivered once this transaction completes
+            // ESP_LOGI(TAG, "sent: %s", command);
         }
-        xSemaphoreGive(data_mutex);
     }
-    return returnMessage;
-}
+    outbox_next = (outbox_next + 1) % SPI_OUTBOX_PRODUCERS;
 
-cJSON* get_last_json() {
-    cJSON *returnJSON = NULL;
-
-    if (xSemaphoreTake(data_mutex, pdMS_TO_TICKS(1000))) {
-        if (receivedData.jsonInput != NULL) {
-            // Instead of duplicating, simply return the pointer.
-            // NOTE: The caller MUST NOT free this pointer.
-            returnJSON = receivedData.jsonInput;
+    if (used == 0) {
+        if (stats_pages_pending) {
+            load_stats_page(send_buf);
+        } else if (telemetry_enabled) {
+            load_telemetry(send_buf);
         } else {
-            // ESP_LOGW(TAG, "receivedData.jsonInput is NULL");
-            // Create an empty object; the caller is responsible for freeing
-            // this object if it's used, but ideally this branch is rarely hit.
-            returnJSON = cJSON_CreateObject();
+            memcpy(send_buf, "ACK", strlen("ACK"));
         }
+    }
+}
 
-        xSemaphoreGive(data_mutex);
-    } else {
-        // ESP_LOGW(TAG, "Failed to take semaphore");
-        returnJSON = cJSON_CreateObject();
+// Marks the commands carried by a completed transaction as delivered
+static void complete_tx_buffer(int slot) {
+    spi_rpc_delivered(rpc_loaded[slot], trans_done_us[slot]);
+    rpc_loaded[slot] = 0;
+    for (int i = 0; i < SPI_OUTBOX_PRODUCERS; ++i) {
+        if (tx_loaded[slot][i] != 0) {
+            atomic_store_explicit(&outboxes[i].delivered, tx_loaded[slot][i], memory_order_release);
+            tx_loaded[slot][i] = 0;
+            if (outboxes[i].owner) {
+                xTaskNotifyGive(outboxes[i].owner);
+            }
+        }
     }
+}
 
-    return returnJSON;
+// Returns the ring cell that holds chunk number 'cell'
+static inline char *frame_ring_cell(uint32_t cell) {
+    return frame_ring.cells + (cell % FRAME_RING_CELLS) * CHUNK_SIZE;
 }
 
+/*
+ * Returns a contiguous, null-terminated view of the first 'length' bytes of
+ * the frame held in 'cell_count' cells starting at 'start_cell' (all of them
+ * when compacting). Frames are received straight into the ring, so this only
+ * copies when the frame wraps past the end of the ring (into the spare
+ * cells), when the master sent a chunk shorter than CHUNK_SIZE before the
+ * last one, or when the terminator would land in the next cell while that
+ * cell may already hold a received chunk ('next_cell_free' false).
+ */
+static char *frame_ring_frame(uint32_t start_cell, uint32_t cell_count, size_t length, bool compact,
+                              bool next_cell_free) {
+    uint32_t first = start_cell % FRAME_RING_CELLS;
+    char *frame = frame_ring.cells + first * CHUNK_SIZE;
+    char *spare = frame_ring.cells + FRAME_RING_CELLS * CHUNK_SIZE;
+
+    if (first + cell_count > FRAME_RING_CELLS) {
+        uint32_t wrapped = first + cell_count - FRAME_RING_CELLS;
+        memcpy(spare, frame_ring.cells, wrapped * CHUNK_SIZE);
+    } else if (!next_cell_free && !compact && length == cell_count * CHUNK_SIZE &&
+               first + cell_count < FRAME_RING_CELLS) {
+        memcpy(spare, frame, cell_count * CHUNK_SIZE);
+        frame = spare;
+    }
 
-cJSON* get_retro() {
-    cJSON *retro = cJSON_GetObjectItem(get_last_json(), "Retro");
-    return retro;
+    if (compact) {
+        // Close the gaps left by short chunks, moving data towards the frame start
+        length = 0;
+        for (uint32_t i = 0; i < cell_count; ++i) {
+            char *chunk = frame + i * CHUNK_SIZE;
+            size_t chunk_len = strnlen(chunk, CHUNK_SIZE);
+            memmove(frame + length, chunk, chunk_len);
+            length += chunk_len;
+        }
+    }
+    frame[length] = '\0';
+    return frame;
 }
 
-double get_retro_ta() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
-
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+static esp_err_t queue_rx_transaction(spi_slave_transaction_t *transaction) {
+    // Each transaction lands directly in the next cell of the frame ring
+    uint32_t cell = frame_ring.next_cell++;
+    transaction->rx_buffer = frame_ring_cell(cell);
+    transaction->user = (void *)(uintptr_t)cell;
+    memset(transaction->rx_buffer, 0, CHUNK_SIZE);
+    load_tx_buffer((char *)transaction->tx_buffer, transaction - rx_transactions);
+    return spi_slave_queue_trans(SPI2_HOST, transaction, portMAX_DELAY);
+}
 
-    cJSON *ta = cJSON_GetObjectItem(retro_item, "ta");
-    if (!ta || !cJSON_IsNumber(ta)) {
-        // ESP_LOGW(TAG, "ta not found or not a number");
-        return 0.0;
+// Checks a framed message's sequence number, returns false for duplicates
+static bool accept_sequence(uint16_t seq) {
+    if (frame_ring.have_seq) {
+        int16_t delta = (int16_t)(seq - frame_ring.last_seq);
+        if (delta == 0) {
+            ++rx_stats.frames_duplicated;
+            return false;
+        } else if (delta < 0) {
+            // Sequence went backwards, the Pi restarted its counter
+            ++rx_stats.resyncs;
+        } else if (delta > 1) {
+            rx_stats.frames_dropped += delta - 1;
+        }
     }
+    frame_ring.last_seq = seq;
+    frame_ring.have_seq = true;
+    return true;
+}
 
-    // ESP_LOGI(TAG, "Retro ta: %f", ta->valuedouble);
-    return ta->valuedouble;
+// Counts a complete message and files its size and arrival gap in the histograms
+static void record_frame(size_t length) {
+    int64_t now = esp_timer_get_time();
+    ++rx_stats.frames;
+    ++rx_stats.frame_size_hist[spi_stats_bin((uint32_t)length, SPI_STATS_SIZE_BIN_BYTES)];
+    if (rx_stats.last_frame_us) {
+        ++rx_stats.frame_interval_hist[spi_stats_bin((uint32_t)(now - rx_stats.last_frame_us),
+                                                     SPI_STATS_INTERVAL_BIN_US)];
+    }
+    rx_stats.last_frame_us = now;
 }
 
-double get_retro_tx() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+// Files one latency of a vision pipeline stage; a negative one, from clock error, counts as zero
+static void record_latency(spi_latency_stats_t *stats, int64_t latency_us, uint32_t first_edge) {
+    uint32_t latency = latency_us > 0 ? (uint32_t)latency_us : 0;
+    ++stats->frames;
+    stats->last_us = latency;
+    if (latency > stats->max_us) {
+        stats->max_us = latency;
+    }
+    ++stats->hist[spi_stats_bin(latency, first_edge)];
+}
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+// True for the first byte of every message type the master sends
+static inline bool is_message_type(char type) {
+    return type == SPI_MSG_JSON || type == SPI_MSG_TEXT || type == SPI_MSG_BINARY ||
+           type == SPI_MSG_DELTA || type == SPI_MSG_RPC || type == SPI_MSG_STATS;
+}
 
-    cJSON *tx = cJSON_GetObjectItem(retro_item, "tx");
-    if (!tx || !cJSON_IsNumber(tx)) {
-        // ESP_LOGW(TAG, "tx not found or not a number");
-        return 0.0;
+static void dispatch_message(char *message, size_t length) {
+    record_frame(length);
+    if (message[0] == SPI_MSG_BINARY) {
+        process_binary_frame((const uint8_t *)message, length);
+    } else if (message[0] == SPI_MSG_DELTA) {
+        process_delta_frame((const uint8_t *)message, length);
+    } else {
+        process_received_data(message);
     }
+}
 
-    // ESP_LOGI(TAG, "Retro tx: %f", tx->valuedouble);
-    return tx->valuedouble;
+// Starts decoding a J message from its first chunk, 'len' bytes with the type byte
+static void begin_streamed_json(const char *message, size_t len) {
+    vision_json_stream_begin(&json_stream);
+    json_stream_bytes = len;
+    json_streaming = vision_json_stream_feed(&json_stream, message + 1, len - 1);
 }
 
-double get_retro_tx_nocross() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+// Feeds the next piece of the J message being assembled to its decoder
+static void stream_json(const char *data, size_t len) {
+    if (!json_streaming) return;
+    json_stream_bytes += len;
+    // A malformed message is left to process_received_data, which reports it
+    json_streaming = vision_json_stream_feed(&json_stream, data, len);
+}
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+/*
+ * Publishes a J message decoded while its chunks came in, so the frame is
+ * out as soon as the last chunk is. Returns false if it still has to be
+ * decoded from its text.
+ */
+static bool finish_streamed_json() {
+    vision_frame_t frame;
+    bool streamed = json_streaming && vision_json_stream_finish(&json_stream, &frame);
+    json_streaming = false;
+    if (!streamed) return false;
+    record_frame(json_stream_bytes);
+    publish_vision_frame(&frame, &json_stream.tags);
+    return true;
+}
 
-    cJSON *tx_nocross = cJSON_GetObjectItem(retro_item, "tx_nocross");
-    if (!tx_nocross || !cJSON_IsNumber(tx_nocross)) {
-        // ESP_LOGW(TAG, "tx_nocross not found or not a number");
-        return 0.0;
+/*
+ * Takes a priority chunk, already acted on by the priority task, out of the
+ * ring. The part of the frame received before it slides up one cell so the
+ * frame stays contiguous and completes as if the chunk had never been sent.
+ */
+static void skip_priority_cell(uint32_t cell) {
+    for (uint32_t i = cell; i > frame_ring.frame_start; --i) {
+        memcpy(frame_ring_cell(i), frame_ring_cell(i - 1), CHUNK_SIZE);
     }
-
-    // ESP_LOGI(TAG, "Retro tx_nocross: %f", tx_nocross->valuedouble);
-    return tx_nocross->valuedouble;
+    ++frame_ring.frame_start;
 }
 
-double get_retro_txp() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+// Number of cells a framed message occupies, header included
+static inline uint32_t framed_cells(uint16_t length) {
+    return (SPI_FRAME_HEADER_SIZE + length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+static void reset_frame(uint32_t next_cell) {
+    frame_ring.frame_start = next_cell;
+    frame_ring.frame_discard = false;
+    frame_ring.frame_gaps = false;
+    frame_ring.last_chunk_short = false;
+    frame_ring.framed = false;
+    json_streaming = false;
+}
 
-    cJSON *txp = cJSON_GetObjectItem(retro_item, "txp");
-    if (!txp || !cJSON_IsNumber(txp)) {
-        // ESP_LOGW(TAG, "txp not found or not a number");
-        return 0.0;
+// Starts a framed message whose header is at the start of 'cell'
+static void begin_framed(uint32_t cell, const spi_frame_header_t *header) {
+    reset_frame(cell);
+    frame_ring.framed = true;
+    frame_ring.peer_framed = true;
+    frame_ring.resyncing = false;
+    frame_ring.frame_length = header->length;
+
+    if (framed_cells(header->length) > FRAME_MAX_CELLS) {
+        ESP_LOGE(TAG, "Frame exceeds %d bytes, dropping", FRAME_MAX_CELLS * CHUNK_SIZE);
+        ++rx_stats.oversized_frames;
+        frame_ring.frame_discard = true;
+    }
+    if (!accept_sequence(header->seq)) {
+        frame_ring.frame_discard = true;
     }
-
-    // ESP_LOGI(TAG, "Retro txp: %f", txp->valuedouble);
-    return txp->valuedouble;
 }
 
-double get_retro_ty() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+// Feeds the part of a framed J message that is in 'cell' to its decoder
+static void stream_framed_chunk(uint32_t cell) {
+    const char *chunk = frame_ring_cell(cell);
+    if (cell == frame_ring.frame_start) {
+        const char *message = chunk + SPI_FRAME_HEADER_SIZE;
+        if (!frame_ring.frame_discard && frame_ring.frame_length > 0 && message[0] == SPI_MSG_JSON) {
+            size_t room = CHUNK_SIZE - SPI_FRAME_HEADER_SIZE;
+            begin_streamed_json(message, frame_ring.frame_length < room ? frame_ring.frame_length : room);
+        }
+    } else if (json_streaming) {
+        size_t left = frame_ring.frame_length - json_stream_bytes;
+        stream_json(chunk, left < CHUNK_SIZE ? left : CHUNK_SIZE);
+    }
+}
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+// Called for every chunk of a framed message; completes it once 'length' bytes are in
+static void continue_framed(uint32_t cell) {
+    uint32_t cells = framed_cells(frame_ring.frame_length);
+    stream_framed_chunk(cell);
+    if (cell + 1 - frame_ring.frame_start < cells) return;
 
-    cJSON *ty = cJSON_GetObjectItem(retro_item, "ty");
-    if (!ty || !cJSON_IsNumber(ty)) {
-        // ESP_LOGW(TAG, "ty not found or not a number");
-        return 0.0;
+    if (!frame_ring.frame_discard && !finish_streamed_json()) {
+        char *message = frame_ring_frame(frame_ring.frame_start, cells, SPI_FRAME_HEADER_SIZE + frame_ring.frame_length,
+                                         false, false) + SPI_FRAME_HEADER_SIZE;
+        dispatch_message(message, frame_ring.frame_length);
     }
-
-    // ESP_LOGI(TAG, "Retro ty: %f", ty->valuedouble);
-    return ty->valuedouble;
+    reset_frame(cell + 1);
 }
 
-double get_retro_ty_nocross() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+/*
+ * Feeds one received chunk (already sitting in its ring cell) into frame assembly.
+ *
+ * Framed messages (see spi_frame_header_t) complete as soon as their length is
+ * reached. A header arriving before then means the rest of the previous frame
+ * was lost: it is counted as truncated and the new frame starts in this cell,
+ * so the following good frame is kept. Unframed messages still end on <END>.
+ */
+static void handle_received_chunk(uint32_t cell) {
+    char *new_buf = frame_ring_cell(cell);
+    if (spi_priority_decode((const uint8_t *)new_buf, CHUNK_SIZE, NULL)) {
+        skip_priority_cell(cell);
+        return;
+    }
+    size_t chunk_len = strnlen(new_buf, CHUNK_SIZE);
+    uint32_t frame_cells = cell - frame_ring.frame_start;
+    bool end_signal = strncmp(new_buf, END_SIGNAL, strlen(END_SIGNAL)) == 0;
+    spi_frame_header_t header;
+    bool is_header = spi_frame_header_decode((const uint8_t *)new_buf, CHUNK_SIZE, &header);
+
+    if (frame_ring.framed && frame_cells > 0) {
+        if (is_header || end_signal) {
+            ++rx_stats.frames_truncated;
+            ++rx_stats.resyncs;
+            reset_frame(cell + 1);
+            if (is_header) {
+                begin_framed(cell, &header);
+                continue_framed(cell);
+            }
+        } else {
+            continue_framed(cell);
+        }
+        return;
+    }
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+    if (frame_cells == 0 && is_header) {
+        begin_framed(cell, &header);
+        continue_framed(cell);
+        return;
+    }
 
-    cJSON *ty_nocross = cJSON_GetObjectItem(retro_item, "ty_nocross");
-    if (!ty_nocross || !cJSON_IsNumber(ty_nocross)) {
-        // ESP_LOGW(TAG, "ty_nocross not found or not a number");
-        return 0.0;
+    if (end_signal) {
+        // ESP_LOGI(TAG, "End of Transmission received");
+        if (!frame_ring.frame_discard && frame_cells > 0 && !finish_streamed_json()) {
+            // The terminator lands in this <END> cell, which is already handled
+            char *frame = frame_ring_frame(frame_ring.frame_start, frame_cells, frame_cells * CHUNK_SIZE,
+                                           frame_ring.frame_gaps, true);
+            record_frame(strlen(frame));
+            process_received_data(frame);
+        }
+        reset_frame(cell + 1);
+    } else if (frame_cells == 0 && frame_ring.peer_framed && !is_message_type(new_buf[0])) {
+        // The rest of a frame whose header was lost, skip until the next header
+        if (!frame_ring.resyncing) {
+            ++rx_stats.resyncs;
+            frame_ring.resyncing = true;
+        }
+        reset_frame(cell + 1);
+    } else if (frame_cells == 0 && (new_buf[0] == SPI_MSG_BINARY || new_buf[0] == SPI_MSG_DELTA)) {
+        // Binary and delta frames always fit in one chunk and are not followed by <END>
+        dispatch_message(new_buf, CHUNK_SIZE);
+        reset_frame(cell + 1);
+    } else if (frame_cells >= FRAME_MAX_CELLS) {
+        // Frame is larger than the ring allows, drop it and wait for <END>
+        if (!frame_ring.frame_discard) {
+            ESP_LOGE(TAG, "Frame exceeds %d bytes, dropping", FRAME_MAX_CELLS * CHUNK_SIZE);
+            ++rx_stats.oversized_frames;
+            frame_ring.frame_discard = true;
+        }
+    } else {
+        if (frame_cells == 0 && new_buf[0] == SPI_MSG_JSON) {
+            begin_streamed_json(new_buf, chunk_len);
+        } else {
+            stream_json(new_buf, chunk_len);
+        }
+        if (frame_ring.last_chunk_short) {
+            frame_ring.frame_gaps = true;
+        }
+        frame_ring.last_chunk_short = chunk_len < CHUNK_SIZE;
     }
+}
+
+// Runs in the SPI task when the Pi answers a clock sync request
+static void clock_sync_answered(uint16_t id, spi_rpc_status_t status, const char *payload, int64_t delivered_us,
+                                void *arg) {
+    clock_sync_pending = false;
+    spi_clock_sample_t sample;
+    // A request that went out twice cannot be paired with the time it was read
+    if (status != SPI_RPC_OK || !delivered_us || !spi_clock_sample_parse(payload, &sample)) return;
 
-    // ESP_LOGI(TAG, "Retro ty_nocross: %f", ty_nocross->valuedouble);
-    return ty_nocross->valuedouble;
+    clock_sync_sample(&clock_sync, delivered_us, (int64_t)sample.pi_us,
+                      (uint32_t)(esp_timer_get_time() - delivered_us));
 }
 
-double get_retro_typ() {
-    cJSON *retro = get_retro();
-    if (!retro) return 0.0;
+// Starts a clock sync request when one is due, fast until the window has filled
+static void poll_clock_sync() {
+    if (!(link_caps.caps & SPI_CAP_CLOCK_SYNC) || clock_sync_pending) return;
 
-    cJSON *retro_item = cJSON_GetArrayItem(retro, 0);
-    if (!retro_item) return 0.0;
+    int64_t now = esp_timer_get_time();
+    int64_t period = clock_sync.count < CLOCK_SYNC_WINDOW ? CLOCK_SYNC_FAST_PERIOD_US : CLOCK_SYNC_PERIOD_US;
+    if (now - clock_sync_sent_us < period) return;
 
-    cJSON *typ = cJSON_GetObjectItem(retro_item, "typ");
-    if (!typ || !cJSON_IsNumber(typ)) {
-        // ESP_LOGW(TAG, "typ not found or not a number");
-        return 0.0;
+    clock_sync_sent_us = now;
+    clock_sync_pending = spi_rpc_call(SPI_RPC_CLOCK, NULL, clock_sync_answered, NULL) != 0;
+}
+
+// Fields the Pi puts in a frame from 'pipeline': those of the active profile, narrowed by its subscription
+static uint32_t vision_frame_fields(int pipeline) {
+    portENTER_CRITICAL(&vision_lock);
+    uint32_t fields = vision_active.fields;
+    portEXIT_CRITICAL(&vision_lock);
+    if (link_caps.caps & SPI_CAP_SUBSCRIBE) {
+        for (size_t i = 0; i < sizeof(vision_subscriptions) / sizeof(vision_subscriptions[0]); ++i) {
+            if (vision_subscriptions[i].pipeline == pipeline) {
+                fields &= vision_subscriptions[i].fields;
+            }
+        }
     }
+    return fields;
+}
 
-    // ESP_LOGI(TAG, "Retro typ: %f", typ->valuedouble);
-    return typ->valuedouble;
+// Pipeline the delta state is from, -1 before a frame said
+static int delta_pipeline() {
+    return delta_state.valid & (1u << VISION_FIELD_PID) ? delta_state.pID : -1;
 }
 
-cJSON* get_fiducial() {
-    cJSON *fiducial = cJSON_GetObjectItem(get_last_json(), "Fiducial");
-    if (!fiducial) {
-        return NULL;
+/*
+ * Runs in the SPI task once the Pi changed the fields it sends. The ones it
+ * dropped leave the delta state now rather than at the next keyframe, and a
+ * keyframe is asked for: a field it sends again would otherwise only come
+ * back once its value changes.
+ */
+static void vision_fields_changed() {
+    if (!(link_caps.caps & SPI_CAP_DELTA)) return;
+    delta_state.valid &= vision_frame_fields(delta_pipeline());
+    keyframe_requested = spi_send_command(VISION_DELTA_KEYFRAME_REQUEST) != 0;
+}
+
+// Runs in the SPI task when the Pi answers a subscription
+static void vision_subscription_answered(uint16_t id, spi_rpc_status_t status, const char *payload,
+                                         int64_t delivered_us, void *arg) {
+    const spi_vision_subscription_t *subscription = arg;
+    if (status != SPI_RPC_OK) {
+        ESP_LOGW(TAG, "Subscription p%u f%lx not applied", subscription->pipeline,
+                 (unsigned long)subscription->fields);
+        return;
     }
-    return fiducial;
+    vision_fields_changed();
 }
 
-int get_fiducial_fID() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0;
+// Tells the Pi which fields each pipeline's frames need, without blocking
+static void send_vision_subscriptions() {
+    if (!(link_caps.caps & SPI_CAP_SUBSCRIBE)) return;
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0;
+    for (size_t i = 0; i < sizeof(vision_subscriptions) / sizeof(vision_subscriptions[0]); ++i) {
+        char args[SPI_RPC_ARGS_LEN];
+        spi_vision_subscription_format(&vision_subscriptions[i], args, sizeof(args));
+        spi_rpc_call(SPI_RPC_SUBSCRIBE, args, vision_subscription_answered, (void *)&vision_subscriptions[i]);
+    }
+}
 
-    cJSON *fID = cJSON_GetObjectItem(fiducial_item, "fID");
-    if (!fID || !cJSON_IsNumber(fID)) {
-        ESP_LOGW(TAG, "fID not found or not a number");
-        return 0;
+/*
+ * Runs in the SPI task once frames resume after a link loss. The Pi may have
+ * restarted in between, so its clock, the vision profile it runs and the tag
+ * positions seen before the loss can no longer be trusted.
+ */
+static void resync_link() {
+    clock_sync_reset(&clock_sync);
+    if (take_data_mutex(pdMS_TO_TICKS(100))) {
+        roi_predictor_reset(&roi_predictor);
+        xSemaphoreGive(data_mutex);
     }
 
-    ESP_LOGI(TAG, "Fiducial fID: %d", fID->valueint);
-    return fID->valueint;
+    portENTER_CRITICAL(&vision_lock);
+    spi_vision_profile_t profile = vision_requested;
+    vision_request_failed = true;
+    portEXIT_CRITICAL(&vision_lock);
+    send_vision_subscriptions();
+    if (profile.fields) {
+        spi_secondary_request_vision(profile.rate, profile.fields);
+    }
 }
 
-cJSON* get_fiducial_pts() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0;
+void spi_secondary_task(void *arg) {
+    init_ema(&purple_object_ema, 0.2f, "retro");
+    init_ema(&april_tag_ema, 0.2, "fiducial");
+    init_ema(&line_following_ema, 0.2, "retro");
+    esp_err_t ret;
+    int armed = 0;  // Transactions queued with the driver and not yet collected
+    int64_t window_start = esp_timer_get_time();
+    uint32_t window_chunks = 0;
+    uint32_t window_frames = 0;
+    uint32_t window_bytes = 0;
+
+    // All receive memory is allocated once up front: the ring cells plus spare
+    // cells used to unwrap a frame that crosses the end of the ring
+    frame_ring.cells = heap_caps_calloc(1, (FRAME_RING_CELLS + FRAME_MAX_CELLS + 1) * CHUNK_SIZE, MALLOC_CAP_DMA);
+    if (!frame_ring.cells) {
+        ESP_LOGE(TAG, "Frame ring allocation failed!");
+        vTaskDelete(NULL);
+        return;
+    }
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0;
+    // Keep several DMA-capable transactions queued so the slave is armed
+    // while the previous chunk is being processed
+    for (int i = 0; i < SPI_RX_QUEUE_DEPTH; ++i) {
+        tx_buffers[i] = heap_caps_calloc(1, CHUNK_SIZE, MALLOC_CAP_DMA);
+        if (!tx_buffers[i]) {
+            ESP_LOGE(TAG, "DMA buffer allocation failed!");
+            vTaskDelete(NULL);
+            return;
+        }
 
-    cJSON *pts = cJSON_GetObjectItem(fiducial_item, "pts");
-    if (!pts) return 0;
-    return pts;
-}
+        memset(&rx_transactions[i], 0, sizeof(spi_slave_transaction_t));
+        rx_transactions[i].length = CHUNK_SIZE * 8;  // Transaction size in bits
+        rx_transactions[i].tx_buffer = tx_buffers[i];  // Data to send
+        if (queue_rx_transaction(&rx_transactions[i]) == ESP_OK) {
+            ++armed;
+        }
+    }
 
-void get_point_at_index(int index, double* ret) {
-    // Initialize output to zero
-    ret[0] = 0;
-    ret[1] = 0;
+    while (1) {
+        // Wait for master to send data
+        spi_slave_transaction_t *done = NULL;
+        ret = spi_slave_get_trans_result(SPI2_HOST, &done, pdMS_TO_TICKS(100));
+        spi_rpc_poll();
+        if (atomic_exchange(&link_resync, false)) {
+            resync_link();
+        }
+        poll_clock_sync();
+        if (ret == ESP_ERR_TIMEOUT) {
+            ++rx_stats.spi_timeouts;
+        }
+        if (ret != ESP_OK || !done) {
+            continue;
+        }
+        int64_t process_start = esp_timer_get_time();
+        --armed;
+        if (armed == 0) {
+            // Every queued transaction completed before one was re-armed, so
+            // the master may have clocked a chunk into an unarmed slave
+            ++rx_stats.overruns;
+        }
+        if (done->trans_len < done->length) {
+            ++rx_stats.short_transactions;
+        }
 
-    cJSON *pts = get_fiducial_pts();
-    if (!pts) return;
+        complete_tx_buffer(done - rx_transactions);
+        uint32_t frames_before = rx_stats.frames;
+        chunk_received_us = trans_done_us[done - rx_transactions];
+        handle_received_chunk((uint32_t)(uintptr_t)done->user);
+        window_frames += rx_stats.frames - frames_before;
+        window_bytes += done->trans_len / 8;
+        rx_stats.bytes += done->trans_len / 8;
 
-    // Check if the requested index is within bounds.
-    int array_size = cJSON_GetArraySize(pts);
-    if (index < 0 || index >= array_size) {
-        // ESP_LOGW(TAG, "Index %d out of bounds (array size: %d)", index, array_size);
-        return;
+        if (queue_rx_transaction(done) == ESP_OK) {
+            ++armed;
+        }
+
+        // Processing time bounds the chunk rate the slave can sustain
+        int64_t now = esp_timer_get_time();
+        uint32_t process_us = (uint32_t)(now - process_start);
+        ++rx_stats.chunks;
+        rx_stats.total_process_us += process_us;
+        if (process_us > rx_stats.max_process_us) {
+            rx_stats.max_process_us = process_us;
+        }
+        ++window_chunks;
+        if (now - window_start >= 1000000) {
+            rx_stats.observed_chunks_per_s = (uint32_t)((int64_t)window_chunks * 1000000 / (now - window_start));
+            rx_stats.frames_per_s = (uint32_t)((int64_t)window_frames * 1000000 / (now - window_start));
+            rx_stats.bytes_per_s = (uint32_t)((int64_t)window_bytes * 1000000 / (now - window_start));
+            if (rx_stats.observed_chunks_per_s > rx_stats.peak_chunks_per_s) {
+                rx_stats.peak_chunks_per_s = rx_stats.observed_chunks_per_s;
+            }
+            window_chunks = 0;
+            window_frames = 0;
+            window_bytes = 0;
+            window_start = now;
+        }
     }
+}
 
-    // Get the point at the desired index (0 for bottom left, 1 for bottom right)
-    cJSON *point = cJSON_GetArrayItem(pts, index);
-    if (!point) {
-        //cJSON_Delete(pts);
-        return;
+// Applies a priority command, returns false for a repeat of the last one
+static bool apply_priority(const spi_priority_t *priority) {
+    if (atomic_load(&priority_seq_known) && priority->seq == priority_last_seq) return false;
+    atomic_store(&priority_seq_known, true);
+    priority_last_seq = priority->seq;
+
+    switch (priority->command) {
+        case SPI_PRIORITY_STOP:
+            // The motor layer keeps the wheels stopped, whatever the mission code asks of them
+            stop_held = true;
+            if (drive_wheels) {
+                motor_hold(drive_wheels, MOTOR_HOLD_STOP, true);
+            }
+            break;
+        case SPI_PRIORITY_RELEASE:
+            stop_held = false;
+            if (drive_wheels) {
+                motor_hold(drive_wheels, MOTOR_HOLD_STOP, false);
+            }
+            break;
+        default:
+            ESP_LOGW(TAG, "Unknown priority command %u", priority->command);
+            break;
     }
+    return true;
+}
 
-    cJSON *x_item = cJSON_GetArrayItem(point, 0);
-    cJSON *y_item = cJSON_GetArrayItem(point, 1);
-    if (x_item && y_item) {
-        ret[0] = x_item->valuedouble;
-        ret[1] = y_item->valuedouble;
+// Gap in vision frames that counts as a loss, stretched when the Pi was asked for a low rate
+static int64_t link_timeout_us() {
+    int64_t timeout = (int64_t)link_timeout_ms * 1000;
+    portENTER_CRITICAL(&vision_lock);
+    uint16_t rate = vision_active.rate;
+    if (vision_requested.rate && (!rate || vision_requested.rate < rate)) {
+        rate = vision_requested.rate;
+    }
+    portEXIT_CRITICAL(&vision_lock);
+    if (rate && (int64_t)SPI_LINK_TIMEOUT_FRAMES * 1000000 / rate > timeout) {
+        timeout = (int64_t)SPI_LINK_TIMEOUT_FRAMES * 1000000 / rate;
     }
+    return timeout;
 }
 
+// Declares the link lost after a gap in vision frames and back on the next frame, priority task only
+static void supervise_link(int64_t now) {
+    portENTER_CRITICAL(&link_lock);
+    int64_t last = link_last_frame_us;
+    portEXIT_CRITICAL(&link_lock);
+    if (!last) return;
+
+    if (!link_lost) {
+        if (!link_timeout_ms || now - last <= link_timeout_us()) return;
+
+        link_lost = true;
+        link_lost_frame_us = last;
+        // A Pi that went quiet may come back restarted, counting its priority seq from 0 again
+        atomic_store(&priority_seq_known, false);
+        if (drive_wheels) {
+            motor_hold(drive_wheels, MOTOR_HOLD_LINK, true);
+        }
+        ++link_stats.link_losses;
+        ESP_LOGW(TAG, "Link lost, no vision frame for %lldms", (long long)((now - last) / 1000));
+    } else {
+        // Turning the watchdog off also ends a loss
+        if (last == link_lost_frame_us && link_timeout_ms) return;
 
-char* get_fiducial_fam() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return NULL;
+        link_lost = false;
+        if (drive_wheels) {
+            motor_hold(drive_wheels, MOTOR_HOLD_LINK, false);
+        }
+        uint32_t down = (uint32_t)(last - link_lost_frame_us);
+        link_stats.link_down_us += down;
+        if (down > link_stats.link_max_down_us) {
+            link_stats.link_max_down_us = down;
+        }
+        atomic_store(&link_resync, true);
+        ESP_LOGI(TAG, "Link back after %lums", (unsigned long)(down / 1000));
+    }
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return NULL;
+    spi_link_callback_t callback = link_callback;
+    if (callback) {
+        callback(!link_lost, link_callback_arg);
+    }
+}
+
+// Acts on priority chunks the moment their transaction ends, see spi_post_trans_cb
+static void spi_priority_task(void *arg) {
+    priority_event_t event;
+    while (1) {
+        // While the link is watched, wake up in time to notice a gap in frames
+        bool watching = link_timeout_ms || link_lost;
+        TickType_t wait = watching ? pdMS_TO_TICKS(LINK_CHECK_PERIOD_MS) : portMAX_DELAY;
+        bool received = xQueueReceive(priority_queue, &event, wait);
+        supervise_link(esp_timer_get_time());
+        if (!received) continue;
+
+        spi_priority_t priority;
+        if (!spi_priority_decode(event.chunk, CHUNK_SIZE, &priority) || !apply_priority(&priority)) {
+            continue;
+        }
 
-    cJSON *fam = cJSON_GetObjectItem(fiducial_item, "fam");
-    if (!fam || !cJSON_IsString(fam)) {
-        ESP_LOGW(TAG, "fam not found or not a string");
-        return NULL;
+        uint32_t latency = (uint32_t)(esp_timer_get_time() - event.received_us);
+        ++priority_stats.priority_commands;
+        priority_stats.priority_last_us = latency;
+        if (latency > priority_stats.priority_max_us) {
+            priority_stats.priority_max_us = latency;
+        }
+        ++priority_stats.priority_latency_hist[spi_stats_bin(latency, SPI_STATS_PRIORITY_BIN_US)];
+        ESP_LOGI(TAG, "Priority command %u applied in %luus", priority.command, (unsigned long)latency);
     }
+}
 
-    ESP_LOGI(TAG, "Fiducial fam: %s", fam->valuestring);
-    return fam->valuestring;
+void spi_secondary_get_rx_stats(spi_rx_stats_t *stats) {
+    if (!stats) return;
+    *stats = rx_stats;
+    stats->mutex_timeouts = atomic_load_explicit(&mutex_timeouts, memory_order_relaxed);
+    stats->priority_commands = priority_stats.priority_commands;
+    stats->priority_last_us = priority_stats.priority_last_us;
+    stats->priority_max_us = priority_stats.priority_max_us;
+    memcpy(stats->priority_latency_hist, priority_stats.priority_latency_hist,
+           sizeof(stats->priority_latency_hist));
+    stats->link_losses = link_stats.link_losses;
+    stats->link_down_us = link_stats.link_down_us;
+    stats->link_max_down_us = link_stats.link_max_down_us;
+    stats->clock_samples = clock_sync.count;
+    stats->clock_offset_us = clock_sync.offset_us;
+    stats->clock_uncertainty_us = clock_sync.uncertainty_us;
+    portENTER_CRITICAL(&read_stats_lock);
+    stats->consume_latency = read_stats.consume_latency;
+    stats->frame_age = read_stats.frame_age;
+    portEXIT_CRITICAL(&read_stats_lock);
+    stats->avg_process_us = rx_stats.chunks ? (uint32_t)(rx_stats.total_process_us / rx_stats.chunks) : 0;
+    // A chunk can be accepted as long as it takes no longer to process than to clock in
+    stats->sustainable_chunks_per_s = stats->avg_process_us ? 1000000 / stats->avg_process_us : 0;
 }
 
-double get_fiducial_ta() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+void spi_telemetry_enable(bool enable) {
+    telemetry_enabled = enable;
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+bool spi_secondary_handshake(TickType_t timeout) {
+    spi_link_caps_t local = {
+        .version = SPI_PROTOCOL_VERSION,
+        .caps = SPI_CAP_BINARY | SPI_CAP_FRAMED | SPI_CAP_TELEMETRY | SPI_CAP_STATS | SPI_CAP_DELTA |
+                SPI_CAP_VISION_RATE | SPI_CAP_ROI_HINT | SPI_CAP_CLOCK_SYNC | SPI_CAP_SUBSCRIBE,
+        .chunk_size = CHUNK_SIZE,
+        .frame_rate = SPI_LINK_FRAME_RATE
+    };
+    char request[SPI_RPC_ARGS_LEN];
+    char answer[SPI_RPC_PAYLOAD_LEN];
+    spi_link_caps_format(&local, request, sizeof(request));
+
+    spi_link_caps_t peer;
+    if (spi_rpc_call_wait(SPI_RPC_HANDSHAKE, request, answer, sizeof(answer), timeout) != SPI_RPC_OK ||
+        !spi_link_caps_parse(answer, &peer)) {
+        return false;
+    }
 
-    cJSON *ta = cJSON_GetObjectItem(fiducial_item, "ta");
-    if (!ta || !cJSON_IsNumber(ta)) {
-        ESP_LOGW(TAG, "ta not found or not a number");
-        return 0.0;
+    spi_link_negotiate(&local, &peer, &link_caps);
+    // The Pi may have restarted since its last priority command, so its next one is not a repeat
+    atomic_store(&priority_seq_known, false);
+    if (peer.chunk_size != CHUNK_SIZE) {
+        ESP_LOGE(TAG, "Pi uses %u byte chunks, expected %d; staying on JSON", peer.chunk_size, CHUNK_SIZE);
     }
+    spi_telemetry_enable((link_caps.caps & SPI_CAP_TELEMETRY) != 0);
+    ESP_LOGI(TAG, "Link v%u caps=0x%lx rate=%u", link_caps.version, (unsigned long)link_caps.caps,
+             link_caps.frame_rate);
+    send_vision_subscriptions();
+    return true;
+}
 
-    // ESP_LOGI(TAG, "Fiducial ta: %f", ta->valuedouble);
-    return ta->valuedouble;
+void spi_secondary_get_link_caps(spi_link_caps_t *caps) {
+    if (!caps) return;
+    *caps = link_caps;
 }
 
-double get_fiducial_tx() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+// Runs in the SPI task when the Pi answers a vision profile request
+static void vision_profile_answered(uint16_t id, spi_rpc_status_t status, const char *payload, int64_t delivered_us,
+                                    void *arg) {
+    int index = (int)(intptr_t)arg;
+    portENTER_CRITICAL(&vision_lock);
+    spi_vision_profile_t profile = vision_calls[index].profile;
+    vision_calls[index].busy = false;
+    bool fields_changed = false;
+    if (status == SPI_RPC_OK) {
+        fields_changed = profile.fields != vision_active.fields;
+        vision_active = profile;
+    } else {
+        vision_request_failed = true;
+    }
+    portEXIT_CRITICAL(&vision_lock);
+    if (fields_changed) {
+        vision_fields_changed();
+    }
+    if (status != SPI_RPC_OK) {
+        ESP_LOGW(TAG, "Vision profile r%u f%lx not applied", profile.rate, (unsigned long)profile.fields);
+    }
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+bool spi_secondary_request_vision(uint16_t rate, uint32_t fields) {
+    if (!(link_caps.caps & SPI_CAP_VISION_RATE)) return false;
 
-    cJSON *tx = cJSON_GetObjectItem(fiducial_item, "tx");
-    if (!tx || !cJSON_IsNumber(tx)) {
-        ESP_LOGW(TAG, "tx not found or not a number");
-        return 0.0;
+    spi_vision_profile_t profile = { .rate = rate, .fields = fields & VISION_FIELDS_ALL };
+    if (link_caps.frame_rate && (profile.rate == 0 || profile.rate > link_caps.frame_rate)) {
+        profile.rate = link_caps.frame_rate;
     }
 
-    double txd = tx->valuedouble;
-    if (!txd) return 0.0;
-    // ESP_LOGI(TAG, "Fiducial tx: %f", tx->valuedouble);
-    return txd;
+    // The call's entry is claimed before the call exists, so its answer always finds its own profile;
+    // every call ends in vision_profile_answered, which gives the entry back
+    int index = -1;
+    portENTER_CRITICAL(&vision_lock);
+    bool repeat = !vision_request_failed && profile.rate == vision_requested.rate &&
+                  profile.fields == vision_requested.fields;
+    if (!repeat) {
+        vision_requested = profile;
+        vision_request_failed = false;
+        for (int i = 0; i < SPI_RPC_MAX_PENDING; ++i) {
+            if (!vision_calls[i].busy) {
+                vision_calls[i].busy = true;
+                vision_calls[i].profile = profile;
+                index = i;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&vision_lock);
+    if (repeat) return true;
+
+    char args[SPI_RPC_ARGS_LEN];
+    spi_vision_profile_format(&profile, args, sizeof(args));
+    if (index < 0 || spi_rpc_call(SPI_RPC_VISION, args, vision_profile_answered, (void *)(intptr_t)index) == 0) {
+        portENTER_CRITICAL(&vision_lock);
+        if (index >= 0) {
+            vision_calls[index].busy = false;
+        }
+        vision_request_failed = true;
+        portEXIT_CRITICAL(&vision_lock);
+        return false;
+    }
+    return true;
 }
 
-double get_fiducial_tx_nocross() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+void spi_secondary_get_vision_profile(spi_vision_profile_t *profile) {
+    if (!profile) return;
+    portENTER_CRITICAL(&vision_lock);
+    *profile = vision_active;
+    portEXIT_CRITICAL(&vision_lock);
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+void spi_secondary_set_wheels(motor_t *wheels) {
+    drive_wheels = wheels;
+}
 
-    cJSON *tx_nocross = cJSON_GetObjectItem(fiducial_item, "tx_nocross");
-    if (!tx_nocross || !cJSON_IsNumber(tx_nocross)) {
-        ESP_LOGW(TAG, "tx_nocross not found or not a number");
-        return 0.0;
-    }
+bool spi_secondary_stop_held() {
+    return stop_held;
+}
 
-    ESP_LOGI(TAG, "Fiducial tx_nocross: %f", tx_nocross->valuedouble);
-    return tx_nocross->valuedouble;
+void spi_secondary_set_link_timeout(uint32_t timeout_ms) {
+    link_timeout_ms = timeout_ms;
 }
 
-double get_fiducial_txp() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+void spi_secondary_set_link_callback(spi_link_callback_t callback, void *arg) {
+    link_callback_arg = arg;
+    link_callback = callback;
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+bool spi_secondary_link_up() {
+    return !link_lost;
+}
 
-    cJSON *txp = cJSON_GetObjectItem(fiducial_item, "txp");
-    if (!txp || !cJSON_IsNumber(txp)) {
-        ESP_LOGW(TAG, "txp not found or not a number");
-        return 0.0;
+bool spi_secondary_wait_link(TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+    while (link_lost) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(LINK_CHECK_PERIOD_MS));
     }
-
-    ESP_LOGI(TAG, "Fiducial txp: %f", txp->valuedouble);
-    return txp->valuedouble;
+    return true;
 }
 
-double get_fiducial_ty() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+bool spi_secondary_get_frame_timing(spi_frame_timing_t *timing) {
+    if (!timing) return false;
+    vision_state_t state;
+    read_vision_state(&state);
+    *timing = state.timing;
+    return timing->parsed_us != 0;
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+bool spi_secondary_snapshot(spi_vision_snapshot_t *snapshot) {
+    if (!snapshot) return false;
+    return read_vision_snapshot(-1, snapshot);
+}
 
-    cJSON *ty = cJSON_GetObjectItem(fiducial_item, "ty");
-    if (!ty || !cJSON_IsNumber(ty)) {
-        ESP_LOGW(TAG, "ty not found or not a number");
-        return 0.0;
-    }
+bool spi_secondary_snapshot_tag(int fID, spi_vision_snapshot_t *snapshot) {
+    if (!snapshot) return false;
+    if (fID >= 0) return read_vision_snapshot(fID, snapshot);
+    bool seen = read_vision_snapshot(-1, snapshot) && snapshot->frame.target == VISION_TARGET_FIDUCIAL;
+    // A tag out of view reads as 0 everywhere, like the getters
+    if (!seen) memset(&snapshot->frame, 0, sizeof(snapshot->frame));
+    return seen;
+}
 
-    ESP_LOGI(TAG, "Fiducial ty: %f", ty->valuedouble);
-    return ty->valuedouble;
+bool spi_secondary_has_new_frame(uint32_t seq) {
+    // An odd count is a frame still being published, not readable yet
+    uint32_t published = atomic_load_explicit(&vision_seq, memory_order_acquire) / 2;
+    return (int32_t)(published - seq) > 0;
 }
 
-double get_fiducial_ty_nocross() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+void spi_telemetry_set_segment(uint8_t segment) {
+    telemetry_segment = segment;
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+void spi_secondary_reset_rx_stats() {
+    // Cumulative times are kept so the sustainable rate estimate survives a reset
+    uint64_t total_process_us = rx_stats.total_process_us;
+    uint32_t chunks = rx_stats.chunks;
+    memset(&rx_stats, 0, sizeof(rx_stats));
+    rx_stats.total_process_us = total_process_us;
+    rx_stats.chunks = chunks;
+    atomic_store_explicit(&mutex_timeouts, 0, memory_order_relaxed);
+    memset(&priority_stats, 0, sizeof(priority_stats));
+    memset(&link_stats, 0, sizeof(link_stats));
+    portENTER_CRITICAL(&read_stats_lock);
+    memset(&read_stats, 0, sizeof(read_stats));
+    portEXIT_CRITICAL(&read_stats_lock);
+}
 
-    cJSON *ty_nocross = cJSON_GetObjectItem(fiducial_item, "ty_nocross");
-    if (!ty_nocross || !cJSON_IsNumber(ty_nocross)) {
-        ESP_LOGW(TAG, "ty_nocross not found or not a number");
-        return 0.0;
+void spi_secondary_log_rx_stats() {
+    spi_rx_stats_t stats;
+    spi_secondary_get_rx_stats(&stats);
+    ESP_LOGI(TAG, "chunks=%lu overruns=%lu short=%lu rate=%lu/s peak=%lu/s proc avg=%luus max=%luus sustainable=%lu/s",
+             (unsigned long)stats.chunks, (unsigned long)stats.overruns, (unsigned long)stats.short_transactions,
+             (unsigned long)stats.observed_chunks_per_s, (unsigned long)stats.peak_chunks_per_s,
+             (unsigned long)stats.avg_process_us, (unsigned long)stats.max_process_us,
+             (unsigned long)stats.sustainable_chunks_per_s);
+    ESP_LOGI(TAG, "frames=%lu dropped=%lu duplicated=%lu truncated=%lu resyncs=%lu oversized=%lu",
+             (unsigned long)stats.frames, (unsigned long)stats.frames_dropped,
+             (unsigned long)stats.frames_duplicated, (unsigned long)stats.frames_truncated,
+             (unsigned long)stats.resyncs, (unsigned long)stats.oversized_frames);
+    ESP_LOGI(TAG, "bytes=%lu frames/s=%lu bytes/s=%lu parse_failures=%lu mutex_timeouts=%lu spi_timeouts=%lu",
+             (unsigned long)stats.bytes, (unsigned long)stats.frames_per_s, (unsigned long)stats.bytes_per_s,
+             (unsigned long)stats.parse_failures, (unsigned long)stats.mutex_timeouts,
+             (unsigned long)stats.spi_timeouts);
+    ESP_LOGI(TAG, "deltas=%lu keyframes=%lu stale=%lu",
+             (unsigned long)stats.deltas, (unsigned long)stats.delta_keyframes, (unsigned long)stats.deltas_stale);
+    ESP_LOGI(TAG, "priority commands=%lu last=%luus max=%luus",
+             (unsigned long)stats.priority_commands, (unsigned long)stats.priority_last_us,
+             (unsigned long)stats.priority_max_us);
+    ESP_LOGI(TAG, "link losses=%lu down=%luus longest=%luus",
+             (unsigned long)stats.link_losses, (unsigned long)stats.link_down_us,
+             (unsigned long)stats.link_max_down_us);
+    ESP_LOGI(TAG, "clock samples=%lu offset=%lldus uncertainty=%luus",
+             (unsigned long)stats.clock_samples, (long long)stats.clock_offset_us,
+             (unsigned long)stats.clock_uncertainty_us);
+    ESP_LOGI(TAG, "latency last/max: receive=%lu/%luus parse=%lu/%luus consume=%lu/%luus age=%lu/%luus",
+             (unsigned long)stats.receive_latency.last_us, (unsigned long)stats.receive_latency.max_us,
+             (unsigned long)stats.parse_latency.last_us, (unsigned long)stats.parse_latency.max_us,
+             (unsigned long)stats.consume_latency.last_us, (unsigned long)stats.consume_latency.max_us,
+             (unsigned long)stats.frame_age.last_us, (unsigned long)stats.frame_age.max_us);
+
+    char sizes[SPI_STATS_HIST_BINS * 11 + 1] = "";
+    char intervals[SPI_STATS_HIST_BINS * 11 + 1] = "";
+    char latencies[SPI_STATS_HIST_BINS * 11 + 1] = "";
+    char ages[SPI_STATS_HIST_BINS * 11 + 1] = "";
+    size_t sizes_len = 0, intervals_len = 0, latencies_len = 0, ages_len = 0;
+    for (int i = 0; i < SPI_STATS_HIST_BINS; ++i) {
+        sizes_len += snprintf(sizes + sizes_len, sizeof(sizes) - sizes_len, " %lu",
+                              (unsigned long)stats.frame_size_hist[i]);
+        intervals_len += snprintf(intervals + intervals_len, sizeof(intervals) - intervals_len, " %lu",
+                                  (unsigned long)stats.frame_interval_hist[i]);
+        latencies_len += snprintf(latencies + latencies_len, sizeof(latencies) - latencies_len, " %lu",
+                                  (unsigned long)stats.priority_latency_hist[i]);
+        ages_len += snprintf(ages + ages_len, sizeof(ages) - ages_len, " %lu",
+                             (unsigned long)stats.frame_age.hist[i]);
     }
+    ESP_LOGI(TAG, "frame size hist (<=%dB doubling):%s", SPI_STATS_SIZE_BIN_BYTES, sizes);
+    ESP_LOGI(TAG, "frame interval hist (<=%dus doubling):%s", SPI_STATS_INTERVAL_BIN_US, intervals);
+    ESP_LOGI(TAG, "priority latency hist (<=%dus doubling):%s", SPI_STATS_PRIORITY_BIN_US, latencies);
+    ESP_LOGI(TAG, "frame age hist (<=%dus doubling):%s", SPI_STATS_LATENCY_BIN_US, ages);
+}
 
-    ESP_LOGI(TAG, "Fiducial ty_nocross: %f", ty_nocross->valuedouble);
-    return ty_nocross->valuedouble;
+// Converts a frame's capture time to esp_timer time, 0 if it carried none or the clock is not synced
+static int64_t capture_to_local(uint32_t capture_us) {
+    int64_t local_us;
+    if (!capture_us || !clock_sync_to_local(&clock_sync, capture_us, chunk_received_us, &local_us)) return 0;
+    return local_us;
 }
 
-double get_fiducial_typ() {
-    cJSON *fiducial = get_fiducial();
-    if (!fiducial) return 0.0;
+// Stamps vision data about to be published and files its receive and parse latencies, SPI task only
+static void stamp_vision_frame(spi_frame_timing_t *timing, uint32_t capture_us) {
+    int64_t now = esp_timer_get_time();
+    timing->captured_us = capture_to_local(capture_us);
+    timing->received_us = chunk_received_us;
+    timing->parsed_us = now;
+    // Feeds the link watchdog, see supervise_link
+    portENTER_CRITICAL(&link_lock);
+    link_last_frame_us = now;
+    portEXIT_CRITICAL(&link_lock);
+
+    if (timing->captured_us) {
+        record_latency(&rx_stats.receive_latency, timing->received_us - timing->captured_us,
+                       SPI_STATS_LATENCY_BIN_US);
+    }
+    record_latency(&rx_stats.parse_latency, now - timing->received_us, SPI_STATS_PARSE_BIN_US);
+}
 
-    cJSON *fiducial_item = cJSON_GetArrayItem(fiducial, 0);
-    if (!fiducial_item) return 0.0;
+// When vision data was seen: its capture time if known, else its arrival
+static int64_t vision_seen_us(const spi_frame_timing_t *timing) {
+    return timing->captured_us ? timing->captured_us : timing->received_us;
+}
 
-    cJSON *typ = cJSON_GetObjectItem(fiducial_item, "typ");
-    if (!typ || !cJSON_IsNumber(typ)) {
-        ESP_LOGW(TAG, "typ not found or not a number");
-        return 0.0;
+// Feeds the ROI predictor from a fiducial in a frame that saw a tag, called with data_mutex held
+static void observe_fiducial_frame(const vision_frame_t *frame, const spi_frame_timing_t *timing) {
+    uint32_t needed = (1u << VISION_FIELD_FID) | (1u << VISION_FIELD_PT0) | (1u << VISION_FIELD_PT1) |
+                      (1u << VISION_FIELD_PT2) | (1u << VISION_FIELD_PT3);
+    if (frame->target == VISION_TARGET_FIDUCIAL && (frame->valid & needed) == needed) {
+        roi_predictor_observe(&roi_predictor, frame->pts, frame->fID, vision_seen_us(timing));
     }
-
-    ESP_LOGI(TAG, "Fiducial typ: %f", typ->valuedouble);
-    return typ->valuedouble;
 }
 
-double get_pID() {
-    // Get the last JSON object
-    cJSON *json = get_last_json();
-    if (!json) {
-        ESP_LOGW(TAG, "JSON object is NULL");
-        return -1;  // Return an invalid value to indicate an error
+/*
+ * Hands 'frame' and every fiducial it saw to the getters, see vision_state;
+ * 'tags' is NULL for formats that only carry the frame's own target. SPI task
+ * only. The copy is made with this core's interrupts off, so a getter on the
+ * same core never finds the count odd and one on the other core spins for a
+ * struct copy at most.
+ */
+static void publish_vision_frame(const vision_frame_t *frame, const vision_tags_t *tags) {
+    vision_state_t state = { .frame = *frame };
+    stamp_vision_frame(&state.timing, frame->capture_us);
+    if (!tags) {
+        memset(&frame_tags, 0, sizeof(frame_tags));
+        if (frame->target == VISION_TARGET_FIDUCIAL) vision_tags_add(&frame_tags, frame);
+        tags = &frame_tags;
     }
-    
-    // Get the pID item from the JSON
-    cJSON *pID = cJSON_GetObjectItem(json, "pID");
-    
-    if (!pID) {
-        // ESP_LOGW(TAG, "pID not found in JSON");
-        return -1;  // Return an error value if pID is missing
+
+    portENTER_CRITICAL(&vision_publish_lock);
+    uint32_t seq = atomic_load_explicit(&vision_seq, memory_order_relaxed);
+    atomic_store_explicit(&vision_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    vision_state = state;
+    vision_tags = *tags;
+    atomic_store_explicit(&vision_seq, seq + 2, memory_order_release);
+    portEXIT_CRITICAL(&vision_publish_lock);
+
+    if (frame->v && take_data_mutex(pdMS_TO_TICKS(100))) {
+        // The predictor follows the tag hints are asked for, else the one the Pi listed first
+        const vision_frame_t *tag = vision_tags_find(tags, roi_fID);
+        observe_fiducial_frame(tag ? tag : frame, &state.timing);
+        xSemaphoreGive(data_mutex);
     }
-    
-    // Ensure pID is a number
-    if (!cJSON_IsNumber(pID)) {
-        ESP_LOGW(TAG, "pID is not a number");
-        return -1;  // Return an error value if pID is not a number
+}
+
+// Copies the newest vision data and its timing without blocking, returns the vision_seq it was published under
+static uint32_t read_vision_state(vision_state_t *state) {
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&vision_seq, memory_order_acquire);
+        if (seq & 1) continue;  // Being published from the other core
+        *state = vision_state;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&vision_seq, memory_order_relaxed) == seq) return seq;
     }
-    
-    // If all checks pass, return the pID value
-    // ESP_LOGI(TAG, "pID: %f", pID->valuedouble);
-    return pID->valuedouble;
 }
 
+// Files the consume latency the first time a getter reads the vision data published under 'seq'
+static void note_vision_read(uint32_t seq, const spi_frame_timing_t *timing) {
+    uint32_t last = atomic_load_explicit(&vision_read_seq, memory_order_relaxed);
+    if ((int32_t)(seq - last) <= 0 || !timing->parsed_us) return;
+    // Several tasks may read the same frame; only the one that claims it files it
+    if (!atomic_compare_exchange_strong_explicit(&vision_read_seq, &last, seq, memory_order_relaxed,
+                                                 memory_order_relaxed)) {
+        return;
+    }
 
-char* get_pTYPE() {
-    cJSON *pTYPE = cJSON_GetObjectItem(get_last_json(), "pTYPE");
-    if (!pTYPE || !cJSON_IsString(pTYPE)) {
-        ESP_LOGW(TAG, "pTYPE not found or not a string");
-        return NULL;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&read_stats_lock);
+    record_latency(&read_stats.consume_latency, now - timing->parsed_us, SPI_STATS_LATENCY_BIN_US);
+    if (timing->captured_us) {
+        record_latency(&read_stats.frame_age, now - timing->captured_us, SPI_STATS_LATENCY_BIN_US);
     }
+    portEXIT_CRITICAL(&read_stats_lock);
+}
 
-    ESP_LOGI(TAG, "pTYPE: %s", pTYPE->valuestring);
-    return pTYPE->valuestring;
+void process_received_data(char *input) {
+    if (input == NULL) {
+        ESP_LOGE(TAG, "nuh uh bud");
+        return;
+    }
+    // ESP_LOGI(TAG, "HEAP: %u", (unsigned int)esp_get_free_heap_size());
+    char message_type = input[0];
+    char *message_data = input + 1;
+    switch (message_type) {
+        case 'J':
+            //ESP_LOGI(TAG, "Processing JSON...");
+            // Scanned in place into the frame, nothing allocated; the message is
+            // complete, so the stream decoder is free
+            vision_frame_t frame;
+            vision_json_stream_begin(&json_stream);
+            vision_json_stream_feed(&json_stream, message_data, strlen(message_data));
+            if (!vision_json_stream_finish(&json_stream, &frame)) {
+                ++rx_stats.parse_failures;
+                ESP_LOGE(TAG, "Invalid JSON!");
+                ESP_LOGI(TAG, "Message Data: %s", message_data);
+                break;
+            }
+            publish_vision_frame(&frame, &json_stream.tags);
+            break;
+        case 'M':
+            // ESP_LOGI(TAG, "Processing Message...");
+            if (take_data_mutex(pdMS_TO_TICKS(100))) {
+                // The frame ring cell is reused, so keep a copy of the message
+                strncpy(message_buffer, message_data, MESSAGE_MAX_LEN - 1);
+                message_buffer[MESSAGE_MAX_LEN - 1] = '\0';
+                xSemaphoreGive(data_mutex);
+            }
+            // ESP_LOGI(TAG, "message: %s", get_message());
+            break;
+        case SPI_MSG_RPC:
+            spi_rpc_handle_response(message_data);
+            break;
+        case SPI_MSG_STATS:
+            stats_pages_pending = (1u << SPI_STATS_PAGE_COUNT) - 1;
+            break;
+    }
 }
 
-int get_v() {
-    cJSON *v = cJSON_GetObjectItem(get_last_json(), "v");
-    if (!v || !cJSON_IsNumber(v)) {
-        // ESP_LOGW(TAG, "v not found or not a number");
-        return 0;
+void process_binary_frame(const uint8_t *input, size_t len) {
+    vision_frame_t frame;
+    if (!vision_frame_decode_binary(input, len, &frame)) {
+        ++rx_stats.parse_failures;
+        ESP_LOGE(TAG, "Invalid binary frame!");
+        return;
     }
-    return v->valueint;
+
+    publish_vision_frame(&frame, NULL);
 }
 
-void init_ema(EMAState *ema, double alpha, char* type) {
-    if (!ema) return;
+void process_delta_frame(const uint8_t *input, size_t len) {
+    switch (vision_frame_apply_delta(input, len, &delta_state, &delta_seq, delta_valid,
+                                     vision_frame_fields(delta_pipeline()))) {
+        case VISION_DELTA_KEYFRAME:
+            ++rx_stats.delta_keyframes;
+            delta_valid = true;
+            keyframe_requested = false;
+            break;
+        case VISION_DELTA_APPLIED:
+            ++rx_stats.deltas;
+            break;
+        case VISION_DELTA_STALE:
+            // A base frame was lost; ask once for a keyframe rather than waiting for the next one
+            ++rx_stats.deltas_stale;
+            delta_valid = false;
+            if (!keyframe_requested) {
+                keyframe_requested = spi_send_command(VISION_DELTA_KEYFRAME_REQUEST) != 0;
+            }
+            return;
+        default:
+            ++rx_stats.parse_failures;
+            ESP_LOGE(TAG, "Invalid delta frame!");
+            return;
+    }
 
-    ema->alpha = alpha;
-    ema->initialized = false;
-    ema->pipeline_type = type;
+    publish_vision_frame(&delta_state, NULL);
+}
 
-    ema->ta_ema = 0.0f;
-    ema->tx_ema = 0.0f;
-    ema->tx_nocross_ema = 0.0f;
-    ema->txp_ema = 0.0f;
-    ema->ty_ema = 0.0f;
-    ema->ty_nocross_ema = 0.0f;
-    ema->typ_ema = 0.0f;
+// Copies the newest vision data for a getter, all fields invalid before the first frame
+static void read_vision_frame(vision_frame_t *frame) {
+    vision_state_t state;
+    note_vision_read(read_vision_state(&state), &state.timing);
+    *frame = state.frame;
+}
 
-    ESP_LOGI(TAG, "EMA initialized with alpha=%.2f", alpha);
+/*
+ * Copies the newest vision data into 'snapshot' without blocking, with its
+ * frame the whole frame, or for fID >= 0 that tag merged with the frame's
+ * own members. False before the first frame, or if it did not see the tag.
+ */
+static bool read_vision_snapshot(int fID, spi_vision_snapshot_t *snapshot) {
+    uint32_t seq;
+    vision_state_t state;
+    vision_frame_t tag;
+    const vision_frame_t *found;
+    for (;;) {
+        seq = atomic_load_explicit(&vision_seq, memory_order_acquire);
+        if (seq & 1) continue;  // Being published from the other core
+        found = fID >= 0 ? vision_tags_find(&vision_tags, fID) : NULL;
+        if (found) tag = *found;
+        state = vision_state;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&vision_seq, memory_order_relaxed) == seq) break;
+    }
+    note_vision_read(seq, &state.timing);
+
+    snapshot->seq = seq / 2;
+    snapshot->timing = state.timing;
+    snapshot->age_us = seq ? esp_timer_get_time() - vision_seen_us(&state.timing) : 0;
+    if (fID < 0) {
+        snapshot->frame = state.frame;
+        return seq != 0;
+    }
+    if (!found) {
+        memset(&snapshot->frame, 0, sizeof(snapshot->frame));
+        return false;
+    }
+    // The frame's own members, as for its first target
+    tag.pID = state.frame.pID;
+    tag.v = state.frame.v;
+    tag.capture_us = state.frame.capture_us;
+    tag.valid |= state.frame.valid & ((1u << VISION_FIELD_PID) | (1u << VISION_FIELD_V));
+    snapshot->frame = tag;
+    return true;
 }
 
-void reset_ema(EMAState *ema) {
-    if (!ema) return;
-    ema->initialized = false;
-    ESP_LOGI(TAG, "EMA state reset");
+// Whether 'frame' has 'field' for 'target'; VISION_TARGET_NONE for fields of any frame
+static inline bool vision_frame_has(const vision_frame_t *frame, vision_target_t target, int field) {
+    return (target == VISION_TARGET_NONE || frame->target == target) && (frame->valid & (1u << field));
 }
 
+// Copies the newest vision data and checks it has 'field' for 'target', see vision_frame_has
+static bool read_vision_field(vision_frame_t *frame, vision_target_t target, int field) {
+    read_vision_frame(frame);
+    return vision_frame_has(frame, target, field);
+}
 
-void update_ema(EMAState *ema) {
-    if (!ema) return;
-    double point_bottom_left[2];
-    double point_bottom_right[2];
-    double point_top_right[2];
-    double point_top_left[2];
-    double ta = 0.0;
-    double tx = 0.0;
-    double tx_nocross = 0.0;
-    double txp = 0.0;
-    double ty = 0.0;
-    double ty_nocross = 0.0;
-    double typ = 0.0;
-    if (strcmp(ema->pipeline_type, "fiducial") == 0) {
-        get_point_at_index(0, point_bottom_left);
-        get_point_at_index(1, point_bottom_right);
-        get_point_at_index(2, point_top_right);
-        get_point_at_index(3, point_top_left);
-
-        ta          = get_fiducial_ta();
-        tx          = get_fiducial_tx();
-        tx_nocross  = get_fiducial_tx_nocross();
-        txp         = get_fiducial_txp();
-        ty          = get_fiducial_ty();
-        ty_nocross  = get_fiducial_ty_nocross();
-        typ         = get_fiducial_typ();
-    } else if (strcmp(ema->pipeline_type, "retro") == 0) {
-        ta          = get_retro_ta();
-        tx          = get_retro_tx();
-        tx_nocross  = get_retro_tx_nocross();
-        txp         = get_retro_txp();
-        ty          = get_retro_ty();
-        ty_nocross  = get_retro_ty_nocross();
-        typ         = get_retro_typ();
-    }
+uint32_t spi_send_command(const char *message) {
+    if (!message) return 0;
 
-    if (!ema->initialized) {
-        ema->point_bottom_left[0] = point_bottom_left[0];
-        ema->point_bottom_left[1] = point_bottom_left[1];
+    spi_outbox_t *outbox = get_outbox();
+    if (!outbox) {
+        ESP_LOGE(TAG, "No free outbox for this task");
+        return 0;
+    }
 
-        ema->point_bottom_right[0] = point_bottom_right[0];
-        ema->point_bottom_right[1] = point_bottom_right[1];
+    uint32_t head = atomic_load_explicit(&outbox->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&outbox->tail, memory_order_acquire);
+    if (head - tail >= SPI_OUTBOX_DEPTH) {
+        ESP_LOGW(TAG, "Outbox full, dropping: %s", message);
+        return 0;
+    }
 
-        ema->point_top_right[0] = point_top_right[0];
-        ema->point_top_right[1] = point_top_right[1];
+    char *slot = outbox->commands[head % SPI_OUTBOX_DEPTH];
+    strncpy(slot, message, CHUNK_SIZE - 1);
+    slot[CHUNK_SIZE - 1] = '\0';
+    atomic_store_explicit(&outbox->head, head + 1, memory_order_release);
+    return head + 1;
+}
 
-        ema->point_top_left[0] = point_top_left[0];
-        ema->point_top_left[1] = point_top_left[1];
+bool spi_command_delivered(uint32_t id) {
+    spi_outbox_t *outbox = get_outbox();
+    if (!outbox || id == 0) return false;
+    uint32_t delivered = atomic_load_explicit(&outbox->delivered, memory_order_acquire);
+    return (int32_t)(delivered - id) >= 0;
+}
 
-        ema->ta_ema = ta;
-        ema->tx_ema = tx;
-        ema->tx_nocross_ema = tx_nocross;
-        ema->txp_ema = txp;
-        ema->ty_ema = ty;
-        ema->ty_nocross_ema = ty_nocross;
-        ema->typ_ema = typ;
-        ema->initialized = true;
-        ESP_LOGI(TAG, "EMA first update: initialization complete");
-    } else {
-        ema->ta_ema          = ema->alpha * ta         + (1.0f - ema->alpha) * ema->ta_ema;
-        ema->tx_ema          = ema->alpha * tx         + (1.0f - ema->alpha) * ema->tx_ema;
-        ema->tx_nocross_ema  = ema->alpha * tx_nocross + (1.0f - ema->alpha) * ema->tx_nocross_ema;
-        ema->txp_ema         = ema->alpha * txp        + (1.0f - ema->alpha) * ema->txp_ema;
-        ema->ty_ema          = ema->alpha * ty         + (1.0f - ema->alpha) * ema->ty_ema;
-        ema->ty_nocross_ema  = ema->alpha * ty_nocross + (1.0f - ema->alpha) * ema->ty_nocross_ema;
-        ema->typ_ema         = ema->alpha * typ        + (1.0f - ema->alpha) * ema->typ_ema;
+bool spi_wait_command_delivered(uint32_t id, TickType_t timeout) {
+    if (id == 0) return false;
+    TickType_t start = xTaskGetTickCount();
+    while (!spi_command_delivered(id)) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) {
+            return false;
+        }
+        // The SPI task notifies this task whenever one of its commands goes out
+        ulTaskNotifyTake(pdTRUE, timeout - elapsed);
+    }
+    return true;
+}
 
-        ema->point_bottom_left[0] = ema->alpha * point_bottom_left[0] + (1.0f - ema->alpha) * ema->point_bottom_left[0];
-        ema->point_bottom_left[1] = ema->alpha * point_bottom_left[1] + (1.0f - ema->alpha) * ema->point_bottom_left[1];
+bool spi_send_roi_hint(maneuver_t maneuver, int fID) {
+    if (!(link_caps.caps & SPI_CAP_ROI_HINT)) return false;
+    // The previous hint is still waiting to go out; it will be stale by then, so skip this one
+    if (roi_pending && !spi_command_delivered(roi_pending)) return false;
 
-        ema->point_bottom_right[0] = ema->alpha * point_bottom_right[0] + (1.0f - ema->alpha) * ema->point_bottom_right[0];
-        ema->point_bottom_right[1] = ema->alpha * point_bottom_right[1] + (1.0f - ema->alpha) * ema->point_bottom_right[1];
+    roi_motion_t motion = ROI_MOTION_LATERAL;
+    if (maneuver == STOP) {
+        motion = ROI_MOTION_NONE;
+    } else if (maneuver == FORWARD || maneuver == BACKWARD) {
+        motion = ROI_MOTION_APPROACH;
+    }
 
-        ema->point_top_right[0] = ema->alpha * point_top_right[0] + (1.0f - ema->alpha) * ema->point_top_right[0];
-        ema->point_top_right[1] = ema->alpha * point_top_right[1] + (1.0f - ema->alpha) * ema->point_top_right[1];
+    spi_roi_hint_t hint;
+    bool predicted = false;
+    if (take_data_mutex(pdMS_TO_TICKS(10))) {
+        roi_fID = fID;
+        predicted = (fID < 0 || roi_predictor.fID == fID) &&
+                    roi_predictor_predict(&roi_predictor, motion, esp_timer_get_time(), &hint);
+        xSemaphoreGive(data_mutex);
+    }
+    if (!predicted) return false;
 
-        ema->point_top_left[0] = ema->alpha * point_top_left[0] + (1.0f - ema->alpha) * ema->point_top_left[0];
-        ema->point_top_left[1] = ema->alpha * point_top_left[1] + (1.0f - ema->alpha) * ema->point_top_left[1];
+    if (roi_pending && hint.x == roi_last.x && hint.y == roi_last.y && hint.w == roi_last.w &&
+        hint.h == roi_last.h && hint.fID == roi_last.fID) {
+        return true;
     }
+
+    hint.seq = ++roi_seq;
+    char command[CHUNK_SIZE];
+    if (!spi_roi_hint_format(&hint, command, sizeof(command))) return false;
+    uint32_t id = spi_send_command(command);
+    if (id == 0) return false;
+    roi_last = hint;
+    roi_pending = id;
+    return true;
 }
 
-void get_ema_point_bottom_left(const EMAState *ema, double ret[2]) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return;
-    }
-    ret[0] = ema->point_bottom_left[0];
-    ret[1] = ema->point_bottom_left[1];
+void send_message(char *message) {
+    spi_send_command(message);
 }
 
-void get_ema_point_bottom_right(const EMAState *ema, double ret[2]) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return;
-    }
-    ret[0] = ema->point_bottom_right[0];
-    ret[1] = ema->point_bottom_right[1];
+bool send_message_wait(char *message, TickType_t timeout) {
+    return spi_wait_command_delivered(spi_send_command(message), timeout);
 }
 
-void get_ema_point_top_right(const EMAState *ema, double ret[2]) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return;
+char* get_message() {
+    char* returnMessage = "";
+    if (take_data_mutex(pdMS_TO_TICKS(100))) {
+        if (receivedData.messageInput != NULL) {
+            returnMessage = receivedData.messageInput;
+        } else {
+            // ESP_LOGW(TAG, "messageInput is NULL");
+            returnMessage = NULL;
+        }
+        xSemaphoreGive(data_mutex);
     }
-    ret[0] = ema->point_top_right[0];
-    ret[1] = ema->point_top_right[1];
+    return returnMessage;
 }
 
-void get_ema_point_top_left(const EMAState *ema, double ret[2]) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return;
+// Defines get_<target>_<metric>, 0 unless the newest frame is from that pipeline and has the metric
+#define VISION_METRIC_GETTER(TARGET, target, NAME, name) \
+    double get_##target##_##name() { \
+        vision_frame_t frame; \
+        return read_vision_field(&frame, VISION_TARGET_##TARGET, VISION_FIELD_##NAME) ? frame.name : 0.0; \
     }
-    ret[0] = ema->point_top_left[0];
-    ret[1] = ema->point_top_left[1];
+
+#define X(NAME, name, key) VISION_METRIC_GETTER(RETRO, retro, NAME, name)
+VISION_SCHEMA_METRICS(X)
+#undef X
+
+int get_fiducial_fID() {
+    vision_frame_t frame;
+    return read_vision_field(&frame, VISION_TARGET_FIDUCIAL, VISION_FIELD_FID) ? frame.fID : 0;
 }
 
-double get_ema_ta(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
+void get_point_at_index(int index, double* ret) {
+    vision_frame_t frame;
+    if (index >= 0 && index < 4 && read_vision_field(&frame, VISION_TARGET_FIDUCIAL, VISION_FIELD_PT0 + index)) {
+        ret[0] = frame.pts[index][0];
+        ret[1] = frame.pts[index][1];
+    } else {
+        ret[0] = 0;
+        ret[1] = 0;
     }
-    return ema->ta_ema;
 }
 
-double get_ema_tx(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
-    }
-    return ema->tx_ema;
+bool get_fiducial_by_id(int fID, vision_frame_t *tag) {
+    if (!tag) return false;
+    spi_vision_snapshot_t snapshot;
+    bool found = spi_secondary_snapshot_tag(fID, &snapshot);
+    *tag = snapshot.frame;
+    return found;
 }
 
-double get_ema_tx_nocross(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
-    }
-    return ema->tx_nocross_ema;
+#define X(NAME, name, key) VISION_METRIC_GETTER(FIDUCIAL, fiducial, NAME, name)
+VISION_SCHEMA_METRICS(X)
+#undef X
+
+double get_pID() {
+    vision_frame_t frame;
+    return read_vision_field(&frame, VISION_TARGET_NONE, VISION_FIELD_PID) ? frame.pID : -1;
 }
 
-double get_ema_txp(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
-    }
-    return ema->txp_ema;
+int get_v() {
+    vision_frame_t frame;
+    return read_vision_field(&frame, VISION_TARGET_NONE, VISION_FIELD_V) ? frame.v : 0;
 }
 
-double get_ema_ty(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
-    }
-    return ema->ty_ema;
+void init_ema(EMAState *ema, double alpha, char* type) {
+    if (!ema) return;
+
+    ema->alpha = alpha;
+    ema->initialized = false;
+    ema->pipeline_type = type;
+
+#define X(NAME, name, key) ema->name##_ema = 0.0f;
+    VISION_SCHEMA_METRICS(X)
+#undef X
+
+    ESP_LOGI(TAG, "EMA initialized with alpha=%.2f", alpha);
 }
 
-double get_ema_ty_nocross(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
-    }
-    return ema->ty_nocross_ema;
+void reset_ema(EMAState *ema) {
+    if (!ema) return;
+    ema->initialized = false;
+    ESP_LOGI(TAG, "EMA state reset");
 }
 
-double get_ema_typ(const EMAState *ema) {
-    if (!ema || !ema->initialized) {
-        ESP_LOGW(TAG, "EMA not initialized or invalid");
-        return 0.0f;
+
+// Moves 'average' towards 'sample', or starts it there on the first update
+static inline void ema_step(const EMAState *ema, double *average, double sample) {
+    *average = ema->initialized ? ema->alpha * sample + (1.0f - ema->alpha) * *average : sample;
+}
+
+void update_ema(EMAState *ema) {
+    if (!ema) return;
+    vision_target_t target = VISION_TARGET_NONE;
+#define X(NAME, name, key) if (strcmp(ema->pipeline_type, #name) == 0) target = VISION_TARGET_##NAME;
+    VISION_SCHEMA_TARGETS(X)
+#undef X
+
+    // One copy of the frame for every value instead of a getter each; values
+    // it does not have for the target count as 0
+    vision_frame_t frame = { .valid = 0 };
+    if (target != VISION_TARGET_NONE) read_vision_frame(&frame);
+
+#define X(NAME, name, key) \
+    ema_step(ema, &ema->name##_ema, vision_frame_has(&frame, target, VISION_FIELD_##NAME) ? frame.name : 0.0);
+    VISION_SCHEMA_METRICS(X)
+#undef X
+
+    // Only fiducials have corners
+    bool corners = target == VISION_TARGET_FIDUCIAL;
+#define X(index, name) \
+    for (int i = 0; i < 2; ++i) { \
+        bool has = corners && vision_frame_has(&frame, target, VISION_FIELD_PT0 + index); \
+        ema_step(ema, &ema->point_##name[i], has ? frame.pts[index][i] : 0.0); \
+    }
+    VISION_SCHEMA_CORNERS(X)
+#undef X
+
+    if (!ema->initialized) {
+        ema->initialized = true;
+        ESP_LOGI(TAG, "EMA first update: initialization complete");
     }
-    return ema->typ_ema;
 }
 
+#define X(index, name) \
+    void get_ema_point_##name(const EMAState *ema, double ret[2]) { \
+        if (!ema || !ema->initialized) { \
+            ESP_LOGW(TAG, "EMA not initialized or invalid"); \
+            return; \
+        } \
+        ret[0] = ema->point_##name[0]; \
+        ret[1] = ema->point_##name[1]; \
+    }
+VISION_SCHEMA_CORNERS(X)
+#undef X
+
+#define X(NAME, name, key) \
+    double get_ema_##name(const EMAState *ema) { \
+        if (!ema || !ema->initialized) { \
+            ESP_LOGW(TAG, "EMA not initialized or invalid"); \
+            return 0.0f; \
+        } \
+        return ema->name##_ema; \
+    }
+VISION_SCHEMA_METRICS(X)
+#undef X
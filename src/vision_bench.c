@@ -0,0 +1,99 @@
+#include "vision_bench.h"
+
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "vision_corpus.h"
+
+#define TAG "VISION_BENCH"
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} bench_message_t;
+
+typedef struct {
+    uint32_t messages;      // In the corpus
+    uint32_t frames;        // Decoded during the run
+    uint32_t failures;
+    uint64_t cycles;
+    uint32_t max_cycles;
+} bench_type_stats_t;
+
+static const char bench_types[] = { SPI_MSG_JSON, SPI_MSG_BINARY, SPI_MSG_DELTA };
+
+static uint8_t arena[VISION_BENCH_ARENA_SIZE];
+static bench_message_t messages[VISION_BENCH_MAX_MESSAGES];
+static vision_replay_t replay;
+
+// Decodes the corpus lines into the arena, returns how many fit
+static size_t load_corpus() {
+    size_t count = 0, used = 0;
+    for (size_t i = 0; i < vision_corpus_count && count < VISION_BENCH_MAX_MESSAGES; ++i) {
+        size_t len = spi_capture_parse(vision_corpus[i], arena + used, sizeof(arena) - used);
+        if (!len) {
+            ESP_LOGW(TAG, "Corpus message %u left out", (unsigned)i);
+            continue;
+        }
+        messages[count].data = arena + used;
+        messages[count].len = len;
+        used += len + 1;
+        ++count;
+    }
+    return count;
+}
+
+void vision_bench_run(uint32_t passes) {
+    size_t count = load_corpus();
+    if (!count || !passes) {
+        ESP_LOGE(TAG, "Nothing to replay");
+        return;
+    }
+
+    bench_type_stats_t stats[sizeof(bench_types)];
+    memset(stats, 0, sizeof(stats));
+    for (size_t i = 0; i < count; ++i) {
+        const char *type = memchr(bench_types, messages[i].data[0], sizeof(bench_types));
+        if (type) ++stats[type - bench_types].messages;
+    }
+
+    vision_replay_begin(&replay);
+    for (uint32_t pass = 0; pass < passes; ++pass) {
+        for (size_t i = 0; i < count; ++i) {
+            const char *type = memchr(bench_types, messages[i].data[0], sizeof(bench_types));
+            if (!type) continue;
+            bench_type_stats_t *type_stats = &stats[type - bench_types];
+
+            vision_frame_t frame;
+            uint32_t start = esp_cpu_get_cycle_count();
+            bool ok = vision_replay_message(&replay, messages[i].data, messages[i].len, &frame);
+            // One decode is far shorter than the counter's wrap, so the difference is exact
+            uint32_t cycles = esp_cpu_get_cycle_count() - start;
+
+            ++type_stats->frames;
+            type_stats->cycles += cycles;
+            if (cycles > type_stats->max_cycles) {
+                type_stats->max_cycles = cycles;
+            }
+            if (!ok) {
+                ++type_stats->failures;
+            }
+        }
+        vTaskDelay(1);
+    }
+
+    uint32_t cycles_per_us = esp_rom_get_cpu_ticks_per_us();
+    ESP_LOGI(TAG, "%u messages, %u passes, %u MHz", (unsigned)count, (unsigned)passes, (unsigned)cycles_per_us);
+    for (size_t t = 0; t < sizeof(bench_types); ++t) {
+        const bench_type_stats_t *type_stats = &stats[t];
+        if (!type_stats->frames) continue;
+        uint32_t avg = (uint32_t)(type_stats->cycles / type_stats->frames);
+        // Max includes any interrupt that landed inside the decode
+        ESP_LOGI(TAG, "%c: %u messages, %u cycles/frame (%u ns), max %u cycles, %u failures", bench_types[t],
+                 (unsigned)type_stats->messages, (unsigned)avg, (unsigned)(avg * 1000ull / cycles_per_us),
+                 (unsigned)type_stats->max_cycles, (unsigned)type_stats->failures);
+    }
+}
@@ -0,0 +1,85 @@
+#include "vision_corpus.h"
+
+#include <string.h>
+
+const char *const vision_corpus[] = {
+    // Python's json.dumps, default separators
+    "J{\"ts\": 81234567, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 1, \"Fiducial\": [{\"fam\": \"36h11\", "
+    "\"fID\": 3, \"ta\": 2.4813, \"tx\": -4.1275, \"tx_nocross\": -4.1275, \"txp\": 143.25, \"ty\": 1.5022, "
+    "\"ty_nocross\": 1.5022, \"typ\": 118.5, \"pts\": [[121.25, 139.75], [165.5, 140.0], [164.75, 97.25], "
+    "[120.5, 96.75]]}]}",
+    // Compact, as spi_bench sends
+    "J{\"ts\":81267890,\"pTYPE\":\"fiducial\",\"pID\":6,\"v\":1,\"Fiducial\":[{\"fam\":\"36h11\",\"fID\":7,"
+    "\"ta\":0.9120,\"tx\":12.5000,\"tx_nocross\":12.5000,\"txp\":201.75,\"ty\":-3.0250,\"ty_nocross\":-3.0250,"
+    "\"typ\":131.00,\"pts\":[[190.25,142.50],[213.00,142.75],[212.75,119.50],[190.00,119.25]]}]}",
+    // Two tags in view, the first one is steered on
+    "J{\"ts\": 81301234, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 1, \"Fiducial\": [{\"fam\": \"36h11\", "
+    "\"fID\": 3, \"ta\": 2.5, \"tx\": -4.0, \"ty\": 1.5, \"pts\": [[121.0, 139.5], [165.5, 140.0], "
+    "[164.5, 97.0], [120.5, 96.5]]}, {\"fam\": \"36h11\", \"fID\": 4, \"ta\": 0.4, \"tx\": 20.1, \"ty\": 2.2, "
+    "\"pts\": [[250.0, 130.0], [262.0, 130.0], [262.0, 118.0], [250.0, 118.0]]}]}",
+    // Retro pipeline
+    "J{\"ts\": 81334567, \"pID\": 2, \"pTYPE\": \"retro\", \"v\": 1, \"Retro\": [{\"ta\": 1.75, \"tx\": 3.5, "
+    "\"tx_nocross\": 3.5, \"txp\": 180.0, \"ty\": -0.25, \"ty_nocross\": -0.25, \"typ\": 122.0}]}",
+    // Nothing in view
+    "J{\"ts\": 81367890, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 0, \"Fiducial\": []}",
+    // Binary frames, spi_bench --format binary
+    "B0201060100030016a76138000020400000000000000000000020430000c03f0000c03f0000f04230023002d0023002d00290013002"
+    "90015e0f",
+    "B0201060100030029a7613800002040b2e47f3eb2e47f3ec9ff21430000c03f0000c03f0000f04238023002d8023002d80290013802"
+    "900108f8",
+    // A keyframe and the deltas on it, spi_bench --format delta
+    "D030000003f7824d361380106010300000020400000000030023002d0023002d002900130029001a623",
+    "D02010001207832d36138b2e47f3e38023002d8023002d802900138029001acaa",
+    "D02020001207834d36138d492ff3e40023002e0023002e0029001400290011b78",
+    "D02030001207837d36138e3473f3f48023002e8023002e802900148029001a28c",
+};
+
+const size_t vision_corpus_count = sizeof(vision_corpus) / sizeof(vision_corpus[0]);
+
+const char *const vision_corpus_malformed[] = {
+    // pID past int
+    "J{\"ts\": 81400000, \"pID\": 1e300, \"pTYPE\": \"fiducial\", \"v\": 1, \"Fiducial\": []}",
+    // ts past any 64-bit clock
+    "J{\"ts\": 1e300, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 1, \"Fiducial\": []}",
+    // v one past int
+    "J{\"ts\": 81433333, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 2147483648, \"Fiducial\": []}",
+    // fID that strtod makes infinite
+    "J{\"ts\": 81466667, \"pID\": 6, \"pTYPE\": \"fiducial\", \"v\": 1, \"Fiducial\": [{\"fam\": \"36h11\", "
+    "\"fID\": -1e400, \"ta\": 2.5, \"tx\": -4.0, \"ty\": 1.5}]}",
+};
+
+const size_t vision_corpus_malformed_count = sizeof(vision_corpus_malformed) / sizeof(vision_corpus_malformed[0]);
+
+void vision_replay_begin(vision_replay_t *replay) {
+    memset(replay, 0, sizeof(*replay));
+}
+
+bool vision_replay_message(vision_replay_t *replay, const uint8_t *message, size_t len, vision_frame_t *frame) {
+    if (!replay || !message || !len || !frame) return false;
+
+    switch (message[0]) {
+        case SPI_MSG_JSON:
+            vision_json_stream_begin(&replay->json);
+            vision_json_stream_feed(&replay->json, (const char *)message + 1, len - 1);
+            return vision_json_stream_finish(&replay->json, frame);
+        case SPI_MSG_BINARY:
+            return vision_frame_decode_binary(message, len, frame);
+        case SPI_MSG_DELTA:
+            switch (vision_frame_apply_delta(message, len, &replay->delta_state, &replay->delta_seq,
+                                             replay->delta_valid, VISION_FIELDS_ALL)) {
+                case VISION_DELTA_KEYFRAME:
+                    replay->delta_valid = true;
+                    // fall through
+                case VISION_DELTA_APPLIED:
+                    *frame = replay->delta_state;
+                    return true;
+                case VISION_DELTA_STALE:
+                    replay->delta_valid = false;
+                    return false;
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,504 @@
+/*
+ * Just enough of ESP-IDF and FreeRTOS on POSIX threads to run the ESP32's SPI
+ * code in a host process. The SPI slave driver is replaced by a loopback that
+ * the master side drives through spi_loopback_transfer.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driver/pcnt.h"
+#include "driver/spi_slave.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "spi_loopback.h"
+#include "spi_secondary.h"
+
+#define LOOPBACK_MAX_QUEUE 16
+
+struct idf_shim_task {
+    pthread_t thread;
+    TaskFunction_t function;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notifications;
+};
+
+struct idf_shim_semaphore {
+    pthread_mutex_t mutex;
+};
+
+struct idf_shim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head, count;
+    uint8_t items[];
+};
+
+int idf_shim_log_level = 1;
+
+static struct timespec start_time;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+static __thread TaskHandle_t current_task = NULL;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int queue_size;
+    slave_transaction_cb_t post_trans_cb;
+    spi_slave_transaction_t *armed[LOOPBACK_MAX_QUEUE];
+    int armed_head, armed_count;
+    spi_slave_transaction_t *done[LOOPBACK_MAX_QUEUE];
+    int done_head, done_count;
+    uint32_t lost_chunks;
+} loopback = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_once_t loopback_once = PTHREAD_ONCE_INIT;
+static motor_t loopback_wheels[4];
+
+static void record_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *level = getenv("ESP_LOG_LEVEL");
+    if (level) {
+        idf_shim_log_level = atoi(level);
+    }
+}
+
+// Absolute CLOCK_MONOTONIC deadline 'us' from now, for the timed waits below
+static struct timespec deadline_after_us(uint64_t us) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+static void init_cond_monotonic(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Waits on cond until woken or the tick timeout passes, returns false on timeout
+static bool wait_ticks(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t timeout) {
+    if (timeout == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    struct timespec deadline = deadline_after_us((uint64_t)timeout * 1000);
+    return pthread_cond_timedwait(cond, lock, &deadline) != ETIMEDOUT;
+}
+
+static void init_loopback(void) {
+    init_cond_monotonic(&loopback.changed);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK:                return "ESP_OK";
+        case ESP_FAIL:              return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_TIMEOUT:       return "ESP_ERR_TIMEOUT";
+        default:                    return "UNKNOWN";
+    }
+}
+
+int64_t esp_timer_get_time(void) {
+    pthread_once(&start_once, record_start);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start_time.tv_sec) * 1000000 + (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+    (void)caps;
+    return calloc(n, size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+// Heap figures have no meaning on the host, telemetry reports zero
+uint32_t esp_get_free_heap_size(void) {
+    return 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    return 0;
+}
+
+void esp_restart(void) {
+    abort();
+}
+
+// Encoders are not simulated
+int read_encoder(pcnt_unit_t unit) {
+    (void)unit;
+    return 0;
+}
+
+// Neither are the motors; a STOP is recorded so telemetry reports it
+void perform_maneuver(motor_t *motors, maneuver_t maneuver, float speeds[4], float speed_scalar) {
+    (void)speeds;
+    (void)speed_scalar;
+    if (maneuver != STOP) return;
+    for (int i = 0; i < 4; ++i) {
+        motors[i].speed = 0;
+    }
+}
+
+static _Atomic uint32_t motor_hold_bits;
+
+void motor_hold(motor_t *motors, motor_hold_t reason, bool held) {
+    if (held) {
+        atomic_fetch_or(&motor_hold_bits, reason);
+        perform_maneuver(motors, STOP, NULL, 0);
+    } else {
+        atomic_fetch_and(&motor_hold_bits, ~(uint32_t)reason);
+    }
+}
+
+uint32_t motor_holds() {
+    return atomic_load(&motor_hold_bits);
+}
+
+static TaskHandle_t new_task(TaskFunction_t function, void *arg) {
+    TaskHandle_t task = calloc(1, sizeof(*task));
+    if (!task) return NULL;
+    task->function = function;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond_monotonic(&task->notified);
+    return task;
+}
+
+static void *run_task(void *arg) {
+    TaskHandle_t task = arg;
+    current_task = task;
+    task->function(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle) {
+    (void)name;
+    (void)stack_depth;
+    (void)priority;
+    TaskHandle_t task = new_task(function, arg);
+    if (!task || pthread_create(&task->thread, NULL, run_task, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    (void)core;
+    return xTaskCreate(function, name, stack_depth, arg, priority, handle);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == current_task) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep((useconds_t)ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(esp_timer_get_time() / 1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    // Threads not started through xTaskCreate (main) get a handle on first use
+    if (!current_task) {
+        current_task = new_task(NULL, NULL);
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    (void)task;
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    ++task->notifications;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t timeout) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0 && timeout > 0) {
+        if (!wait_ticks(&task->notified, &task->lock, timeout)) break;
+    }
+    uint32_t value = task->notifications;
+    if (value > 0) {
+        task->notifications = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    SemaphoreHandle_t semaphore = calloc(1, sizeof(*semaphore));
+    if (semaphore) {
+        pthread_mutex_init(&semaphore->mutex, NULL);
+    }
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout) {
+    if (timeout == portMAX_DELAY) {
+        return pthread_mutex_lock(&semaphore->mutex) == 0;
+    }
+    // pthread_mutex_timedlock only takes CLOCK_REALTIME deadlines
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return pthread_mutex_timedlock(&semaphore->mutex, &deadline) == 0;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return pthread_mutex_unlock(&semaphore->mutex) == 0;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(&semaphore->mutex);
+    free(semaphore);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = calloc(1, sizeof(*queue) + length * item_size);
+    if (queue) {
+        pthread_mutex_init(&queue->lock, NULL);
+        init_cond_monotonic(&queue->changed);
+        queue->length = length;
+        queue->item_size = item_size;
+    }
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t timeout) {
+    BaseType_t ret = pdPASS;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (timeout == 0 || !wait_ticks(&queue->changed, &queue->lock, timeout)) {
+            ret = pdFAIL;
+            break;
+        }
+    }
+    if (ret == pdPASS) {
+        UBaseType_t tail = (queue->head + queue->count) % queue->length;
+        memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+        ++queue->count;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken) {
+    if (woken) {
+        *woken = pdFALSE;
+    }
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout) {
+    BaseType_t ret = pdPASS;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (timeout == 0 || !wait_ticks(&queue->changed, &queue->lock, timeout)) {
+            ret = pdFAIL;
+            break;
+        }
+    }
+    if (ret == pdPASS) {
+        memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        --queue->count;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config,
+                               const spi_slave_interface_config_t *slave_config, int dma_chan) {
+    (void)host;
+    (void)bus_config;
+    (void)dma_chan;
+    pthread_once(&loopback_once, init_loopback);
+    if (slave_config->queue_size <= 0 || slave_config->queue_size > LOOPBACK_MAX_QUEUE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&loopback.lock);
+    loopback.queue_size = slave_config->queue_size;
+    loopback.post_trans_cb = slave_config->post_trans_cb;
+    pthread_mutex_unlock(&loopback.lock);
+    return ESP_OK;
+}
+
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans, TickType_t timeout) {
+    (void)host;
+    esp_err_t ret = ESP_OK;
+    pthread_mutex_lock(&loopback.lock);
+    while (loopback.armed_count + loopback.done_count >= loopback.queue_size) {
+        if (!wait_ticks(&loopback.changed, &loopback.lock, timeout)) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+    if (ret == ESP_OK) {
+        int tail = (loopback.armed_head + loopback.armed_count) % LOOPBACK_MAX_QUEUE;
+        loopback.armed[tail] = (spi_slave_transaction_t *)trans;
+        ++loopback.armed_count;
+        pthread_cond_broadcast(&loopback.changed);
+    }
+    pthread_mutex_unlock(&loopback.lock);
+    return ret;
+}
+
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans, TickType_t timeout) {
+    (void)host;
+    esp_err_t ret = ESP_OK;
+    pthread_mutex_lock(&loopback.lock);
+    while (loopback.done_count == 0) {
+        if (!wait_ticks(&loopback.changed, &loopback.lock, timeout)) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+    if (ret == ESP_OK) {
+        *trans = loopback.done[loopback.done_head];
+        loopback.done_head = (loopback.done_head + 1) % LOOPBACK_MAX_QUEUE;
+        --loopback.done_count;
+        pthread_cond_broadcast(&loopback.changed);
+    }
+    pthread_mutex_unlock(&loopback.lock);
+    return ret;
+}
+
+esp_err_t spi_slave_transmit(spi_host_device_t host, spi_slave_transaction_t *trans, TickType_t timeout) {
+    esp_err_t ret = spi_slave_queue_trans(host, trans, timeout);
+    if (ret != ESP_OK) return ret;
+    spi_slave_transaction_t *done;
+    return spi_slave_get_trans_result(host, &done, timeout);
+}
+
+int spi_loopback_start(void) {
+    esp_timer_get_time();  // Start the clock
+    if (spi_secondary_init() != ESP_OK) return -1;
+    spi_secondary_set_wheels(loopback_wheels);
+    return 0;
+}
+
+static void handshake_task(void *arg) {
+    (void)arg;
+    spi_secondary_handshake(pdMS_TO_TICKS(500));
+    vTaskDelete(NULL);
+}
+
+void spi_loopback_start_handshake(void) {
+    xTaskCreate(handshake_task, "handshake", 4096, NULL, 1, NULL);
+}
+
+int spi_loopback_transfer(const uint8_t *tx, uint8_t *rx, size_t len, uint32_t arm_timeout_us) {
+    pthread_once(&loopback_once, init_loopback);
+    struct timespec deadline = deadline_after_us(arm_timeout_us);
+    pthread_mutex_lock(&loopback.lock);
+    while (loopback.armed_count == 0) {
+        if (arm_timeout_us == 0 ||
+            pthread_cond_timedwait(&loopback.changed, &loopback.lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (loopback.armed_count == 0) {
+        ++loopback.lost_chunks;
+        pthread_mutex_unlock(&loopback.lock);
+        if (rx) {
+            memset(rx, 0, len);
+        }
+        return -1;
+    }
+
+    spi_slave_transaction_t *trans = loopback.armed[loopback.armed_head];
+    loopback.armed_head = (loopback.armed_head + 1) % LOOPBACK_MAX_QUEUE;
+    --loopback.armed_count;
+
+    size_t bytes = trans->length / 8 < len ? trans->length / 8 : len;
+    if (trans->rx_buffer) {
+        memcpy(trans->rx_buffer, tx, bytes);
+    }
+    if (rx) {
+        memset(rx, 0, len);
+        if (trans->tx_buffer) {
+            memcpy(rx, trans->tx_buffer, bytes);
+        }
+    }
+    trans->trans_len = bytes * 8;
+    // The driver runs the callback from its interrupt before the result is queued
+    if (loopback.post_trans_cb) {
+        loopback.post_trans_cb(trans);
+    }
+
+    int tail = (loopback.done_head + loopback.done_count) % LOOPBACK_MAX_QUEUE;
+    loopback.done[tail] = trans;
+    ++loopback.done_count;
+    pthread_cond_broadcast(&loopback.changed);
+    pthread_mutex_unlock(&loopback.lock);
+    return 0;
+}
+
+uint32_t spi_loopback_lost_chunks(void) {
+    pthread_mutex_lock(&loopback.lock);
+    uint32_t lost = loopback.lost_chunks;
+    pthread_mutex_unlock(&loopback.lock);
+    return lost;
+}
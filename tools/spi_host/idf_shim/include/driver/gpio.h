@@ -0,0 +1,13 @@
+/**
+ * @file gpio.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_GPIO_H
+#define IDF_SHIM_GPIO_H
+
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+#endif // IDF_SHIM_GPIO_H
@@ -0,0 +1,18 @@
+/**
+ * @file mcpwm_prelude.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ *
+ * Only the handle types motor.h needs to declare motor_t.
+ */
+
+#ifndef IDF_SHIM_MCPWM_PRELUDE_H
+#define IDF_SHIM_MCPWM_PRELUDE_H
+
+#include "esp_err.h"
+
+typedef struct mcpwm_timer_t *mcpwm_timer_handle_t;
+typedef struct mcpwm_oper_t *mcpwm_oper_handle_t;
+typedef struct mcpwm_gen_t *mcpwm_gen_handle_t;
+typedef struct mcpwm_cmpr_t *mcpwm_cmpr_handle_t;
+
+#endif // IDF_SHIM_MCPWM_PRELUDE_H
@@ -0,0 +1,18 @@
+/**
+ * @file pcnt.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_PCNT_H
+#define IDF_SHIM_PCNT_H
+
+#include "esp_err.h"
+
+typedef enum {
+    PCNT_UNIT_0,
+    PCNT_UNIT_1,
+    PCNT_UNIT_2,
+    PCNT_UNIT_3
+} pcnt_unit_t;
+
+#endif // IDF_SHIM_PCNT_H
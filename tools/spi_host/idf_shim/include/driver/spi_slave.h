@@ -0,0 +1,60 @@
+/**
+ * @file spi_slave.h
+ * @brief Host stand-in for the ESP-IDF SPI slave driver, backed by the loopback in idf_shim.c
+ *
+ * Transactions queued by the slave are completed by spi_loopback_transfer,
+ * called from the master side of a host program.
+ */
+
+#ifndef IDF_SHIM_SPI_SLAVE_H
+#define IDF_SHIM_SPI_SLAVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+    SPI1_HOST,
+    SPI2_HOST,
+    SPI3_HOST
+} spi_host_device_t;
+
+#define SPI_DMA_CH_AUTO 3
+
+typedef struct {
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int max_transfer_sz;
+} spi_bus_config_t;
+
+typedef struct spi_slave_transaction_t spi_slave_transaction_t;
+typedef void (*slave_transaction_cb_t)(spi_slave_transaction_t *trans);
+
+typedef struct {
+    int spics_io_num;
+    uint32_t flags;
+    int queue_size;
+    uint8_t mode;
+    slave_transaction_cb_t post_setup_cb;
+    slave_transaction_cb_t post_trans_cb;
+} spi_slave_interface_config_t;
+
+struct spi_slave_transaction_t {
+    size_t length;              // Bits
+    size_t trans_len;           // Bits actually clocked
+    const void *tx_buffer;
+    void *rx_buffer;
+    void *user;
+};
+
+esp_err_t spi_slave_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config,
+                               const spi_slave_interface_config_t *slave_config, int dma_chan);
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans, TickType_t timeout);
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans, TickType_t timeout);
+esp_err_t spi_slave_transmit(spi_host_device_t host, spi_slave_transaction_t *trans, TickType_t timeout);
+
+#endif // IDF_SHIM_SPI_SLAVE_H
@@ -0,0 +1,13 @@
+/**
+ * @file esp_attr.h
+ * @brief Host stand-in for the ESP-IDF header of the same name
+ *
+ * Placement attributes have no meaning on the host.
+ */
+
+#ifndef IDF_SHIM_ESP_ATTR_H
+#define IDF_SHIM_ESP_ATTR_H
+
+#define IRAM_ATTR
+
+#endif // IDF_SHIM_ESP_ATTR_H
@@ -0,0 +1,25 @@
+/**
+ * @file esp_err.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_ESP_ERR_H
+#define IDF_SHIM_ESP_ERR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_TIMEOUT         0x107
+
+#define ESP_ERROR_CHECK(x) do { esp_err_t err_ = (x); (void)err_; } while (0)
+
+const char *esp_err_to_name(esp_err_t code);
+
+#endif // IDF_SHIM_ESP_ERR_H
@@ -0,0 +1,26 @@
+/**
+ * @file esp_log.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_ESP_LOG_H
+#define IDF_SHIM_ESP_LOG_H
+
+#include <stdio.h>
+
+// Set from the environment variable ESP_LOG_LEVEL (0 none ... 5 verbose), errors only by default
+extern int idf_shim_log_level;
+
+#define IDF_SHIM_LOG(level, letter, tag, format, ...) do { \
+        if (idf_shim_log_level >= (level)) { \
+            fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) IDF_SHIM_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) IDF_SHIM_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) IDF_SHIM_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) IDF_SHIM_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) IDF_SHIM_LOG(5, "V", tag, format, ##__VA_ARGS__)
+
+#endif // IDF_SHIM_ESP_LOG_H
@@ -0,0 +1,15 @@
+/**
+ * @file esp_system.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_ESP_SYSTEM_H
+#define IDF_SHIM_ESP_SYSTEM_H
+
+#include <stdint.h>
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+void esp_restart(void);
+
+#endif // IDF_SHIM_ESP_SYSTEM_H
@@ -0,0 +1,15 @@
+/**
+ * @file esp_timer.h
+ * @brief Host stand-in for the ESP-IDF header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_ESP_TIMER_H
+#define IDF_SHIM_ESP_TIMER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+// Microseconds since the process started
+int64_t esp_timer_get_time(void);
+
+#endif // IDF_SHIM_ESP_TIMER_H
@@ -0,0 +1,43 @@
+/**
+ * @file FreeRTOS.h
+ * @brief Host stand-in for the FreeRTOS header of the same name, see idf_shim.c
+ *
+ * Ticks are milliseconds. Critical sections are plain mutexes, which is enough
+ * for code that only uses them to guard short updates between tasks.
+ */
+
+#ifndef IDF_SHIM_FREERTOS_H
+#define IDF_SHIM_FREERTOS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_attr.h"
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define configTICK_RATE_HZ      1000
+#define portTICK_PERIOD_MS      1
+#define portMAX_DELAY           ((TickType_t)0xFFFFFFFFu)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms))
+#define pdTICKS_TO_MS(ticks)    ((uint32_t)(ticks))
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define pdFAIL                  0
+
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_MUTEX_INITIALIZER }
+
+#define portENTER_CRITICAL(mux)     pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux)      pthread_mutex_unlock(&(mux)->mutex)
+#define portENTER_CRITICAL_ISR(mux) pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL_ISR(mux)  pthread_mutex_unlock(&(mux)->mutex)
+#define portYIELD_FROM_ISR(woken)   ((void)(woken))
+
+#endif // IDF_SHIM_FREERTOS_H
@@ -0,0 +1,22 @@
+/**
+ * @file queue.h
+ * @brief Host stand-in for the FreeRTOS header of the same name, see idf_shim.c
+ *
+ * Items are copied in and out by value like FreeRTOS queues. The ISR variant
+ * is the same call; on the host the "interrupt" is the thread that ran the
+ * transaction.
+ */
+
+#ifndef IDF_SHIM_QUEUE_H
+#define IDF_SHIM_QUEUE_H
+
+#include "FreeRTOS.h"
+
+typedef struct idf_shim_queue *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t timeout);
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout);
+
+#endif // IDF_SHIM_QUEUE_H
@@ -0,0 +1,18 @@
+/**
+ * @file semphr.h
+ * @brief Host stand-in for the FreeRTOS header of the same name, see idf_shim.c
+ */
+
+#ifndef IDF_SHIM_SEMPHR_H
+#define IDF_SHIM_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+typedef struct idf_shim_semaphore *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#endif // IDF_SHIM_SEMPHR_H
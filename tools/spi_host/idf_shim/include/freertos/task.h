@@ -0,0 +1,29 @@
+/**
+ * @file task.h
+ * @brief Host stand-in for the FreeRTOS header of the same name, see idf_shim.c
+ *
+ * Tasks are pthreads; priorities and stack sizes are ignored.
+ */
+
+#ifndef IDF_SHIM_TASK_H
+#define IDF_SHIM_TASK_H
+
+#include "FreeRTOS.h"
+
+typedef struct idf_shim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t timeout);
+
+#endif // IDF_SHIM_TASK_H
@@ -0,0 +1,260 @@
+/*
+ * Compares ways of decoding JSON vision documents: cJSON_Parse followed by
+ * cJSON_Duplicate (the original receive path), cJSON_Parse alone, and the
+ * in-place scanner the ESP32 uses now. Every document is first decoded both
+ * through cJSON and by the scanner and the two frames must agree.
+ *
+ *   json_bench [--captures FILE] [--iterations N]
+ *
+ * --captures reads one document per line, as logged on the Pi; a leading 'J'
+ * message type is dropped and other messages of a spi_capture_format file
+ * are skipped. Without it the J documents of vision_corpus.h are used.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "spi_protocol.h"
+#include "vision_corpus.h"
+
+#define BENCH_MAX_DOCUMENTS     256
+#define BENCH_MAX_DOCUMENT_LEN  4096
+
+typedef struct {
+    const char *name;
+    uint64_t allocations;
+    uint64_t bytes;
+    double ns;
+} bench_result_t;
+
+static uint64_t allocations;
+static uint64_t allocated_bytes;
+
+static void *counting_malloc(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+    return malloc(size);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool cjson_number(const cJSON *object, const char *name, double *value) {
+    cJSON *item = cJSON_GetObjectItem(object, name);
+    if (!cJSON_IsNumber(item)) return false;
+    *value = item->valuedouble;
+    return true;
+}
+
+// The tree walk the ESP32 did before the scanner, kept as the reference
+static void cjson_decode(const cJSON *json, vision_frame_t *frame) {
+    static const struct {
+        const char *name;
+        int field;
+        size_t offset;
+    } metrics[] = {
+#define X(NAME, name, key) { key, VISION_FIELD_##NAME, offsetof(vision_frame_t, name) },
+        VISION_SCHEMA_METRICS(X)
+#undef X
+    };
+    memset(frame, 0, sizeof(*frame));
+    double value;
+    if (cjson_number(json, "ts", &value) && value > 0) {
+        frame->capture_us = (uint32_t)(uint64_t)value;
+    }
+    if (cjson_number(json, "pID", &value)) {
+        frame->pID = (int)value;
+        frame->valid |= 1u << VISION_FIELD_PID;
+    }
+    if (cjson_number(json, "v", &value)) {
+        frame->v = (int)value;
+        frame->valid |= 1u << VISION_FIELD_V;
+    }
+
+    cJSON *target = cJSON_GetArrayItem(cJSON_GetObjectItem(json, "Fiducial"), 0);
+    frame->target = VISION_TARGET_FIDUCIAL;
+    if (!target) {
+        target = cJSON_GetArrayItem(cJSON_GetObjectItem(json, "Retro"), 0);
+        frame->target = VISION_TARGET_RETRO;
+    }
+    if (!target) {
+        frame->target = VISION_TARGET_NONE;
+        return;
+    }
+    frame->valid |= 1u << VISION_FIELD_TARGET;
+
+    if (cjson_number(target, "fID", &value)) {
+        frame->fID = (int)value;
+        frame->valid |= 1u << VISION_FIELD_FID;
+    }
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); ++i) {
+        if (cjson_number(target, metrics[i].name, (double *)((char *)frame + metrics[i].offset))) {
+            frame->valid |= 1u << metrics[i].field;
+        }
+    }
+    cJSON *pts = cJSON_GetObjectItem(target, "pts");
+    for (int i = 0; i < 4; ++i) {
+        cJSON *point = cJSON_GetArrayItem(pts, i);
+        cJSON *x = cJSON_GetArrayItem(point, 0);
+        cJSON *y = cJSON_GetArrayItem(point, 1);
+        if (cJSON_IsNumber(x) && cJSON_IsNumber(y)) {
+            frame->pts[i][0] = x->valuedouble;
+            frame->pts[i][1] = y->valuedouble;
+            frame->valid |= 1u << (VISION_FIELD_PT0 + i);
+        }
+    }
+}
+
+static bool decode_parse_duplicate(const char *json, size_t len, vision_frame_t *frame) {
+    cJSON *parsed = cJSON_Parse(json);
+    if (!parsed) return false;
+    cJSON *kept = cJSON_Duplicate(parsed, 1);
+    cJSON_Delete(parsed);
+    cjson_decode(kept, frame);
+    cJSON_Delete(kept);
+    return true;
+}
+
+static bool decode_parse(const char *json, size_t len, vision_frame_t *frame) {
+    cJSON *parsed = cJSON_Parse(json);
+    if (!parsed) return false;
+    cjson_decode(parsed, frame);
+    cJSON_Delete(parsed);
+    return true;
+}
+
+static bool decode_scan(const char *json, size_t len, vision_frame_t *frame) {
+    return vision_frame_decode_json(json, len, frame);
+}
+
+static size_t load_captures(const char *path, char **documents, size_t max) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+    char line[BENCH_MAX_DOCUMENT_LEN];
+    size_t count = 0;
+    while (count < max && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *json = line[0] == SPI_MSG_JSON ? line + 1 : line;
+        if (*json == '{') {
+            documents[count++] = strdup(json);
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--captures FILE] [--iterations N]\n", name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "captures",   required_argument, NULL, 'c' },
+        { "iterations", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *captures = NULL;
+    uint32_t iterations = 100000;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': captures = optarg; break;
+            case 'n': iterations = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    char *documents[BENCH_MAX_DOCUMENTS];
+    size_t count = 0;
+    if (captures) {
+        count = load_captures(captures, documents, BENCH_MAX_DOCUMENTS);
+    } else {
+        for (size_t i = 0; i < vision_corpus_count && count < BENCH_MAX_DOCUMENTS; ++i) {
+            if (vision_corpus[i][0] == SPI_MSG_JSON) {
+                documents[count++] = strdup(vision_corpus[i] + 1);
+            }
+        }
+    }
+    if (!count || !iterations) {
+        fprintf(stderr, "nothing to decode\n");
+        return 2;
+    }
+    size_t lengths[BENCH_MAX_DOCUMENTS];
+    size_t total_len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        lengths[i] = strlen(documents[i]);
+        total_len += lengths[i];
+    }
+
+    // The scanner must read every document the way the tree walk did
+    uint32_t mismatches = 0;
+    uint32_t failures = 0;
+    for (size_t i = 0; i < count; ++i) {
+        vision_frame_t expected, scanned;
+        bool parsed = decode_parse(documents[i], lengths[i], &expected);
+        bool scanned_ok = decode_scan(documents[i], lengths[i], &scanned);
+        if (parsed != scanned_ok) {
+            ++failures;
+            printf("document %zu: cJSON %s it, the scanner %s it\n", i, parsed ? "took" : "rejected",
+                   scanned_ok ? "took" : "rejected");
+        } else if (parsed && memcmp(&expected, &scanned, sizeof(expected)) != 0) {
+            ++mismatches;
+            printf("document %zu: decoded differently, valid %05x vs %05x\n", i,
+                   (unsigned)expected.valid, (unsigned)scanned.valid);
+        }
+    }
+
+    cJSON_Hooks hooks = { .malloc_fn = counting_malloc, .free_fn = free };
+    cJSON_InitHooks(&hooks);
+
+    bench_result_t results[] = {
+        { .name = "parse+duplicate" },
+        { .name = "parse" },
+        { .name = "scan" },
+    };
+    bool (*const decoders[])(const char *, size_t, vision_frame_t *) = {
+        decode_parse_duplicate, decode_parse, decode_scan
+    };
+    volatile double sink = 0;
+    for (size_t r = 0; r < sizeof(results) / sizeof(results[0]); ++r) {
+        allocations = 0;
+        allocated_bytes = 0;
+        double start = now_ns();
+        for (uint32_t n = 0; n < iterations; ++n) {
+            vision_frame_t frame;
+            size_t i = n % count;
+            if (decoders[r](documents[i], lengths[i], &frame)) {
+                sink += frame.tx;
+            }
+        }
+        results[r].ns = (now_ns() - start) / iterations;
+        results[r].allocations = allocations;
+        results[r].bytes = allocated_bytes;
+    }
+
+    printf("documents %zu, avg %.0f bytes, %u decodes each way\n", count, (double)total_len / count, iterations);
+    for (size_t r = 0; r < sizeof(results) / sizeof(results[0]); ++r) {
+        printf("%-16s %8.0f ns/frame %6.1f allocations/frame %8.0f bytes/frame %6.1fx\n", results[r].name,
+               results[r].ns, (double)results[r].allocations / iterations, (double)results[r].bytes / iterations,
+               results[0].ns / results[r].ns);
+    }
+    printf("checked   mismatches=%u disagreements=%u\n", mismatches, failures);
+
+    for (size_t i = 0; i < count; ++i) {
+        free(documents[i]);
+    }
+    return mismatches || failures ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+/*
+ * Replays recorded vision messages through the ESP32 receive path and
+ * reports the time and the heap allocations each message costs. Two paths
+ * are timed for every message type:
+ *
+ *   decode   vision_replay_message, the decoders alone, as vision_bench runs
+ *            them on the ESP32
+ *   receive  process_received_data and friends, which also publish the
+ *            frame, stamp it and feed the ROI predictor
+ *
+ *   replay_bench [--captures FILE] [--iterations N] [--export DIR]
+ *
+ * --captures reads spi_capture_format lines, as spi_bench --record writes
+ * them; without it the messages of vision_corpus.h are replayed, and its
+ * malformed ones checked to be rejected. --export writes every message to a
+ * file of its own in DIR, created if need be, a seed corpus for vision_fuzz.
+ *
+ * The ESP32 code runs in this process as in spi_bench, but no master clocks
+ * its SPI task, so this thread is the only one receiving. Every message is
+ * first checked: the receive path has to publish what the decoders read.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "spi_loopback.h"
+#include "spi_protocol.h"
+#include "spi_secondary.h"
+#include "vision_corpus.h"
+
+#define BENCH_MAX_MESSAGES      4096
+#define BENCH_MAX_MESSAGE_LEN   4096
+#define BENCH_MAX_MALFORMED     64
+
+typedef struct {
+    uint8_t *data;              // NUL-terminated, as process_received_data wants it
+    size_t len;
+} bench_message_t;
+
+typedef struct {
+    const char *name;
+    bool (*replay)(const bench_message_t *message);
+} bench_path_t;
+
+static const char bench_types[] = { SPI_MSG_JSON, SPI_MSG_BINARY, SPI_MSG_DELTA };
+
+static bench_message_t messages[BENCH_MAX_MESSAGES];
+static size_t message_count;
+static bench_message_t malformed[BENCH_MAX_MALFORMED];   // Only checked, never timed
+static size_t malformed_count;
+static vision_replay_t replay;
+
+/*
+ * Every allocation made by code linked into this program goes through these,
+ * see -Wl,--wrap in CMakeLists.txt. Other threads may allocate too, hence atomic.
+ */
+static atomic_uint_fast64_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static bool replay_decode(const bench_message_t *message) {
+    vision_frame_t frame;
+    return vision_replay_message(&replay, message->data, message->len, &frame);
+}
+
+// Hands a message over the way the SPI task does once it is reassembled
+static bool replay_receive(const bench_message_t *message) {
+    if (message->data[0] == SPI_MSG_BINARY) {
+        process_binary_frame(message->data, message->len);
+    } else if (message->data[0] == SPI_MSG_DELTA) {
+        process_delta_frame(message->data, message->len);
+    } else {
+        process_received_data((char *)message->data);
+    }
+    return true;
+}
+
+static bool add_message(bench_message_t *list, size_t *count, size_t max, const char *line) {
+    uint8_t buf[BENCH_MAX_MESSAGE_LEN];
+    size_t len = spi_capture_parse(line, buf, sizeof(buf));
+    if (!len || *count == max) return false;
+    bench_message_t *message = &list[(*count)++];
+    message->data = malloc(len + 1);
+    memcpy(message->data, buf, len + 1);
+    message->len = len;
+    return true;
+}
+
+static size_t load_captures(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+    char line[2 * BENCH_MAX_MESSAGE_LEN + 2];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        ++line_number;
+        if (message_count == BENCH_MAX_MESSAGES) {
+            fprintf(stderr, "%s: only the first %d messages are replayed\n", path, BENCH_MAX_MESSAGES);
+            break;
+        }
+        if (line[0] != '\n' && !add_message(messages, &message_count, BENCH_MAX_MESSAGES, line)) {
+            fprintf(stderr, "%s: line %zu is malformed, skipped\n", path, line_number);
+        }
+    }
+    fclose(file);
+    return message_count;
+}
+
+static int export_messages(const char *dir) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    for (size_t i = 0; i < message_count + malformed_count; ++i) {
+        const bench_message_t *message = i < message_count ? &messages[i] : &malformed[i - message_count];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%03zu%c", dir, i, message->data[0]);
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+            perror(path);
+            return -1;
+        }
+        fwrite(message->data, 1, message->len, file);
+        fclose(file);
+    }
+    return 0;
+}
+
+/*
+ * Runs every message through both paths in order. The receive path has to
+ * publish exactly the frame the decoders read, and nothing when they fail.
+ */
+static uint32_t check_messages(uint32_t *failures) {
+    uint32_t mismatches = 0;
+    vision_replay_begin(&replay);
+    for (size_t i = 0; i < message_count; ++i) {
+        vision_frame_t decoded;
+        bool ok = vision_replay_message(&replay, messages[i].data, messages[i].len, &decoded);
+        spi_vision_snapshot_t before = {0}, after;
+        spi_secondary_snapshot(&before);
+        replay_receive(&messages[i]);
+        bool published = spi_secondary_snapshot(&after) && after.seq != before.seq;
+        if (!ok) {
+            ++*failures;
+            printf("message %zu (%c): does not decode\n", i, messages[i].data[0]);
+        }
+        if (ok != published || (ok && !vision_frame_equal(&decoded, &after.frame))) {
+            ++mismatches;
+            printf("message %zu (%c): the receive path %s\n", i, messages[i].data[0],
+                   ok != published ? (published ? "published it anyway" : "published nothing")
+                                   : "published another frame");
+        }
+    }
+    return mismatches;
+}
+
+// Neither path may take a malformed message for a frame
+static uint32_t check_malformed(void) {
+    uint32_t accepted = 0;
+    for (size_t i = 0; i < malformed_count; ++i) {
+        vision_frame_t decoded;
+        vision_replay_begin(&replay);
+        bool ok = vision_replay_message(&replay, malformed[i].data, malformed[i].len, &decoded);
+        spi_vision_snapshot_t before = {0}, after;
+        spi_secondary_snapshot(&before);
+        replay_receive(&malformed[i]);
+        bool published = spi_secondary_snapshot(&after) && after.seq != before.seq;
+        if (ok || published) {
+            ++accepted;
+            printf("malformed %zu (%c): %s\n", i, malformed[i].data[0],
+                   ok ? "decodes" : "the receive path published it");
+        }
+    }
+    return accepted;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--captures FILE] [--iterations N] [--export DIR]\n", name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "captures",   required_argument, NULL, 'c' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "export",     required_argument, NULL, 'e' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *captures = NULL;
+    const char *export_dir = NULL;
+    uint32_t iterations = 20000;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': captures = optarg; break;
+            case 'n': iterations = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'e': export_dir = optarg; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (captures) {
+        load_captures(captures);
+    } else {
+        for (size_t i = 0; i < vision_corpus_count; ++i) {
+            if (!add_message(messages, &message_count, BENCH_MAX_MESSAGES, vision_corpus[i])) {
+                fprintf(stderr, "vision_corpus[%zu] is malformed\n", i);
+            }
+        }
+        for (size_t i = 0; i < vision_corpus_malformed_count; ++i) {
+            if (!add_message(malformed, &malformed_count, BENCH_MAX_MALFORMED, vision_corpus_malformed[i])) {
+                fprintf(stderr, "vision_corpus_malformed[%zu] is not a capture line\n", i);
+            }
+        }
+    }
+    if (!message_count || !iterations) {
+        fprintf(stderr, "nothing to replay\n");
+        return 2;
+    }
+    if (export_dir) {
+        return export_messages(export_dir) == 0 ? 0 : 1;
+    }
+
+    // Malformed messages are counted below, not logged one by one
+    if (!getenv("ESP_LOG_LEVEL")) {
+        idf_shim_log_level = 0;
+    }
+    if (spi_loopback_start() != 0) {
+        fprintf(stderr, "loopback start failed\n");
+        return 1;
+    }
+
+    uint32_t failures = 0;
+    uint32_t mismatches = check_messages(&failures);
+    uint32_t accepted = check_malformed();
+
+    static const bench_path_t paths[] = {
+        { "decode",  replay_decode },
+        { "receive", replay_receive },
+    };
+    size_t type_counts[sizeof(bench_types)] = {0};
+    for (size_t i = 0; i < message_count; ++i) {
+        const char *type = memchr(bench_types, messages[i].data[0], sizeof(bench_types));
+        if (type) ++type_counts[type - bench_types];
+    }
+
+    printf("messages  %zu: J %zu, B %zu, D %zu; %u passes over each type\n", message_count,
+           type_counts[0], type_counts[1], type_counts[2], iterations);
+    volatile bool sink = false;
+    for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); ++p) {
+        double total_ns = 0;
+        uint64_t total_frames = 0, total_allocations = 0;
+        for (size_t t = 0; t < sizeof(bench_types); ++t) {
+            if (!type_counts[t]) continue;
+            // A pass replays the type's messages in order, so each delta follows its base
+            vision_replay_begin(&replay);
+            atomic_store(&allocations, 0);
+            double start = now_ns();
+            for (uint32_t n = 0; n < iterations; ++n) {
+                for (size_t i = 0; i < message_count; ++i) {
+                    if (messages[i].data[0] == bench_types[t]) {
+                        sink = paths[p].replay(&messages[i]);
+                    }
+                }
+            }
+            double elapsed = now_ns() - start;
+            uint64_t frames = (uint64_t)iterations * type_counts[t];
+            uint64_t allocated = atomic_load(&allocations);
+            printf("%-9s %c   %8.0f ns/frame %6.2f allocations/frame\n", paths[p].name, bench_types[t],
+                   elapsed / frames, (double)allocated / frames);
+            total_ns += elapsed;
+            total_frames += frames;
+            total_allocations += allocated;
+        }
+        printf("%-9s all %8.0f ns/frame %6.2f allocations/frame\n", paths[p].name, total_ns / total_frames,
+               (double)total_allocations / total_frames);
+    }
+    (void)sink;
+
+    spi_rx_stats_t stats;
+    spi_secondary_get_rx_stats(&stats);
+    printf("checked   mismatches=%u failures=%u accepted=%u of %zu malformed parse_failures=%u\n", mismatches,
+           failures, accepted, malformed_count, stats.parse_failures);
+
+    for (size_t i = 0; i < message_count; ++i) {
+        free(messages[i].data);
+    }
+    for (size_t i = 0; i < malformed_count; ++i) {
+        free(malformed[i].data);
+    }
+    return mismatches || failures || accepted ? 1 : 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * Drives the ESP32 receive path with synthetic vision frames and reports what
+ * it could sustain. By default the ESP32 code runs in this process behind the
+ * loopback transport; with --device the same traffic goes to a real ESP32
+ * over spidev.
+ *
+ *   spi_bench [--frames N] [--rate FPS] [--format json|binary|delta] [--size BYTES]
+ *             [--framed] [--strict] [--clock HZ] [--drop N] [--corrupt N] [--stop N]
+ *             [--device PATH] [--record FILE]
+ *
+ * --stop N slips a priority STOP (then a RELEASE) into every Nth frame.
+ * --record writes every vision message sent to FILE, one spi_capture_format
+ * line each, for replay_bench and vision_fuzz to replay.
+ *
+ * Like the Pi, JSON and delta frames only carry the fields the ESP32
+ * subscribed to; the report compares their size with all fields sent.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spi_loopback.h"
+#include "spi_master.h"
+
+#define BENCH_ARM_TIMEOUT_US    100000  // Loopback wait for the slave unless --strict
+#define BENCH_SPIDEV_CLOCK_HZ   1000000
+#define BENCH_STATS_POLLS       32
+#define BENCH_HANDSHAKE_POLLS   500
+#define BENCH_CAPTURE_AGE_US    20000   // Pretend each frame took this long from capture to sending
+#define BENCH_MAX_MESSAGE_LEN   4096
+
+typedef enum {
+    FORMAT_JSON,
+    FORMAT_BINARY,
+    FORMAT_DELTA
+} bench_format_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t rate;
+    bench_format_t format;
+    size_t size;
+    bool framed;
+    bool strict;
+    uint32_t clock_hz;
+    uint32_t drop_every;
+    uint32_t corrupt_every;
+    uint32_t stop_every;
+    const char *device;
+    const char *record;
+} bench_config_t;
+
+typedef struct {
+    spi_transport_t *inner;
+    uint32_t drop_every;
+    uint32_t corrupt_every;
+    uint32_t count;
+} faulty_ctx_t;
+
+typedef struct {
+    bool keyframe_requested;
+    uint32_t rpc_requests;
+    uint32_t roi_hints;
+    uint32_t clock_syncs;
+    uint32_t subscriptions;
+    bool handshake_answered;
+    uint32_t profile_fields;            // From the last vision profile, every field before one
+    uint32_t pipeline_fields[256];      // Subscribed fields by pipeline
+    bool subscribed[256];
+    spi_stats_page_t pages[SPI_STATS_PAGE_COUNT];
+    bool have_page[SPI_STATS_PAGE_COUNT];
+} bench_state_t;
+
+static double now_s(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Drops or corrupts every Nth chunk to reproduce link faults
+static int faulty_transfer(spi_transport_t *transport, const uint8_t *tx, uint8_t *rx, size_t len) {
+    faulty_ctx_t *ctx = transport->ctx;
+    ++ctx->count;
+    if (ctx->drop_every && ctx->count % ctx->drop_every == 0) {
+        memset(rx, 0, len);
+        return -1;
+    }
+    if (ctx->corrupt_every && ctx->count % ctx->corrupt_every == 0) {
+        uint8_t corrupted[SPI_CHUNK_SIZE];
+        memcpy(corrupted, tx, len < sizeof(corrupted) ? len : sizeof(corrupted));
+        corrupted[ctx->count % len] ^= 0x5A;
+        return ctx->inner->transfer(ctx->inner, corrupted, rx, len);
+    }
+    return ctx->inner->transfer(ctx->inner, tx, rx, len);
+}
+
+static void synthetic_frame(uint32_t i, vision_frame_t *frame) {
+    // A fiducial drifting sideways, as during alignment
+    double x = 160 + 40 * sin(i * 0.05);
+    memset(frame, 0, sizeof(*frame));
+    frame->target = VISION_TARGET_FIDUCIAL;
+    frame->pID = 6;
+    frame->v = 1;
+    frame->fID = 3;
+    frame->ta = 2.5;
+    frame->tx = (x - 160) / 8.0;
+    frame->tx_nocross = frame->tx;
+    frame->txp = x;
+    frame->ty = 1.5;
+    frame->ty_nocross = 1.5;
+    frame->typ = 120;
+    double corners[4][2] = { {x - 20, 140}, {x + 20, 140}, {x + 20, 100}, {x - 20, 100} };
+    memcpy(frame->pts, corners, sizeof(corners));
+}
+
+// Fields the Pi would put in a frame from 'pipeline', see spi_vision_subscription_t
+static uint32_t frame_fields(const bench_state_t *state, int pipeline) {
+    uint32_t fields = state->profile_fields;
+    if (pipeline >= 0 && pipeline < 256 && state->subscribed[pipeline]) {
+        fields &= state->pipeline_fields[pipeline];
+    }
+    return fields;
+}
+
+// Appends one member to a JSON document if its field is wanted
+static size_t json_member(char *buf, size_t len, size_t used, uint32_t fields, int field, const char *format,
+                          double value) {
+    if (!(fields & (1u << field)) || used >= len) return used;
+    return used + (size_t)snprintf(buf + used, len - used, format, value);
+}
+
+// Same document layout the Pi sends, with only 'fields', padded with a "pad" member up to 'size' bytes
+static size_t synthetic_json(const vision_frame_t *f, uint32_t fields, size_t size, char *buf, size_t len) {
+    size_t used = (size_t)snprintf(buf, len, "{\"ts\":%lu,\"pTYPE\":\"fiducial\"", (unsigned long)f->capture_us);
+    used = json_member(buf, len, used, fields, VISION_FIELD_PID, ",\"pID\":%.0f", f->pID);
+    used = json_member(buf, len, used, fields, VISION_FIELD_V, ",\"v\":%.0f", f->v);
+    used += (size_t)snprintf(buf + used, len - used, ",\"Fiducial\":[{\"fam\":\"36h11\"");
+    used = json_member(buf, len, used, fields, VISION_FIELD_FID, ",\"fID\":%.0f", f->fID);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TA, ",\"ta\":%.4f", f->ta);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TX, ",\"tx\":%.4f", f->tx);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TX_NOCROSS, ",\"tx_nocross\":%.4f", f->tx_nocross);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TXP, ",\"txp\":%.2f", f->txp);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TY, ",\"ty\":%.4f", f->ty);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TY_NOCROSS, ",\"ty_nocross\":%.4f", f->ty_nocross);
+    used = json_member(buf, len, used, fields, VISION_FIELD_TYP, ",\"typ\":%.2f", f->typ);
+    // Corners are positional, any wanted corner brings the whole array
+    uint32_t corners = (1u << VISION_FIELD_PT0) | (1u << VISION_FIELD_PT1) | (1u << VISION_FIELD_PT2) |
+                       (1u << VISION_FIELD_PT3);
+    if (fields & corners) {
+        used += (size_t)snprintf(buf + used, len - used, ",\"pts\":[[%.2f,%.2f],[%.2f,%.2f],[%.2f,%.2f],[%.2f,%.2f]]",
+                                 f->pts[0][0], f->pts[0][1], f->pts[1][0], f->pts[1][1],
+                                 f->pts[2][0], f->pts[2][1], f->pts[3][0], f->pts[3][1]);
+    }
+    used += (size_t)snprintf(buf + used, len - used, "}]");
+    const char *pad_open = ",\"pad\":\"";
+    if (size > used + strlen(pad_open) + 3 && size < len) {
+        used += snprintf(buf + used, len - used, "%s", pad_open);
+        while (used < size - 2) {
+            buf[used++] = 'x';
+        }
+        buf[used++] = '"';
+    }
+    buf[used++] = '}';
+    buf[used] = '\0';
+    return used;
+}
+
+static void on_command(spi_master_t *master, const char *command, void *arg) {
+    bench_state_t *state = arg;
+    uint16_t id;
+    char method;
+    const char *args;
+    spi_roi_hint_t hint;
+    spi_vision_profile_t profile;
+    spi_vision_subscription_t subscription;
+
+    if (strcmp(command, VISION_DELTA_KEYFRAME_REQUEST) == 0) {
+        state->keyframe_requested = true;
+    } else if (spi_roi_hint_parse(command, &hint)) {
+        ++state->roi_hints;
+    } else if (spi_master_parse_rpc(command, &id, &method, &args)) {
+        ++state->rpc_requests;
+        if (method == 'H') {
+            spi_link_caps_t caps = {
+                .version = SPI_PROTOCOL_VERSION,
+                .caps = SPI_CAP_BINARY | SPI_CAP_FRAMED | SPI_CAP_TELEMETRY | SPI_CAP_STATS | SPI_CAP_DELTA |
+                        SPI_CAP_VISION_RATE | SPI_CAP_ROI_HINT | SPI_CAP_CLOCK_SYNC | SPI_CAP_SUBSCRIBE,
+                .chunk_size = SPI_CHUNK_SIZE
+            };
+            char answer[48];
+            spi_link_caps_format(&caps, answer, sizeof(answer));
+            spi_master_reply(master, id, 0, answer);
+            state->handshake_answered = true;
+        } else if (method == 'C') {
+            ++state->clock_syncs;
+            spi_master_reply_clock(master, id);
+        } else if (method == 'S' && spi_vision_subscription_parse(args, &subscription)) {
+            ++state->subscriptions;
+            state->pipeline_fields[subscription.pipeline] = subscription.fields;
+            state->subscribed[subscription.pipeline] = true;
+            spi_master_reply(master, id, 0, NULL);
+        } else if (method == 'V' && spi_vision_profile_parse(args, &profile)) {
+            state->profile_fields = profile.fields;
+            spi_master_reply(master, id, 0, NULL);
+        } else {
+            spi_master_reply(master, id, 0, NULL);
+        }
+    }
+}
+
+// Appends a message to the --record file
+static void record_message(FILE *record, const uint8_t *message, size_t len) {
+    char line[2 * BENCH_MAX_MESSAGE_LEN + 2];
+    if (record && spi_capture_format(message, len, line, sizeof(line))) {
+        fprintf(record, "%s\n", line);
+    }
+}
+
+static void on_stats(spi_master_t *master, const spi_stats_page_t *page, void *arg) {
+    (void)master;
+    bench_state_t *state = arg;
+    state->pages[page->page] = *page;
+    state->have_page[page->page] = true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--frames N] [--rate FPS] [--format json|binary|delta] [--size BYTES]\n"
+            "          [--framed] [--strict] [--clock HZ] [--drop N] [--corrupt N] [--stop N]\n"
+            "          [--device PATH] [--record FILE]\n", name);
+}
+
+static int parse_args(int argc, char **argv, bench_config_t *config) {
+    static const struct option options[] = {
+        { "frames",  required_argument, NULL, 'n' },
+        { "rate",    required_argument, NULL, 'r' },
+        { "format",  required_argument, NULL, 'f' },
+        { "size",    required_argument, NULL, 's' },
+        { "framed",  no_argument,       NULL, 'F' },
+        { "strict",  no_argument,       NULL, 'S' },
+        { "clock",   required_argument, NULL, 'c' },
+        { "drop",    required_argument, NULL, 'd' },
+        { "corrupt", required_argument, NULL, 'x' },
+        { "stop",    required_argument, NULL, 'p' },
+        { "device",  required_argument, NULL, 'D' },
+        { "record",  required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'n': config->frames = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'r': config->rate = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 's': config->size = strtoul(optarg, NULL, 10); break;
+            case 'F': config->framed = true; break;
+            case 'S': config->strict = true; break;
+            case 'c': config->clock_hz = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'd': config->drop_every = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'x': config->corrupt_every = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'p': config->stop_every = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'D': config->device = optarg; break;
+            case 'o': config->record = optarg; break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    config->format = FORMAT_JSON;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    config->format = FORMAT_BINARY;
+                } else if (strcmp(optarg, "delta") == 0) {
+                    config->format = FORMAT_DELTA;
+                } else {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void print_report(const bench_config_t *config, const spi_master_t *master, const bench_state_t *state,
+                         double elapsed, size_t frame_bytes, uint64_t sent_bytes, uint64_t full_bytes) {
+    printf("sent      %u frames of %zu bytes in %.3f s: %.1f frames/s\n",
+           config->frames, frame_bytes, elapsed, config->frames / elapsed);
+    if (config->frames) {
+        printf("fields    subscriptions=%u avg=%.1f bytes/frame, %.1f with every field (%.0f%% saved)\n",
+               state->subscriptions, (double)sent_bytes / config->frames, (double)full_bytes / config->frames,
+               full_bytes ? 100.0 * (1.0 - (double)sent_bytes / full_bytes) : 0.0);
+    }
+    printf("master    chunks=%u failed=%u commands=%u telemetry=%u rpc=%u priority=%u roi_hints=%u clock_syncs=%u\n",
+           master->stats.chunks, master->stats.chunks_failed, master->stats.commands,
+           master->stats.telemetry, state->rpc_requests, master->stats.priority, state->roi_hints,
+           state->clock_syncs);
+    if (!config->device) {
+        printf("loopback  lost=%u\n", spi_loopback_lost_chunks());
+    }
+
+    if (!state->have_page[SPI_STATS_PAGE_COUNTERS]) {
+        printf("esp32     no statistics received\n");
+        return;
+    }
+    uint32_t v[SPI_STAT_COUNT];
+    memcpy(v, state->pages[SPI_STATS_PAGE_COUNTERS].values, sizeof(v));  // Packed, copy out aligned
+    printf("esp32     chunks=%u frames=%u bytes=%u parse_failures=%u dropped=%u resyncs=%u overruns=%u\n",
+           v[SPI_STAT_CHUNKS], v[SPI_STAT_FRAMES], v[SPI_STAT_BYTES], v[SPI_STAT_PARSE_FAILURES],
+           v[SPI_STAT_FRAMES_DROPPED], v[SPI_STAT_RESYNCS], v[SPI_STAT_OVERRUNS]);
+    printf("esp32     mutex_timeouts=%u max_process=%u us\n",
+           v[SPI_STAT_MUTEX_TIMEOUTS], v[SPI_STAT_MAX_PROCESS_US]);
+
+    static const char *const hist_names[SPI_STATS_PAGE_COUNT] = {
+        [SPI_STATS_PAGE_FRAME_SIZE] = "sizes",
+        [SPI_STATS_PAGE_INTERVAL] = "intervals",
+        [SPI_STATS_PAGE_PRIORITY] = "priority",
+        [SPI_STATS_PAGE_RECEIVE_LATENCY] = "receive",
+        [SPI_STATS_PAGE_PARSE_LATENCY] = "parse",
+        [SPI_STATS_PAGE_CONSUME_LATENCY] = "consume",
+        [SPI_STATS_PAGE_FRAME_AGE] = "age"
+    };
+    for (int page = SPI_STATS_PAGE_FRAME_SIZE; page < SPI_STATS_PAGE_COUNT; ++page) {
+        if (!state->have_page[page]) continue;
+        printf("%-9s", hist_names[page]);
+        for (int i = 0; i < SPI_STATS_HIST_BINS; ++i) {
+            printf(" %u", state->pages[page].values[i]);
+        }
+        printf("\n");
+    }
+    if (state->have_page[SPI_STATS_PAGE_PRIORITY]) {
+        memcpy(v, state->pages[SPI_STATS_PAGE_PRIORITY].values, sizeof(v));
+        printf("esp32     priority commands=%u max_latency=%u us\n",
+               v[SPI_PRIORITY_STAT_COMMANDS], v[SPI_PRIORITY_STAT_MAX_US]);
+    }
+    for (int page = SPI_STATS_PAGE_RECEIVE_LATENCY; page <= SPI_STATS_PAGE_FRAME_AGE; ++page) {
+        if (!state->have_page[page]) continue;
+        memcpy(v, state->pages[page].values, sizeof(v));
+        printf("esp32     %s latency frames=%u last=%u us max=%u us\n", hist_names[page],
+               v[SPI_LATENCY_STAT_FRAMES], v[SPI_LATENCY_STAT_LAST_US], v[SPI_LATENCY_STAT_MAX_US]);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_config_t config = {
+        .frames = 1000,
+        .format = FORMAT_JSON
+    };
+    if (parse_args(argc, argv, &config) != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *record = NULL;
+    if (config.record && !(record = fopen(config.record, "w"))) {
+        perror(config.record);
+        return 1;
+    }
+
+    spi_transport_t bus;
+    if (config.device) {
+        if (spi_transport_spidev(&bus, config.device, config.clock_hz ? config.clock_hz : BENCH_SPIDEV_CLOCK_HZ)) {
+            return 1;
+        }
+    } else {
+        if (spi_loopback_start() != 0 ||
+            spi_transport_loopback(&bus, config.strict ? 0 : BENCH_ARM_TIMEOUT_US, config.clock_hz) != 0) {
+            fprintf(stderr, "loopback start failed\n");
+            return 1;
+        }
+    }
+
+    faulty_ctx_t faults = { .inner = &bus, .drop_every = config.drop_every, .corrupt_every = config.corrupt_every };
+    spi_transport_t faulty = { .transfer = faulty_transfer, .ctx = &faults };
+
+    bench_state_t state = { .profile_fields = VISION_FIELDS_ALL };
+    spi_master_t master;
+    spi_master_init(&master, &faulty);
+    master.framed = config.framed;
+    master.on_command = on_command;
+    master.on_stats = on_stats;
+    master.arg = &state;
+
+    // A real ESP32 runs the handshake itself at boot; in loopback, start it and clock until it is
+    // answered and the subscriptions that follow it are in
+    if (!config.device) {
+        spi_loopback_start_handshake();
+        for (int i = 0; i < BENCH_HANDSHAKE_POLLS && (!state.handshake_answered || !state.subscriptions); ++i) {
+            spi_master_poll(&master);
+            usleep(1000);
+        }
+    }
+
+    vision_frame_t frame, reference = {0}, full_reference = {0};
+    uint16_t delta_seq = 0;
+    char json[BENCH_MAX_MESSAGE_LEN];
+    size_t frame_bytes = 0;
+    uint64_t sent_bytes = 0, full_bytes = 0;  // Frames as sent and as they would be with every field
+    double start = now_s();
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (uint32_t i = 0; i < config.frames; ++i) {
+        synthetic_frame(i, &frame);
+        frame.capture_us = (uint32_t)(spi_master_clock_us() - BENCH_CAPTURE_AGE_US);
+        if (config.stop_every && i % config.stop_every == 0) {
+            spi_master_priority(&master, (i / config.stop_every) % 2 ? SPI_PRIORITY_RELEASE : SPI_PRIORITY_STOP, 0);
+        }
+        uint32_t fields = frame_fields(&state, frame.pID);
+        if (config.format == FORMAT_JSON) {
+            full_bytes += synthetic_json(&frame, VISION_FIELDS_ALL, config.size, json, sizeof(json)) + 1;
+            frame_bytes = synthetic_json(&frame, fields, config.size, json + 1, sizeof(json) - 1) + 1;
+            spi_master_send_text(&master, SPI_MSG_JSON, json + 1);
+            json[0] = SPI_MSG_JSON;
+            record_message(record, (const uint8_t *)json, frame_bytes);
+        } else if (config.format == FORMAT_BINARY) {
+            frame_bytes = sizeof(vision_frame_bin_t);
+            full_bytes += frame_bytes;
+            spi_master_send_binary(&master, &frame);
+            if (record) {
+                uint8_t binary[sizeof(vision_frame_bin_t)];
+                record_message(record, binary, vision_frame_encode_binary(&frame, binary, sizeof(binary)));
+            }
+        } else {
+            uint8_t delta[SPI_CHUNK_SIZE];
+            bool keyframe = delta_seq % VISION_DELTA_KEYFRAME_INTERVAL == 0 || state.keyframe_requested;
+            state.keyframe_requested = false;
+            // Keep room for the header so a delta never spills into a second chunk
+            size_t room = master.framed ? sizeof(delta) - SPI_FRAME_HEADER_SIZE : sizeof(delta);
+            full_bytes += vision_frame_encode_delta(&frame, &full_reference, delta_seq, keyframe, 0.0,
+                                                    VISION_FIELDS_ALL, delta, room);
+            frame_bytes = vision_frame_encode_delta(&frame, &reference, delta_seq++, keyframe, 0.0,
+                                                    fields, delta, room);
+            spi_master_send(&master, delta, frame_bytes);
+            record_message(record, delta, frame_bytes);
+        }
+        sent_bytes += frame_bytes;
+
+        if (config.rate) {
+            long period_ns = 1000000000L / config.rate;
+            next.tv_nsec += period_ns;
+            while (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                ++next.tv_sec;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+    double elapsed = now_s() - start;
+
+    // Ask the ESP32 for its side of the story; pages arrive in the following idle chunks
+    faults.drop_every = 0;
+    faults.corrupt_every = 0;
+    spi_master_send_text(&master, SPI_MSG_STATS, "");
+    for (int i = 0; i < BENCH_STATS_POLLS && !state.have_page[SPI_STATS_PAGE_COUNT - 1]; ++i) {
+        spi_master_poll(&master);
+    }
+
+    print_report(&config, &master, &state, elapsed, frame_bytes, sent_bytes, full_bytes);
+    if (record) {
+        fclose(record);
+    }
+    if (bus.close) {
+        bus.close(&bus);
+    }
+    return 0;
+}
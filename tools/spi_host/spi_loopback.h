@@ -0,0 +1,46 @@
+/**
+ * @file spi_loopback.h
+ * @brief Host-side stand-in for the SPI bus between the Pi and the ESP32
+ *
+ * The ESP32 code (spi_secondary.c and friends) is built for the host against
+ * the headers in idf_shim/include. Its SPI slave driver calls land in
+ * idf_shim.c, where this loopback completes them with chunks from the master.
+ */
+
+#ifndef SPI_LOOPBACK_H
+#define SPI_LOOPBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Start the ESP32 side: spi_secondary_init and its SPI task
+ *
+ * @return 0 on success
+ */
+int spi_loopback_start(void);
+
+/**
+ * @brief Run spi_secondary_handshake in an ESP32 task, as the mission code does at boot
+ *
+ * The master has to keep clocking chunks for the handshake to go through.
+ */
+void spi_loopback_start_handshake(void);
+
+/**
+ * @brief Clock one chunk through the loopback bus
+ *
+ * Like the real bus, a chunk sent while the slave has no transaction armed
+ * is lost. arm_timeout_us lets the master wait for the slave instead, which
+ * measures how fast the slave can go rather than how often it falls behind.
+ *
+ * @return 0 if the slave received the chunk, -1 if it was lost
+ */
+int spi_loopback_transfer(const uint8_t *tx, uint8_t *rx, size_t len, uint32_t arm_timeout_us);
+
+/**
+ * @brief Chunks that found no armed transaction
+ */
+uint32_t spi_loopback_lost_chunks(void);
+
+#endif // SPI_LOOPBACK_H
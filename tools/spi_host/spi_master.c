@@ -0,0 +1,176 @@
+#include "spi_master.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void spi_master_init(spi_master_t *master, spi_transport_t *transport) {
+    memset(master, 0, sizeof(*master));
+    master->transport = transport;
+}
+
+uint64_t spi_master_clock_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Hands each command packed into a MISO chunk to on_command
+static void dispatch_commands(spi_master_t *master, const uint8_t *rx) {
+    char text[SPI_CHUNK_SIZE + 1];
+    memcpy(text, rx, SPI_CHUNK_SIZE);
+    text[SPI_CHUNK_SIZE] = '\0';
+
+    char *save = NULL;
+    for (char *command = strtok_r(text, "\n", &save); command; command = strtok_r(NULL, "\n", &save)) {
+        if (strcmp(command, "ACK") == 0) continue;
+        ++master->stats.commands;
+        if (master->on_command) {
+            master->on_command(master, command, master->arg);
+        }
+    }
+}
+
+int spi_master_transfer(spi_master_t *master, const uint8_t *chunk) {
+    uint8_t rx[SPI_CHUNK_SIZE];
+    ++master->stats.chunks;
+    if (master->transport->transfer(master->transport, chunk, rx, SPI_CHUNK_SIZE) != 0) {
+        ++master->stats.chunks_failed;
+        return -1;
+    }
+    master->rx_us = spi_master_clock_us();
+
+    spi_telemetry_t telemetry;
+    spi_stats_page_t page;
+    if (rx[0] == SPI_MSG_TELEMETRY && spi_telemetry_decode(rx, sizeof(rx), &telemetry)) {
+        ++master->stats.telemetry;
+        if (master->on_telemetry) {
+            master->on_telemetry(master, &telemetry, master->arg);
+        }
+    } else if (rx[0] == SPI_MSG_STATS && spi_stats_page_decode(rx, sizeof(rx), &page)) {
+        ++master->stats.stats_pages;
+        if (master->on_stats) {
+            master->on_stats(master, &page, master->arg);
+        }
+    } else if (rx[0] != 0) {
+        dispatch_commands(master, rx);
+    }
+
+    if (master->priority_pending) {
+        master->priority_pending = false;
+        ++master->stats.priority;
+        uint8_t priority[SPI_CHUNK_SIZE];
+        memcpy(priority, master->priority, sizeof(priority));
+        return spi_master_transfer(master, priority);
+    }
+    return 0;
+}
+
+// Sends the answers held back while a message was going out
+static int flush_deferred(spi_master_t *master) {
+    int ret = 0;
+    while (master->deferred_count > 0) {
+        char text[sizeof(master->deferred[0])];
+        memcpy(text, master->deferred[0], sizeof(text));
+        --master->deferred_count;
+        memmove(master->deferred[0], master->deferred[1], master->deferred_count * sizeof(master->deferred[0]));
+        ret |= spi_master_send_text(master, SPI_MSG_RPC, text);
+    }
+    return ret;
+}
+
+int spi_master_send(spi_master_t *master, const uint8_t *message, size_t len) {
+    uint8_t chunk[SPI_CHUNK_SIZE];
+    int ret = 0;
+    size_t sent = 0;
+    bool single_chunk = message[0] == SPI_MSG_BINARY || message[0] == SPI_MSG_DELTA;
+    ++master->stats.messages;
+    master->sending = true;
+
+    if (master->framed) {
+        // Header first, then the message fills the rest of this chunk and the following ones
+        memset(chunk, 0, sizeof(chunk));
+        size_t used = spi_frame_header_encode(master->seq++, (uint16_t)len, chunk, sizeof(chunk));
+        size_t n = len < sizeof(chunk) - used ? len : sizeof(chunk) - used;
+        memcpy(chunk + used, message, n);
+        sent = n;
+        ret |= spi_master_transfer(master, chunk);
+    }
+
+    while (sent < len) {
+        memset(chunk, 0, sizeof(chunk));
+        size_t n = len - sent < sizeof(chunk) ? len - sent : sizeof(chunk);
+        memcpy(chunk, message + sent, n);
+        sent += n;
+        ret |= spi_master_transfer(master, chunk);
+    }
+
+    if (!master->framed && !single_chunk) {
+        ret |= spi_master_poll(master);
+    }
+    master->sending = false;
+    return ret | flush_deferred(master);
+}
+
+int spi_master_send_text(spi_master_t *master, char type, const char *text) {
+    size_t len = strlen(text);
+    uint8_t *message = malloc(len + 1);
+    if (!message) return -1;
+    message[0] = (uint8_t)type;
+    memcpy(message + 1, text, len);
+    int ret = spi_master_send(master, message, len + 1);
+    free(message);
+    return ret;
+}
+
+int spi_master_send_binary(spi_master_t *master, const vision_frame_t *frame) {
+    uint8_t message[SPI_CHUNK_SIZE];
+    size_t len = vision_frame_encode_binary(frame, message, sizeof(message));
+    if (len == 0) return -1;
+    return spi_master_send(master, message, len);
+}
+
+void spi_master_priority(spi_master_t *master, spi_priority_command_t command, uint8_t arg) {
+    spi_priority_encode(command, arg, master->priority_seq++, master->priority, sizeof(master->priority));
+    master->priority_pending = true;
+}
+
+int spi_master_poll(spi_master_t *master) {
+    // A lone <END> closes nothing on the ESP32, so it is safe to send at any time between messages
+    uint8_t chunk[SPI_CHUNK_SIZE] = {0};
+    memcpy(chunk, SPI_MASTER_END, strlen(SPI_MASTER_END));
+    return spi_master_transfer(master, chunk);
+}
+
+int spi_master_reply(spi_master_t *master, uint16_t id, int status, const char *payload) {
+    char text[sizeof(master->deferred[0])];
+    snprintf(text, sizeof(text), "%u %d%s%s", id, status, payload && payload[0] ? " " : "", payload ? payload : "");
+    if (master->sending) {
+        if (master->deferred_count == SPI_MASTER_DEFERRED_REPLIES) return -1;
+        memcpy(master->deferred[master->deferred_count++], text, sizeof(text));
+        return 0;
+    }
+    return spi_master_send_text(master, SPI_MSG_RPC, text);
+}
+
+int spi_master_reply_clock(spi_master_t *master, uint16_t id) {
+    // Read rx_us before replying, sending the answer clocks more transfers
+    spi_clock_sample_t sample = { .pi_us = master->rx_us };
+    char answer[SPI_CHUNK_SIZE];
+    spi_clock_sample_format(&sample, answer, sizeof(answer));
+    return spi_master_reply(master, id, 0, answer);
+}
+
+bool spi_master_parse_rpc(const char *command, uint16_t *id, char *method, const char **args) {
+    if (command[0] != 'R') return false;
+
+    char *end;
+    unsigned long value = strtoul(command + 1, &end, 10);
+    if (end == command + 1 || *end != ' ' || end[1] == '\0') return false;
+
+    *id = (uint16_t)value;
+    *method = end[1];
+    *args = end[2] == ' ' ? end + 3 : end + 2;
+    return true;
+}
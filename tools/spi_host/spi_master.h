@@ -0,0 +1,123 @@
+/**
+ * @file spi_master.h
+ * @brief Reference implementation of the Pi (master) side of the SPI link
+ *
+ * Messages are a type byte followed by their body (see spi_protocol.h). They
+ * are sent CHUNK_SIZE bytes at a time, either followed by an "<END>" chunk or,
+ * in framed mode, prefixed by a spi_frame_header_t. Binary and delta frames
+ * always fit in one chunk and need neither. Every chunk clocks a chunk back
+ * on MISO, which carries commands, telemetry, stats pages or "ACK".
+ * Priority chunks (spi_priority_t) jump the queue and may land mid-message.
+ */
+
+#ifndef SPI_MASTER_H
+#define SPI_MASTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spi_protocol.h"
+#include "spi_transport.h"
+
+#define SPI_MASTER_END "<END>"
+#define SPI_MASTER_DEFERRED_REPLIES 4   // RPC answers held back while a message is going out
+
+typedef struct spi_master spi_master_t;
+
+typedef struct {
+    uint32_t chunks;            // Chunks clocked
+    uint32_t chunks_failed;     // Lost or failed transfers
+    uint32_t messages;
+    uint32_t commands;          // Commands read off MISO
+    uint32_t telemetry;
+    uint32_t stats_pages;
+    uint32_t priority;          // Priority chunks sent
+} spi_master_stats_t;
+
+struct spi_master {
+    spi_transport_t *transport;
+    bool framed;                // Prefix messages with a header instead of ending them with <END>
+    uint16_t seq;               // Next framing sequence number
+    uint16_t priority_seq;
+    bool priority_pending;
+    uint8_t priority[SPI_CHUNK_SIZE];
+    uint64_t rx_us;             // spi_master_clock_us when the last transfer ended
+    bool sending;               // A message is going out; answers wait so they do not land inside it
+    int deferred_count;
+    char deferred[SPI_MASTER_DEFERRED_REPLIES][SPI_CHUNK_SIZE * 2];
+
+    // Called for each command the ESP32 sent, RPC requests included
+    void (*on_command)(spi_master_t *master, const char *command, void *arg);
+    void (*on_telemetry)(spi_master_t *master, const spi_telemetry_t *telemetry, void *arg);
+    void (*on_stats)(spi_master_t *master, const spi_stats_page_t *page, void *arg);
+    void *arg;
+
+    spi_master_stats_t stats;
+};
+
+void spi_master_init(spi_master_t *master, spi_transport_t *transport);
+
+/**
+ * @brief The master's clock in microseconds, for capture times and clock sync answers
+ */
+uint64_t spi_master_clock_us(void);
+
+/**
+ * @brief Clock one raw chunk and dispatch whatever came back on MISO
+ *
+ * @return 0 on success, -1 if the transport failed
+ */
+int spi_master_transfer(spi_master_t *master, const uint8_t *chunk);
+
+/**
+ * @brief Send a message, type byte included
+ *
+ * @return 0 if every chunk went out, -1 otherwise
+ */
+int spi_master_send(spi_master_t *master, const uint8_t *message, size_t len);
+
+/**
+ * @brief Send a text message such as SPI_MSG_JSON or SPI_MSG_TEXT
+ */
+int spi_master_send_text(spi_master_t *master, char type, const char *text);
+
+int spi_master_send_binary(spi_master_t *master, const vision_frame_t *frame);
+
+/**
+ * @brief Queue a priority command to go out right after the chunk being clocked
+ *
+ * Call it before spi_master_send to have it land between the first chunks of
+ * that message, or follow it with spi_master_poll to send it on its own.
+ */
+void spi_master_priority(spi_master_t *master, spi_priority_command_t command, uint8_t arg);
+
+/**
+ * @brief Clock a chunk with no message in it, only to read MISO
+ */
+int spi_master_poll(spi_master_t *master);
+
+/**
+ * @brief Answer an RPC request ("R<id> <method> <args>") from the ESP32
+ *
+ * Called from on_command while a message is going out, the answer is sent
+ * right after that message. Answers that do not fit the queue are dropped;
+ * the ESP32 resends the request.
+ */
+int spi_master_reply(spi_master_t *master, uint16_t id, int status, const char *payload);
+
+/**
+ * @brief Answer an SPI_RPC_CLOCK request, from on_command
+ *
+ * The answer carries rx_us, the end of the transfer the request came back in.
+ */
+int spi_master_reply_clock(spi_master_t *master, uint16_t id);
+
+/**
+ * @brief Split an RPC request into its id, method and arguments
+ *
+ * @return true if command is an RPC request
+ */
+bool spi_master_parse_rpc(const char *command, uint16_t *id, char *method, const char **args);
+
+#endif // SPI_MASTER_H
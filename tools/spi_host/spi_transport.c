@@ -0,0 +1,78 @@
+#include "spi_transport.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/spi/spidev.h>
+#endif
+
+typedef struct {
+    int fd;
+    uint32_t clock_hz;
+} spidev_ctx_t;
+
+#ifdef __linux__
+static int spidev_transfer(spi_transport_t *transport, const uint8_t *tx, uint8_t *rx, size_t len) {
+    spidev_ctx_t *ctx = transport->ctx;
+    struct spi_ioc_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.tx_buf = (uintptr_t)tx;
+    transfer.rx_buf = (uintptr_t)rx;
+    transfer.len = (uint32_t)len;
+    transfer.speed_hz = ctx->clock_hz;
+    transfer.bits_per_word = 8;
+    return ioctl(ctx->fd, SPI_IOC_MESSAGE(1), &transfer) < 0 ? -1 : 0;
+}
+
+static void spidev_close(spi_transport_t *transport) {
+    spidev_ctx_t *ctx = transport->ctx;
+    if (ctx) {
+        close(ctx->fd);
+    }
+    free(ctx);
+    transport->ctx = NULL;
+}
+
+int spi_transport_spidev(spi_transport_t *transport, const char *device, uint32_t clock_hz) {
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+
+    // Mode 0, matching spi_secondary_init
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 || ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &clock_hz) < 0) {
+        perror("spidev setup");
+        close(fd);
+        return -1;
+    }
+
+    spidev_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        close(fd);
+        return -1;
+    }
+    ctx->fd = fd;
+    ctx->clock_hz = clock_hz;
+
+    transport->transfer = spidev_transfer;
+    transport->close = spidev_close;
+    transport->ctx = ctx;
+    return 0;
+}
+#else
+int spi_transport_spidev(spi_transport_t *transport, const char *device, uint32_t clock_hz) {
+    (void)transport;
+    (void)clock_hz;
+    fprintf(stderr, "%s: spidev is only available on Linux\n", device);
+    return -1;
+}
+#endif
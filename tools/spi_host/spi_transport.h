@@ -0,0 +1,36 @@
+/**
+ * @file spi_transport.h
+ * @brief Full-duplex chunk transfer used by the reference master
+ */
+
+#ifndef SPI_TRANSPORT_H
+#define SPI_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct spi_transport {
+    /**
+     * @brief Clock len bytes out on MOSI while reading len bytes from MISO
+     *
+     * @return 0 on success, -1 if the chunk was lost or the bus failed
+     */
+    int (*transfer)(struct spi_transport *transport, const uint8_t *tx, uint8_t *rx, size_t len);
+    void (*close)(struct spi_transport *transport);
+    void *ctx;
+} spi_transport_t;
+
+/**
+ * @brief Transport that talks to the host build of the ESP32 code, see spi_loopback.h
+ *
+ * @param arm_timeout_us How long a chunk waits for the slave to arm a transaction
+ * @param clock_hz Simulated bus clock, each transfer takes len * 8 / clock_hz; 0 for no delay
+ */
+int spi_transport_loopback(spi_transport_t *transport, uint32_t arm_timeout_us, uint32_t clock_hz);
+
+/**
+ * @brief Transport over a Linux spidev device, e.g. /dev/spidev0.0 on the Pi
+ */
+int spi_transport_spidev(spi_transport_t *transport, const char *device, uint32_t clock_hz);
+
+#endif // SPI_TRANSPORT_H
@@ -0,0 +1,39 @@
+#include "spi_transport.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "spi_loopback.h"
+
+typedef struct {
+    uint32_t arm_timeout_us;
+    uint32_t clock_hz;
+} loopback_ctx_t;
+
+static int loopback_transfer(spi_transport_t *transport, const uint8_t *tx, uint8_t *rx, size_t len) {
+    loopback_ctx_t *ctx = transport->ctx;
+    if (ctx->clock_hz) {
+        // Hold the bus for as long as the real clock would
+        uint64_t ns = (uint64_t)len * 8 * 1000000000ull / ctx->clock_hz;
+        struct timespec delay = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+        nanosleep(&delay, NULL);
+    }
+    return spi_loopback_transfer(tx, rx, len, ctx->arm_timeout_us);
+}
+
+static void free_ctx(spi_transport_t *transport) {
+    free(transport->ctx);
+    transport->ctx = NULL;
+}
+
+int spi_transport_loopback(spi_transport_t *transport, uint32_t arm_timeout_us, uint32_t clock_hz) {
+    loopback_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return -1;
+    ctx->arm_timeout_us = arm_timeout_us;
+    ctx->clock_hz = clock_hz;
+
+    transport->transfer = loopback_transfer;
+    transport->close = free_ctx;
+    transport->ctx = ctx;
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Fuzz target for the ESP32 receive path. Each input is one message as the
+ * SPI task hands it on once its chunks are reassembled, type byte first, and
+ * goes through:
+ *
+ *   - the binary, delta and JSON decoders, whatever its type byte says;
+ *   - the JSON stream decoder fed a byte at a time and in pieces the input
+ *     picks, which has to read what it reads from the whole document;
+ *   - spi_capture_format and spi_capture_parse, which have to round-trip it;
+ *   - process_received_data, process_binary_frame or process_delta_frame,
+ *     picked by type byte as the SPI task does.
+ *
+ * Built with Clang, this is a libFuzzer binary:
+ *
+ *   vision_fuzz [libFuzzer options] CORPUS_DIR [SEED_DIR...]
+ *
+ * Other compilers build a driver that runs the files it is given, or every
+ * message of vision_corpus.h, under AddressSanitizer and
+ * UndefinedBehaviorSanitizer; that reproduces what libFuzzer found:
+ *
+ *   vision_fuzz [FILE|DIR...]
+ *
+ * replay_bench --export DIR writes vision_corpus.h out as seed files; libFuzzer
+ * wants CORPUS_DIR to exist already.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "spi_loopback.h"
+#include "spi_protocol.h"
+#include "spi_secondary.h"
+#include "vision_corpus.h"
+
+#define FUZZ_MAX_MESSAGE_LEN    4096
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static bool same_tags(const vision_tags_t *a, const vision_tags_t *b) {
+    if (a->count != b->count) return false;
+    for (int i = 0; i < VISION_MAX_TAGS; ++i) {
+        if (!vision_frame_equal(&a->slots[i], &b->slots[i])) return false;
+    }
+    return true;
+}
+
+// Decodes the document in pieces of at most 'step' bytes and checks it against 'whole'
+static void check_json_pieces(const char *json, size_t len, size_t step, const vision_json_stream_t *whole,
+                              bool whole_ok, const vision_frame_t *whole_frame) {
+    static vision_json_stream_t pieces;
+    vision_json_stream_begin(&pieces);
+    for (size_t at = 0; at < len; at += step) {
+        vision_json_stream_feed(&pieces, json + at, len - at < step ? len - at : step);
+    }
+    vision_frame_t frame;
+    bool ok = vision_json_stream_finish(&pieces, &frame);
+    bool same = ok == whole_ok && (!ok || (vision_frame_equal(&frame, whole_frame) &&
+                                           same_tags(&pieces.tags, &whole->tags)));
+    if (!same) {
+        fprintf(stderr, "JSON decoded differently in pieces of %zu bytes: %s whole, %s in pieces\n", step,
+                whole_ok ? "took" : "rejected", ok ? "took" : "rejected");
+        abort();
+    }
+
+    // Every tag filed has to be found where it was filed
+    for (int i = 0; ok && i < VISION_MAX_TAGS; ++i) {
+        const vision_frame_t *slot = &pieces.tags.slots[i];
+        if (slot->valid && vision_tags_find(&pieces.tags, slot->fID) != slot) {
+            fprintf(stderr, "tag %d not found in slot %d\n", slot->fID, i);
+            abort();
+        }
+    }
+}
+
+static void check_json(const uint8_t *data, size_t size) {
+    const char *json = (const char *)data;
+    size_t len = size;
+    if (data[0] == SPI_MSG_JSON) {
+        ++json;
+        --len;
+    }
+
+    static vision_json_stream_t whole;
+    vision_frame_t frame;
+    vision_json_stream_begin(&whole);
+    vision_json_stream_feed(&whole, json, len);
+    bool ok = vision_json_stream_finish(&whole, &frame);
+
+    check_json_pieces(json, len, 1, &whole, ok, &frame);
+    check_json_pieces(json, len, 1 + data[size - 1] % SPI_CHUNK_SIZE, &whole, ok, &frame);
+}
+
+static void check_binary(const uint8_t *data, size_t size) {
+    vision_frame_t frame;
+    vision_frame_decode_binary(data, size, &frame);
+
+    // Once as if the base frame were lost, once with the state the delta says it applies to
+    static vision_frame_t state;
+    uint16_t seq = 0;
+    vision_frame_apply_delta(data, size, &state, &seq, false, VISION_FIELDS_ALL);
+    vision_delta_header_t header;
+    if (size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        seq = (uint16_t)(header.seq - header.back);
+    }
+    vision_frame_apply_delta(data, size, &state, &seq, true, VISION_FIELDS_ALL);
+}
+
+static void check_capture(const uint8_t *data, size_t size) {
+    static char line[2 * FUZZ_MAX_MESSAGE_LEN + 2];
+    static uint8_t parsed[FUZZ_MAX_MESSAGE_LEN + 1];
+    if (!spi_capture_format(data, size, line, sizeof(line))) return;
+    size_t len = spi_capture_parse(line, parsed, sizeof(parsed));
+    if (len != size || memcmp(parsed, data, size) != 0) {
+        fprintf(stderr, "capture line did not parse back: %s\n", line);
+        abort();
+    }
+}
+
+// What the SPI task does with a reassembled message
+static void check_receive(const uint8_t *data, size_t size) {
+    static char message[FUZZ_MAX_MESSAGE_LEN + 1];
+    memcpy(message, data, size);
+    message[size] = '\0';
+    if (message[0] == SPI_MSG_BINARY) {
+        process_binary_frame((const uint8_t *)message, size);
+    } else if (message[0] == SPI_MSG_DELTA) {
+        process_delta_frame((const uint8_t *)message, size);
+    } else {
+        process_received_data(message);
+    }
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void)argc;
+    (void)argv;
+    // Malformed messages are the point here, keep their errors quiet
+    if (!getenv("ESP_LOG_LEVEL")) {
+        idf_shim_log_level = 0;
+    }
+    // Nothing clocks the SPI task, so the fuzzing thread is the only one receiving
+    if (spi_loopback_start() != 0) {
+        fprintf(stderr, "loopback start failed\n");
+        abort();
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0 || size > FUZZ_MAX_MESSAGE_LEN) return 0;
+
+    check_json(data, size);
+    check_binary(data, size);
+    check_capture(data, size);
+    check_receive(data, size);
+    return 0;
+}
+
+#ifdef VISION_FUZZ_REPLAY
+
+static int run_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    static uint8_t data[FUZZ_MAX_MESSAGE_LEN + 1];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+// Runs a file, or every file in a directory
+static int run_path(const char *path, uint32_t *runs) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        ++*runs;
+        return run_file(path);
+    }
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        ++*runs;
+        if (run_file(child) != 0) result = -1;
+    }
+    closedir(dir);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    uint32_t runs = 0;
+    int result = 0;
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            if (run_path(argv[i], &runs) != 0) result = 1;
+        }
+    } else {
+        for (size_t i = 0; i < vision_corpus_count + vision_corpus_malformed_count; ++i) {
+            const char *line = i < vision_corpus_count ? vision_corpus[i]
+                                                       : vision_corpus_malformed[i - vision_corpus_count];
+            uint8_t message[FUZZ_MAX_MESSAGE_LEN + 1];
+            size_t len = spi_capture_parse(line, message, sizeof(message));
+            if (len) {
+                LLVMFuzzerTestOneInput(message, len);
+                ++runs;
+            }
+        }
+    }
+    printf("ran %u inputs\n", runs);
+    return result;
+}
+
+#endif // VISION_FUZZ_REPLAY